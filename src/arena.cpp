@@ -0,0 +1,80 @@
+#include "arena.h"
+
+#include <algorithm>
+#include <cstdint>
+
+namespace {
+
+thread_local Arena* current_arena = nullptr;
+
+}
+
+std::unique_lock<std::mutex> ArenaState::lock() {
+    if (ownership == Arena::Ownership::Shared) {
+        return std::unique_lock<std::mutex>(mutex);
+    }
+    return std::unique_lock<std::mutex>(mutex, std::defer_lock);
+}
+
+void* ArenaState::allocate(std::size_t bytes, std::size_t alignment) {
+    auto guard = lock();
+    auto aligned = [alignment](std::byte* p) {
+        auto address = reinterpret_cast<std::uintptr_t>(p);
+        return reinterpret_cast<std::byte*>((address + alignment - 1) & ~(alignment - 1));
+    };
+    std::byte* start = cursor ? aligned(cursor) : nullptr;
+    if (!start || start + bytes > end) {
+        std::size_t size = std::max(block_size, bytes + alignment);
+        blocks.emplace_back(new std::byte[size]);
+        cursor = blocks.back().get();
+        end = cursor + size;
+        start = aligned(cursor);
+    }
+    cursor = start + bytes;
+    allocations++;
+    bytes_used += bytes;
+    references.fetch_add(1, std::memory_order_relaxed);
+    return start;
+}
+
+void ArenaState::release(ArenaState* state) {
+    if (state->references.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        delete state;
+    }
+}
+
+Arena::Arena(Ownership ownership, std::size_t block_size) : state_(new ArenaState()) {
+    state_->ownership = ownership;
+    state_->block_size = block_size;
+}
+
+Arena::~Arena() {
+    ArenaState::release(state_);
+}
+
+std::size_t Arena::allocations() const {
+    auto guard = state_->lock();
+    return state_->allocations;
+}
+
+std::size_t Arena::bytes_used() const {
+    auto guard = state_->lock();
+    return state_->bytes_used;
+}
+
+std::size_t Arena::blocks() const {
+    auto guard = state_->lock();
+    return state_->blocks.size();
+}
+
+Arena* Arena::current() {
+    return current_arena;
+}
+
+ArenaScope::ArenaScope(Arena& arena) : previous_(current_arena) {
+    current_arena = &arena;
+}
+
+ArenaScope::~ArenaScope() {
+    current_arena = previous_;
+}
@@ -0,0 +1,116 @@
+#ifndef EXPRESSION_ARENA_H
+#define EXPRESSION_ARENA_H
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+struct ArenaState;
+
+// Bump allocator for expression nodes. While an ArenaScope is active on a
+// thread, every node built on that thread (by the operators, sin/cos/exp/ln,
+// diff, substitute and simplify) is carved out of the arena's blocks instead
+// of getting its own heap allocation. Individual frees only drop a reference
+// count; the blocks are released together once the Arena and every node
+// allocated from it are gone.
+//
+// Nodes are hash-consed in a process-wide table, so a node allocated here is
+// handed to any expression, on any thread, that builds the same structure;
+// the constants 0 and 1 made by diff() are typical. Each such node pins all
+// of the arena's blocks until its last reference is dropped.
+class Arena {
+public:
+    enum class Ownership {
+        // Allocation is guarded by a mutex, nodes may be built on several
+        // threads.
+        Shared,
+        // Allocation takes no lock; only one thread may build nodes in the
+        // arena. The reference count stays atomic, since interned nodes can
+        // be dropped on any thread.
+        UnlockedAllocation
+    };
+
+    explicit Arena(Ownership ownership = Ownership::Shared, std::size_t block_size = 64 * 1024);
+    ~Arena();
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    std::size_t allocations() const;
+    std::size_t bytes_used() const;
+    std::size_t blocks() const;
+
+    // Arena that nodes built on the calling thread currently go to, if any.
+    static Arena* current();
+
+private:
+    ArenaState* state_;
+    template <typename U>
+    friend class ArenaAllocator;
+};
+
+struct ArenaState {
+    Arena::Ownership ownership;
+    std::size_t block_size;
+    std::vector<std::unique_ptr<std::byte[]>> blocks;
+    std::byte* cursor = nullptr;
+    std::byte* end = nullptr;
+    std::size_t allocations = 0;
+    std::size_t bytes_used = 0;
+    // Live allocations plus one for the Arena object itself.
+    std::atomic<std::size_t> references{1};
+    std::mutex mutex;
+
+    // Holds the mutex in Shared mode, and nothing otherwise.
+    std::unique_lock<std::mutex> lock();
+    void* allocate(std::size_t bytes, std::size_t alignment);
+    // Drops one reference and frees the state with its blocks on the last one.
+    static void release(ArenaState* state);
+};
+
+// Makes `arena` the destination of node allocations on this thread until the
+// scope ends. Scopes nest.
+class ArenaScope {
+public:
+    explicit ArenaScope(Arena& arena);
+    ~ArenaScope();
+    ArenaScope(const ArenaScope&) = delete;
+    ArenaScope& operator=(const ArenaScope&) = delete;
+
+private:
+    Arena* previous_;
+};
+
+// Standard allocator over an Arena, used with std::allocate_shared.
+template <typename U>
+class ArenaAllocator {
+public:
+    using value_type = U;
+
+    explicit ArenaAllocator(const Arena& arena) : state_(arena.state_) {}
+    template <typename V>
+    ArenaAllocator(const ArenaAllocator<V>& other) : state_(other.state_) {}
+
+    U* allocate(std::size_t n) {
+        return static_cast<U*>(state_->allocate(n * sizeof(U), alignof(U)));
+    }
+
+    void deallocate(U* pointer, std::size_t n) {
+        (void) pointer;
+        (void) n;
+        ArenaState::release(state_);
+    }
+
+    template <typename V>
+    bool operator==(const ArenaAllocator<V>& other) const {
+        return state_ == other.state_;
+    }
+
+private:
+    ArenaState* state_;
+    template <typename V>
+    friend class ArenaAllocator;
+};
+
+#endif //EXPRESSION_ARENA_H
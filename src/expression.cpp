@@ -1,4 +1,7 @@
 #include "expression.h"
+#include "kernels.h"
+#include "arena.h"
+#include "profile.h"
 
 #include <iostream>
 #include <string>
@@ -6,224 +9,2644 @@
 #include <string>
 #include <memory>
 #include <complex>
+#include <array>
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <mutex>
+#include <deque>
+#include <optional>
+#include <sstream>
+#include <charconv>
+#include <ostream>
+
+static_assert(static_cast<std::size_t>(OpCode::Ln) + 1 == profile_kind_count);
+
+template <typename T>
+T apply_binary(OpCode op, T a, T b) {
+    switch (op) {
+        case OpCode::Add: return a + b;
+        case OpCode::Sub: return a - b;
+        case OpCode::Mul: return a * b;
+        case OpCode::Div: return a / b;
+        case OpCode::Pow: return pow(a, b);
+        default: throw std::runtime_error("Unknown operation code");
+    }
+}
+
+template <typename T>
+T apply_unary(OpCode op, T a) {
+    switch (op) {
+        case OpCode::Sin: return std::sin(a);
+        case OpCode::Cos: return std::cos(a);
+        case OpCode::Ln: return std::log(a);
+        case OpCode::Exp: return std::exp(a);
+        default: throw std::runtime_error("Unknown operation code");
+    }
+}
+
+inline OpCode binary_opcode(char op) {
+    switch (op) {
+        case '+': return OpCode::Add;
+        case '-': return OpCode::Sub;
+        case '*': return OpCode::Mul;
+        case '/': return OpCode::Div;
+        case '^': return OpCode::Pow;
+        default: throw std::runtime_error(std::string("Unknown operation: ") + op);
+    }
+}
+
+inline OpCode unary_opcode(const std::string& op) {
+    if (op == "sin") return OpCode::Sin;
+    if (op == "cos") return OpCode::Cos;
+    if (op == "ln") return OpCode::Ln;
+    if (op == "exp") return OpCode::Exp;
+    throw std::runtime_error("Unknown function: " + op);
+}
+
+inline char binary_symbol(OpCode op) {
+    switch (op) {
+        case OpCode::Add: return '+';
+        case OpCode::Sub: return '-';
+        case OpCode::Mul: return '*';
+        case OpCode::Div: return '/';
+        case OpCode::Pow: return '^';
+        default: throw std::runtime_error("Unknown operation code");
+    }
+}
+
+inline std::string unary_name(OpCode op) {
+    switch (op) {
+        case OpCode::Sin: return "sin";
+        case OpCode::Cos: return "cos";
+        case OpCode::Ln: return "ln";
+        case OpCode::Exp: return "exp";
+        default: throw std::runtime_error("Unknown operation code");
+    }
+}
+
+inline bool is_binary(OpCode op) {
+    return op >= OpCode::Add && op <= OpCode::Pow;
+}
+
+inline VariableSet::VariableSet(std::uint32_t id) {
+    if (id < 64) {
+        low_ = std::uint64_t(1) << id;
+    } else {
+        high_.resize((id - 64) / 64 + 1);
+        high_.back() = std::uint64_t(1) << (id % 64);
+    }
+}
+
+inline bool VariableSet::contains(std::uint32_t id) const {
+    if (id < 64) {
+        return (low_ >> id) & 1;
+    }
+    std::size_t word = (id - 64) / 64;
+    return word < high_.size() && ((high_[word] >> (id % 64)) & 1);
+}
+
+inline bool VariableSet::empty() const {
+    return low_ == 0 && high_.empty();
+}
+
+inline bool VariableSet::intersects(const VariableSet& other) const {
+    if (low_ & other.low_) {
+        return true;
+    }
+    for (std::size_t i = 0; i < std::min(high_.size(), other.high_.size()); i++) {
+        if (high_[i] & other.high_[i]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+inline VariableSet& VariableSet::operator|=(const VariableSet& other) {
+    low_ |= other.low_;
+    if (high_.size() < other.high_.size()) {
+        high_.resize(other.high_.size());
+    }
+    for (std::size_t i = 0; i < other.high_.size(); i++) {
+        high_[i] |= other.high_[i];
+    }
+    return *this;
+}
+
+inline std::vector<std::uint32_t> VariableSet::ids() const {
+    std::vector<std::uint32_t> result;
+    for (std::uint32_t id = 0; id < 64; id++) {
+        if ((low_ >> id) & 1) {
+            result.push_back(id);
+        }
+    }
+    for (std::size_t word = 0; word < high_.size(); word++) {
+        for (std::uint32_t bit = 0; bit < 64; bit++) {
+            if ((high_[word] >> bit) & 1) {
+                result.push_back(static_cast<std::uint32_t>(64 + word * 64 + bit));
+            }
+        }
+    }
+    return result;
+}
+
+inline bool is_operation(OpCode op) {
+    return op != OpCode::Constant && op != OpCode::Variable;
+}
+
+template <typename T, std::size_t K>
+T Taylor<T, K>::derivative(std::size_t order) const {
+    T factorial(1);
+    for (std::size_t i = 2; i <= order; i++) {
+        factorial *= T(static_cast<double>(i));
+    }
+    return c[order] * factorial;
+}
+
+template <typename T, std::size_t K>
+Taylor<T, K> operator+(const Taylor<T, K>& a, const Taylor<T, K>& b) {
+    Taylor<T, K> r;
+    for (std::size_t k = 0; k <= K; k++) {
+        r.c[k] = a.c[k] + b.c[k];
+    }
+    return r;
+}
+
+template <typename T, std::size_t K>
+Taylor<T, K> operator-(const Taylor<T, K>& a, const Taylor<T, K>& b) {
+    Taylor<T, K> r;
+    for (std::size_t k = 0; k <= K; k++) {
+        r.c[k] = a.c[k] - b.c[k];
+    }
+    return r;
+}
+
+template <typename T, std::size_t K>
+Taylor<T, K> operator*(const Taylor<T, K>& a, const Taylor<T, K>& b) {
+    Taylor<T, K> r;
+    for (std::size_t k = 0; k <= K; k++) {
+        for (std::size_t i = 0; i <= k; i++) {
+            r.c[k] += a.c[i] * b.c[k - i];
+        }
+    }
+    return r;
+}
+
+template <typename T, std::size_t K>
+Taylor<T, K> operator/(const Taylor<T, K>& a, const Taylor<T, K>& b) {
+    Taylor<T, K> r;
+    for (std::size_t k = 0; k <= K; k++) {
+        T sum = a.c[k];
+        for (std::size_t i = 1; i <= k; i++) {
+            sum -= b.c[i] * r.c[k - i];
+        }
+        r.c[k] = sum / b.c[0];
+    }
+    return r;
+}
+
+template <typename T, std::size_t K>
+Taylor<T, K> exp(const Taylor<T, K>& a) {
+    Taylor<T, K> r;
+    r.c[0] = std::exp(a.c[0]);
+    for (std::size_t k = 1; k <= K; k++) {
+        for (std::size_t j = 1; j <= k; j++) {
+            r.c[k] += T(static_cast<double>(j)) * a.c[j] * r.c[k - j];
+        }
+        r.c[k] /= T(static_cast<double>(k));
+    }
+    return r;
+}
+
+template <typename T, std::size_t K>
+Taylor<T, K> ln(const Taylor<T, K>& a) {
+    Taylor<T, K> r;
+    r.c[0] = std::log(a.c[0]);
+    for (std::size_t k = 1; k <= K; k++) {
+        T sum(0);
+        for (std::size_t j = 1; j < k; j++) {
+            sum += T(static_cast<double>(j)) * r.c[j] * a.c[k - j];
+        }
+        r.c[k] = (a.c[k] - sum / T(static_cast<double>(k))) / a.c[0];
+    }
+    return r;
+}
+
+template <typename T, std::size_t K>
+void sincos(const Taylor<T, K>& a, Taylor<T, K>& s, Taylor<T, K>& c) {
+    s = Taylor<T, K>();
+    c = Taylor<T, K>();
+    s.c[0] = std::sin(a.c[0]);
+    c.c[0] = std::cos(a.c[0]);
+    for (std::size_t k = 1; k <= K; k++) {
+        for (std::size_t j = 1; j <= k; j++) {
+            T weight = T(static_cast<double>(j)) * a.c[j];
+            s.c[k] += weight * c.c[k - j];
+            c.c[k] -= weight * s.c[k - j];
+        }
+        s.c[k] /= T(static_cast<double>(k));
+        c.c[k] /= T(static_cast<double>(k));
+    }
+}
+
+template <typename T, std::size_t K>
+Taylor<T, K> sin(const Taylor<T, K>& a) {
+    Taylor<T, K> s, c;
+    sincos(a, s, c);
+    return s;
+}
+
+template <typename T, std::size_t K>
+Taylor<T, K> cos(const Taylor<T, K>& a) {
+    Taylor<T, K> s, c;
+    sincos(a, s, c);
+    return c;
+}
+
+// A constant exponent uses the recurrence for a^e, which, unlike
+// exp(e * ln(a)), also works for negative bases. A varying exponent is
+// expanded through exp and ln.
+template <typename T, std::size_t K>
+Taylor<T, K> pow(const Taylor<T, K>& a, const Taylor<T, K>& b) {
+    bool constant_exponent = true;
+    for (std::size_t k = 1; k <= K; k++) {
+        constant_exponent = constant_exponent && b.c[k] == T(0);
+    }
+    if (!constant_exponent) {
+        Taylor<T, K> r = exp(b * ln(a));
+        r.c[0] = apply_binary(OpCode::Pow, a.c[0], b.c[0]);
+        return r;
+    }
+    const T e = b.c[0];
+    Taylor<T, K> r;
+    r.c[0] = apply_binary(OpCode::Pow, a.c[0], e);
+    if (a.c[0] == T(0)) {
+        if constexpr (!std::is_same_v<T, std::complex<double>>) {
+            if (e >= T(0) && e == std::trunc(e) && e <= T(64)) {
+                Taylor<T, K> one;
+                one.c[0] = T(1);
+                r = one;
+                for (int i = 0; i < static_cast<int>(e); i++) {
+                    r = r * a;
+                }
+                return r;
+            }
+        }
+    }
+    for (std::size_t k = 1; k <= K; k++) {
+        T sum(0);
+        for (std::size_t j = 1; j <= k; j++) {
+            sum += (e * T(static_cast<double>(j)) - T(static_cast<double>(k - j))) * a.c[j] * r.c[k - j];
+        }
+        r.c[k] = sum / (T(static_cast<double>(k)) * a.c[0]);
+    }
+    return r;
+}
+
+// Structural key of an operation or constant node. Children are already
+// interned, so they are compared by identity; constants are compared bit for
+// bit. Variables are interned by name separately.
+struct NodeKey {
+    OpCode op;
+    const void* left;
+    const void* right;
+    std::uint64_t bits[2];
+    bool operator==(const NodeKey& other) const = default;
+};
+
+struct NodeKeyHash {
+    std::size_t operator()(const NodeKey& key) const {
+        std::size_t h = std::hash<int>()(static_cast<int>(key.op));
+        auto mix = [&h](std::size_t v) { h ^= v + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2); };
+        mix(std::hash<const void*>()(key.left));
+        mix(std::hash<const void*>()(key.right));
+        mix(std::hash<std::uint64_t>()(key.bits[0]));
+        mix(std::hash<std::uint64_t>()(key.bits[1]));
+        // std::hash is the identity for pointers and integers; finish with a
+        // full avalanche so that linear probing sees well spread slots.
+        std::uint64_t z = h;
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return static_cast<std::size_t>(z ^ (z >> 31));
+    }
+};
+
+// Open-addressing table of the live interned nodes. A node registers itself
+// when it is created and unregisters from its destructor, so the table never
+// holds stale entries and interning costs no allocation per node. Slots hold
+// plain pointers; a slot whose node is already being destroyed is simply
+// taken over by the replacement. Hash 0 marks an empty slot.
+template <typename T>
+class NodeTable {
+private:
+    struct Slot {
+        std::size_t hash = 0;
+        NodeKey key{};
+        Node<T>* node = nullptr;
+    };
+    std::vector<Slot> slots_ = std::vector<Slot>(1024);
+    std::size_t used_ = 0;
+    std::unordered_map<std::string, Node<T>*> variables_;
+    // Variable ids are never reused, so dependency sets stay valid for as long
+    // as the nodes holding them.
+    std::unordered_map<std::string, std::uint32_t> variable_ids_;
+    std::deque<std::string> variable_names_;
+    std::mutex mutex_;
+
+    void grow() {
+        std::vector<Slot> old(slots_.size() * 2);
+        old.swap(slots_);
+        const std::size_t mask = slots_.size() - 1;
+        for (const Slot& slot : old) {
+            if (!slot.hash) {
+                continue;
+            }
+            std::size_t i = slot.hash & mask;
+            while (slots_[i].hash) {
+                i = (i + 1) & mask;
+            }
+            slots_[i] = slot;
+        }
+    }
+
+    // Backward-shift deletion keeps every probe sequence free of holes.
+    void remove(std::size_t i) {
+        const std::size_t mask = slots_.size() - 1;
+        std::size_t j = i;
+        while (true) {
+            j = (j + 1) & mask;
+            if (!slots_[j].hash) {
+                break;
+            }
+            std::size_t home = slots_[j].hash & mask;
+            bool stays = i <= j ? (i < home && home <= j) : (i < home || home <= j);
+            if (!stays) {
+                slots_[i] = slots_[j];
+                i = j;
+            }
+        }
+        slots_[i] = Slot{};
+        used_--;
+    }
+
+    // Callers hold mutex_.
+    std::uint32_t intern_name(const std::string& name) {
+        auto [it, inserted] = variable_ids_.emplace(name, static_cast<std::uint32_t>(variable_names_.size()));
+        if (inserted) {
+            variable_names_.push_back(name);
+        }
+        return it->second;
+    }
+public:
+    // Never destroyed, so nodes released during static destruction can
+    // still unregister.
+    static NodeTable& instance() {
+        static NodeTable* table = new NodeTable();
+        return *table;
+    }
+
+    template <typename Make>
+    std::shared_ptr<Node<T>> intern(const NodeKey& key, Make make) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        const std::size_t hash = NodeKeyHash()(key) | 1;
+        const std::size_t mask = slots_.size() - 1;
+        std::size_t i = hash & mask;
+        while (slots_[i].hash) {
+            Slot& slot = slots_[i];
+            if (slot.hash == hash && slot.key == key) {
+                if (auto node = slot.node->weak_from_this().lock()) {
+                    return node;
+                }
+                std::shared_ptr<Node<T>> node = make();
+                node->interned_hash_ = static_cast<std::uint32_t>(hash);
+                slot.node = node.get();
+                return node;
+            }
+            i = (i + 1) & mask;
+        }
+        std::shared_ptr<Node<T>> node = make();
+        node->interned_hash_ = static_cast<std::uint32_t>(hash);
+        slots_[i] = Slot{hash, key, node.get()};
+        if (++used_ * 2 > slots_.size()) {
+            grow();
+        }
+        return node;
+    }
+
+    template <typename Make>
+    std::shared_ptr<Node<T>> intern_variable(const std::string& name, Make make) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        Node<T>*& entry = variables_[name];
+        if (entry) {
+            if (auto node = entry->weak_from_this().lock()) {
+                return node;
+            }
+        }
+        std::uint32_t id = intern_name(name);
+        std::shared_ptr<Node<T>> node = make(id, variable_names_[id]);
+        entry = node.get();
+        return node;
+    }
+
+    // Only the low bits of the hash are needed to find the probe sequence.
+    void erase(std::uint32_t hash, const Node<T>* node) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        const std::size_t mask = slots_.size() - 1;
+        for (std::size_t i = hash & mask; slots_[i].hash; i = (i + 1) & mask) {
+            if (slots_[i].node == node) {
+                remove(i);
+                return;
+            }
+        }
+    }
+
+    std::uint32_t find_variable(const std::string& name) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = variable_ids_.find(name);
+        return it == variable_ids_.end() ? no_variable : it->second;
+    }
+
+    std::uint32_t intern_variable(const std::string& name) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return intern_name(name);
+    }
+
+    const std::string& variable_name(std::uint32_t id) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return variable_names_.at(id);
+    }
+
+    void erase_variable(const std::string& name, const Node<T>* node) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = variables_.find(name);
+        if (it != variables_.end() && it->second == node) {
+            variables_.erase(it);
+        }
+    }
+
+    std::size_t size() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return used_ + variables_.size();
+    }
+};
+
+template <typename T>
+Node<T>::Node(OpCode op) : op_(op) {}
+
+template <typename T>
+Node<T>::~Node() {
+    if (interned_hash_) {
+        NodeTable<T>::instance().erase(interned_hash_, this);
+    }
+}
+
+template <typename T>
+const VariableSet& Node<T>::dependencies() const {
+    return dependencies_;
+}
+
+template <typename T>
+OpCode Node<T>::opcode() const {
+    return op_;
+}
+
+template <typename T>
+std::size_t Node<T>::arity() const {
+    if (is_binary(op_)) {
+        return 2;
+    }
+    return is_operation(op_) ? 1 : 0;
+}
+
+template <typename T>
+const std::shared_ptr<Node<T>>& Node<T>::child(std::size_t index) const {
+    if (is_binary(op_)) {
+        return static_cast<const BinaryOperation<T>*>(this)->child(index);
+    }
+    if (is_operation(op_)) {
+        return static_cast<const UnaryOperation<T>*>(this)->child(index);
+    }
+    throw std::out_of_range(op_ == OpCode::Constant ? "Value has no children" : "Variable has no children");
+}
+
+// Children referenced from more than one place may be revisited within a
+// single call; only those go through the memo.
+template <typename T>
+bool is_shared(const std::shared_ptr<Node<T>>& node) {
+    return node.use_count() > 1 && node->arity() > 0;
+}
+
+// Post-order walk over an explicit stack. An operation is applied once the
+// values of its operands are on top of `values`, left below right.
+template <typename T>
+T Node<T>::eval(const EvalContext<T>& context, EvalMemo<T>& memo) {
+    struct Frame {
+        Node<T>* node;
+        bool shared;
+        bool expanded;
+    };
+    // Kept per thread so that repeated evaluation does not allocate its
+    // stacks; eval never runs inside itself, and a walk left by an exception
+    // is cleared. Stacks grown past the limit by an unusually deep tree are
+    // released. The memo is the caller's and still allocates an entry for
+    // every shared node it records.
+    constexpr std::size_t retained_depth = 65536;
+    static thread_local std::vector<Frame> stack;
+    static thread_local std::vector<T> values;
+    stack.clear();
+    values.clear();
+    stack.push_back({this, false, false});
+    while (!stack.empty()) {
+        Frame frame = stack.back();
+        Node<T>* node = frame.node;
+        if (frame.expanded) {
+            stack.pop_back();
+            if (is_binary(node->op_)) {
+                T b = values.back();
+                values.pop_back();
+                values.back() = apply_binary(node->op_, values.back(), b);
+            } else {
+                values.back() = apply_unary(node->op_, values.back());
+            }
+            if (frame.shared) {
+                memo.emplace(node, values.back());
+            }
+            continue;
+        }
+        if (node->op_ == OpCode::Constant) {
+            EXPRESSION_PROFILE_VISIT(OpCode::Constant);
+            values.push_back(static_cast<Value<T>*>(node)->get_value());
+            stack.pop_back();
+            continue;
+        }
+        if (node->op_ == OpCode::Variable) {
+            EXPRESSION_PROFILE_VISIT(OpCode::Variable);
+            auto* variable = static_cast<Variable<T>*>(node);
+            const T* value = context.find(variable->get_id());
+            if (!value) {
+                throw std::runtime_error("Variable not found: " + variable->get_name());
+            }
+            values.push_back(*value);
+            stack.pop_back();
+            continue;
+        }
+        if (frame.shared) {
+            auto it = memo.find(node);
+            if (it != memo.end()) {
+                values.push_back(it->second);
+                stack.pop_back();
+                continue;
+            }
+        }
+        EXPRESSION_PROFILE_VISIT(node->op_);
+        stack.back().expanded = true;
+        for (std::size_t i = node->arity(); i-- > 0;) {
+            const auto& child = node->child(i);
+            stack.push_back({child.get(), is_shared(child), false});
+        }
+    }
+    T result = values.back();
+    if (stack.capacity() > retained_depth) {
+        std::vector<Frame>().swap(stack);
+    }
+    if (values.capacity() > retained_depth) {
+        std::vector<T>().swap(values);
+    }
+    return result;
+}
+
+// Dropping the last reference to a long chain would otherwise destroy it
+// through one nested destructor call per node. The outermost operation
+// destructor on a thread drains a queue of the children it and the nodes
+// below it own alone; the destructors that run meanwhile only add to it.
+template <typename T>
+void release_child(std::shared_ptr<Node<T>>& child) {
+    static thread_local std::vector<std::shared_ptr<Node<T>>>* pending = nullptr;
+    if (!child || child.use_count() > 1 || child->arity() == 0) {
+        return;
+    }
+    if (pending) {
+        pending->push_back(std::move(child));
+        return;
+    }
+    std::vector<std::shared_ptr<Node<T>>> queue;
+    queue.push_back(std::move(child));
+    pending = &queue;
+    while (!queue.empty()) {
+        std::shared_ptr<Node<T>> node = std::move(queue.back());
+        queue.pop_back();
+        node.reset();
+    }
+    pending = nullptr;
+}
+
+// Allocates a node in the current thread's arena, or on the heap without one.
+template <typename N, typename... Args>
+std::shared_ptr<N> allocate_node(Args&&... args) {
+    EXPRESSION_PROFILE_ALLOCATION();
+    if (Arena* arena = Arena::current()) {
+        return std::allocate_shared<N>(ArenaAllocator<N>(*arena), std::forward<Args>(args)...);
+    }
+    return std::make_shared<N>(std::forward<Args>(args)...);
+}
+
+template <typename T>
+std::shared_ptr<Node<T>> make_value(T value) {
+    static_assert(sizeof(T) <= sizeof(NodeKey::bits));
+    NodeKey key{OpCode::Constant, nullptr, nullptr, {0, 0}};
+    std::memcpy(key.bits, &value, sizeof(T));
+    return NodeTable<T>::instance().intern(key, [&] { return allocate_node<Value<T>>(value); });
+}
+
+template <typename T>
+std::shared_ptr<Node<T>> make_variable(const std::string& name) {
+    return NodeTable<T>::instance().intern_variable(name, [](std::uint32_t id, const std::string& interned) {
+        return allocate_node<Variable<T>>(interned, id);
+    });
+}
+
+template <typename T>
+std::shared_ptr<Node<T>> make_binary(std::shared_ptr<Node<T>> left, std::shared_ptr<Node<T>> right, OpCode op) {
+    NodeKey key{op, left.get(), right.get(), {0, 0}};
+    return NodeTable<T>::instance().intern(key, [&] {
+        return allocate_node<BinaryOperation<T>>(std::move(left), std::move(right), op);
+    });
+}
+
+template <typename T>
+std::shared_ptr<Node<T>> make_unary(std::shared_ptr<Node<T>> value, OpCode op) {
+    NodeKey key{op, value.get(), nullptr, {0, 0}};
+    return NodeTable<T>::instance().intern(key, [&] {
+        return allocate_node<UnaryOperation<T>>(std::move(value), op);
+    });
+}
+
+template <typename T>
+std::shared_ptr<Node<T>> make_binary(std::shared_ptr<Node<T>> left, std::shared_ptr<Node<T>> right, char op) {
+    return make_binary<T>(std::move(left), std::move(right), binary_opcode(op));
+}
+
+template <typename T>
+std::shared_ptr<Node<T>> make_unary(std::shared_ptr<Node<T>> value, const std::string& op) {
+    return make_unary<T>(std::move(value), unary_opcode(op));
+}
+
+template <typename T>
+std::size_t interned_nodes() {
+    return NodeTable<T>::instance().size();
+}
+
+template <typename T>
+std::uint32_t variable_id(const std::string& name) {
+    return NodeTable<T>::instance().find_variable(name);
+}
+
+template <typename T>
+std::uint32_t intern_variable_id(const std::string& name) {
+    return NodeTable<T>::instance().intern_variable(name);
+}
+
+template <typename T>
+const std::string& variable_name(std::uint32_t id) {
+    return NodeTable<T>::instance().variable_name(id);
+}
+
+template <typename T>
+EvalContext<T>::EvalContext(const std::map<std::string, T>& values) {
+    for (const auto& [name, value] : values) {
+        set(name, value);
+    }
+}
+
+template <typename T>
+EvalContext<T>::EvalContext(std::initializer_list<std::pair<const std::string, T>> values) {
+    for (const auto& [name, value] : values) {
+        set(name, value);
+    }
+}
+
+template <typename T>
+void EvalContext<T>::set(std::uint32_t id, T value) {
+    if (id >= values_.size()) {
+        values_.resize(id + 1);
+    }
+    values_[id] = value;
+    if (!bound_.contains(id)) {
+        bound_ |= VariableSet(id);
+    }
+}
+
+template <typename T>
+void EvalContext<T>::set(const std::string& name, T value) {
+    set(intern_variable_id<T>(name), value);
+}
+
+template <typename T>
+const T* EvalContext<T>::find(std::uint32_t id) const {
+    return bound_.contains(id) ? &values_[id] : nullptr;
+}
+
+template <typename T>
+const T* EvalContext<T>::find(const std::string& name) const {
+    return find(variable_id<T>(name));
+}
+
+template <typename T>
+const VariableSet& EvalContext<T>::variables() const {
+    return bound_;
+}
+
+// Post-order walk on an explicit stack over the nodes that depend on the
+// variable; the other subtrees differentiate to 0 without being walked. An
+// operation is differentiated once the derivatives of its varying operands
+// are on top of `derivatives`, left below right.
+template <typename T>
+std::shared_ptr<Node<T>> diff_node(const std::shared_ptr<Node<T>>& node, std::uint32_t variable, NodeMemo<T>& memo) {
+    if (!node->dependencies().contains(variable)) {
+        return make_value<T>(0);
+    }
+    struct Frame {
+        Node<T>* node;
+        bool shared;
+        bool expanded;
+    };
+    std::vector<Frame> stack{{node.get(), is_shared(node), false}};
+    std::vector<std::shared_ptr<Node<T>>> derivatives;
+    auto varies = [&](const std::shared_ptr<Node<T>>& child) { return child->dependencies().contains(variable); };
+    auto pop = [&](const std::shared_ptr<Node<T>>& child) {
+        std::shared_ptr<Node<T>> result;
+        if (varies(child)) {
+            result = std::move(derivatives.back());
+            derivatives.pop_back();
+        }
+        return result;
+    };
+    while (!stack.empty()) {
+        Frame frame = stack.back();
+        Node<T>* current = frame.node;
+        if (!frame.expanded) {
+            if (frame.shared) {
+                auto it = memo.find(current);
+                if (it != memo.end()) {
+                    derivatives.push_back(it->second);
+                    stack.pop_back();
+                    continue;
+                }
+            }
+            if (current->arity() == 0) {
+                // Only variables depend on anything.
+                derivatives.push_back(static_cast<Variable<T>*>(current)->diff(variable));
+                stack.pop_back();
+                continue;
+            }
+            stack.back().expanded = true;
+            for (std::size_t i = current->arity(); i-- > 0;) {
+                const auto& child = current->child(i);
+                if (varies(child)) {
+                    stack.push_back({child.get(), is_shared(child), false});
+                }
+            }
+            continue;
+        }
+        stack.pop_back();
+        std::shared_ptr<Node<T>> result;
+        if (current->arity() == 2) {
+            auto dr = pop(current->child(1));
+            auto dl = pop(current->child(0));
+            result = static_cast<BinaryOperation<T>*>(current)->diff(dl, dr);
+        } else {
+            auto dv = pop(current->child(0));
+            result = static_cast<UnaryOperation<T>*>(current)->diff(dv);
+        }
+        if (frame.shared) {
+            memo.emplace(current, result);
+        }
+        derivatives.push_back(std::move(result));
+    }
+    return derivatives.back();
+}
+
+// A node reached through a single parent is only revisited through that
+// parent, so the is_shared() policy of diff_node still visits every node once
+// as long as the root itself is held here.
+template <typename T>
+std::shared_ptr<Node<T>> DiffCache<T>::diff(const std::shared_ptr<Node<T>>& node, const std::string& name) {
+    roots_.insert(node);
+    return diff_node(node, variable_id<T>(name), derivatives_[name]);
+}
+
+template <typename T>
+std::size_t DiffCache<T>::size() const {
+    std::size_t result = 0;
+    for (const auto& [name, memo] : derivatives_) {
+        result += memo.size();
+    }
+    return result;
+}
 
 template <typename T>
-Value<T>::Value(T val) : value(val) {}
+void DiffCache<T>::clear() {
+    derivatives_.clear();
+    roots_.clear();
+}
+
+template <typename T>
+bool is_constant(const std::shared_ptr<Node<T>>& node) {
+    return node->opcode() == OpCode::Constant;
+}
+
+template <typename T>
+T constant_of(const std::shared_ptr<Node<T>>& node) {
+    return static_cast<const Value<T>*>(node.get())->get_value();
+}
+
+template <typename T>
+bool is_constant_equal(const std::shared_ptr<Node<T>>& node, T value) {
+    return is_constant(node) && constant_of(node) == value;
+}
+
+template <typename T>
+bool is_integer_constant(const std::shared_ptr<Node<T>>& node) {
+    if (!is_constant(node)) {
+        return false;
+    }
+    if constexpr (std::is_integral_v<T>) {
+        return true;
+    } else if constexpr (std::is_same_v<T, std::complex<double>>) {
+        T value = constant_of(node);
+        return value.imag() == 0.0 && std::trunc(value.real()) == value.real();
+    } else {
+        T value = constant_of(node);
+        return std::trunc(value) == value;
+    }
+}
+
+// Integral constants are only folded when that cannot trap or overflow a
+// conversion; eval would report those cases at evaluation time instead.
+template <typename T>
+bool can_fold_binary(OpCode op, T a, T b) {
+    if constexpr (std::is_integral_v<T>) {
+        if (op == OpCode::Div && b == 0) {
+            return false;
+        }
+        if (op == OpCode::Pow) {
+            double result = std::pow(static_cast<double>(a), static_cast<double>(b));
+            return std::isfinite(result) && std::abs(result) <= static_cast<double>(std::numeric_limits<T>::max());
+        }
+    }
+    (void) op;
+    (void) a;
+    (void) b;
+    return true;
+}
+
+template <typename T>
+bool can_fold_unary(OpCode op, T a) {
+    if constexpr (std::is_integral_v<T>) {
+        double result = apply_unary(op, static_cast<double>(a));
+        return std::isfinite(result) && std::abs(result) <= static_cast<double>(std::numeric_limits<T>::max());
+    }
+    (void) op;
+    (void) a;
+    return true;
+}
+
+// Value of a subtree without variables, if it can be computed here.
+// Integral subtrees other than plain constants are left alone, since
+// evaluating them could trap.
+template <typename T>
+std::optional<T> constant_value(const std::shared_ptr<Node<T>>& node) {
+    if (is_constant(node)) {
+        return constant_of(node);
+    }
+    if (std::is_integral_v<T> || !node->dependencies().empty()) {
+        return std::nullopt;
+    }
+    EvalMemo<T> memo;
+    return node->eval(EvalContext<T>{}, memo);
+}
+
+// Subtrees that use none of the substituted variables are returned as they
+// are, so only the paths leading to substituted variables are rebuilt. Walks
+// those paths in post-order on an explicit stack, like diff_node.
+template <typename T>
+std::shared_ptr<Node<T>> substitute_node(const std::shared_ptr<Node<T>>& node, const EvalContext<T>& context, NodeMemo<T>& memo) {
+    if (!node->dependencies().intersects(context.variables())) {
+        return node;
+    }
+    struct Frame {
+        Node<T>* node;
+        bool shared;
+        bool expanded;
+    };
+    std::vector<Frame> stack{{node.get(), is_shared(node), false}};
+    std::vector<std::shared_ptr<Node<T>>> results;
+    auto affected = [&](const std::shared_ptr<Node<T>>& child) {
+        return child->dependencies().intersects(context.variables());
+    };
+    auto pop = [&](const std::shared_ptr<Node<T>>& child) {
+        if (!affected(child)) {
+            return child;
+        }
+        std::shared_ptr<Node<T>> result = std::move(results.back());
+        results.pop_back();
+        return result;
+    };
+    while (!stack.empty()) {
+        Frame frame = stack.back();
+        Node<T>* current = frame.node;
+        if (!frame.expanded) {
+            if (frame.shared) {
+                auto it = memo.find(current);
+                if (it != memo.end()) {
+                    results.push_back(it->second);
+                    stack.pop_back();
+                    continue;
+                }
+            }
+            if (current->arity() == 0) {
+                results.push_back(static_cast<Variable<T>*>(current)->substitute(context));
+                stack.pop_back();
+                continue;
+            }
+            stack.back().expanded = true;
+            for (std::size_t i = current->arity(); i-- > 0;) {
+                const auto& child = current->child(i);
+                if (affected(child)) {
+                    stack.push_back({child.get(), is_shared(child), false});
+                }
+            }
+            continue;
+        }
+        stack.pop_back();
+        std::shared_ptr<Node<T>> result;
+        if (current->arity() == 2) {
+            auto r = pop(current->child(1));
+            auto l = pop(current->child(0));
+            result = static_cast<BinaryOperation<T>*>(current)->substitute(std::move(l), std::move(r));
+        } else {
+            auto v = pop(current->child(0));
+            result = static_cast<UnaryOperation<T>*>(current)->substitute(std::move(v));
+        }
+        if (frame.shared) {
+            memo.emplace(current, result);
+        }
+        results.push_back(std::move(result));
+    }
+    return results.back();
+}
+
+template <typename T>
+Value<T>::Value(T val) : Node<T>(OpCode::Constant), value(val) {}
+
+template<typename T>
+Value<T>::~Value() = default;
+
+template<typename T>
+T Value<T>::get_value() const {
+    return value;
+}
+
+template<typename T>
+Variable<T>::Variable(const std::string& n, std::uint32_t i) : Node<T>(OpCode::Variable), name(&n), id(i) {
+    this->dependencies_ = VariableSet(id);
+}
+
+template<typename T>
+Variable<T>::~Variable() {
+    NodeTable<T>::instance().erase_variable(*name, this);
+}
+
+template<typename T>
+const std::string& Variable<T>::get_name() const {
+    return *name;
+}
+
+template<typename T>
+std::uint32_t Variable<T>::get_id() const {
+    return id;
+}
+
+template<typename T>
+std::shared_ptr<Node<T>> Variable<T>::diff(std::uint32_t variable) {
+    if (variable == id) {
+        return make_value<T>(1.0);
+    } return make_value<T>(0.0);
+}
+
+template<typename T>
+std::shared_ptr<Node<T>> Variable<T>::substitute(const EvalContext<T>& context) {
+    if (const T* value = context.find(id)) {
+        return make_value<T>(*value);
+    }
+    return this->shared_from_this();
+}
+
+template<typename T>
+BinaryOperation<T>::BinaryOperation(std::shared_ptr<Node<T>> l, std::shared_ptr<Node<T>> r, OpCode o)
+    : Node<T>(o), left(std::move(l)), right(std::move(r)) {
+    this->dependencies_ = left->dependencies();
+    this->dependencies_ |= right->dependencies();
+}
+
+template<typename T>
+BinaryOperation<T>::~BinaryOperation() {
+    release_child(left);
+    release_child(right);
+}
+
+template<typename T>
+const std::shared_ptr<Node<T>>& BinaryOperation<T>::child(std::size_t index) const {
+    return index == 0 ? left : right;
+}
+
+template<typename T>
+std::shared_ptr<Node<T>> BinaryOperation<T>::diff(const std::shared_ptr<Node<T>>& dl, const std::shared_ptr<Node<T>>& dr) {
+    // Terms carrying the derivative of an operand that does not depend on
+    // the variable are left out instead of being multiplied by 0.
+    bool left_varies = dl != nullptr;
+    bool right_varies = dr != nullptr;
+    switch (this->opcode()) {
+        case OpCode::Add: {
+            if (!right_varies) {
+                return dl;
+            }
+            if (!left_varies) {
+                return dr;
+            }
+            return make_binary<T>(dl, dr, OpCode::Add);
+        }
+        case OpCode::Sub: {
+            if (!right_varies) {
+                return dl;
+            }
+            if (!left_varies) {
+                return make_binary<T>(dr, make_value<T>(T(-1)), OpCode::Mul);
+            }
+            return make_binary<T>(dl, dr, OpCode::Sub);
+        }
+        case OpCode::Mul: {
+            if (!right_varies) {
+                return make_binary<T>(dl, right, OpCode::Mul);
+            }
+            if (!left_varies) {
+                return make_binary<T>(left, dr, OpCode::Mul);
+            }
+            auto new_left = make_binary<T>(dl, right, OpCode::Mul);
+            auto new_right = make_binary<T>(left, dr, OpCode::Mul);
+            return make_binary<T>(new_left, new_right, OpCode::Add);
+        }
+        case OpCode::Div: {
+            if (!right_varies) {
+                return make_binary<T>(dl, right, OpCode::Div);
+            }
+            auto new_right = make_binary<T>(left, dr, OpCode::Mul);
+            auto numerator = left_varies
+                ? make_binary<T>(make_binary<T>(dl, right, OpCode::Mul), new_right, OpCode::Sub)
+                : make_binary<T>(new_right, make_value<T>(T(-1)), OpCode::Mul);
+            auto denominator = make_binary<T>(right, make_value<T>(2), OpCode::Pow);
+            return make_binary<T>(numerator, denominator, OpCode::Div);
+        }
+        case OpCode::Pow: {
+            std::shared_ptr<Node<T>> left_part3;
+            std::shared_ptr<Node<T>> right_part3;
+            if (left_varies) {
+                auto left_part1 = make_binary<T>(
+                    left, make_binary<T>(right, make_value<T>(1), OpCode::Sub), OpCode::Pow);
+                auto left_part2 = make_binary<T>(
+                    right, left_part1, OpCode::Mul);
+                left_part3 = make_binary<T>(
+                    left_part2, dl, OpCode::Mul);
+            }
+            if (right_varies) {
+                auto right_part1 = make_binary<T>(
+                    left, right, OpCode::Pow);
+                auto right_part2 = make_binary<T>(
+                    right_part1, make_unary<T>(left, OpCode::Ln), OpCode::Mul);
+                right_part3 = make_binary<T>(
+                    right_part2, dr, OpCode::Mul);
+            }
+            if (!right_part3) {
+                return left_part3;
+            }
+            if (!left_part3) {
+                return right_part3;
+            }
+            return make_binary<T>(
+                left_part3, right_part3, OpCode::Add);
+        }
+        default: throw std::runtime_error("Unknown operation code");
+    }
+}
+
+template<typename T>
+std::shared_ptr<Node<T>> BinaryOperation<T>::substitute(std::shared_ptr<Node<T>> l, std::shared_ptr<Node<T>> r) {
+    if (l == left && r == right) {
+        return this->shared_from_this();
+    }
+    // Operands that became constant are folded into a single Value.
+    if (l->dependencies().empty() && r->dependencies().empty()) {
+        auto a = constant_value(l);
+        auto b = constant_value(r);
+        if (a && b && can_fold_binary(this->opcode(), *a, *b)) {
+            return make_value<T>(apply_binary(this->opcode(), *a, *b));
+        }
+    }
+    return make_binary<T>(std::move(l), std::move(r), this->opcode());
+}
+
+template<typename T>
+UnaryOperation<T>::UnaryOperation(std::shared_ptr<Node<T>> val, OpCode o)
+    : Node<T>(o), value(std::move(val)) {
+    this->dependencies_ = value->dependencies();
+}
+
+template<typename T>
+UnaryOperation<T>::~UnaryOperation() {
+    release_child(value);
+}
+
+template<typename T>
+const std::shared_ptr<Node<T>>& UnaryOperation<T>::child(std::size_t index) const {
+    (void) index;
+    return value;
+}
+
+template<typename T>
+std::shared_ptr<Node<T>> UnaryOperation<T>::diff(const std::shared_ptr<Node<T>>& dv) {
+    switch (this->opcode()) {
+        case OpCode::Sin:
+            return make_binary<T>(
+                make_unary<T>(value, OpCode::Cos), dv, OpCode::Mul);
+        case OpCode::Cos:
+            return make_binary<T>(
+                make_binary<T>(make_unary<T>(value, OpCode::Sin), make_value<T>(-1), OpCode::Mul),
+                dv, OpCode::Mul);
+        case OpCode::Ln:
+            return make_binary<T>(
+                dv, value, OpCode::Div);
+        case OpCode::Exp:
+            return make_binary<T>(
+                make_unary<T>(value, OpCode::Exp), dv, OpCode::Mul);
+        default: throw std::runtime_error("Unknown operation code");
+    }
+}
+
+template<typename T>
+std::shared_ptr<Node<T>> UnaryOperation<T>::substitute(std::shared_ptr<Node<T>> v) {
+    if (v == value) {
+        return this->shared_from_this();
+    }
+    if (v->dependencies().empty()) {
+        auto a = constant_value(v);
+        if (a && can_fold_unary(this->opcode(), *a)) {
+            return make_value<T>(apply_unary(this->opcode(), *a));
+        }
+    }
+    return make_unary<T>(std::move(v), this->opcode());
+}
+
+// Splits a term into coefficient * base, where the coefficient is a constant.
+template <typename T>
+std::pair<T, std::shared_ptr<Node<T>>> split_term(const std::shared_ptr<Node<T>>& node) {
+    if (node->opcode() == OpCode::Mul) {
+        if (is_constant(node->child(0))) {
+            return {constant_of(node->child(0)), node->child(1)};
+        }
+        if (is_constant(node->child(1))) {
+            return {constant_of(node->child(1)), node->child(0)};
+        }
+    }
+    return {T(1), node};
+}
+
+// Splits a factor into base ^ exponent.
+template <typename T>
+std::pair<std::shared_ptr<Node<T>>, std::shared_ptr<Node<T>>> split_power(const std::shared_ptr<Node<T>>& node) {
+    if (node->opcode() == OpCode::Pow) {
+        return {node->child(0), node->child(1)};
+    }
+    return {node, make_value<T>(1)};
+}
+
+template <typename T>
+std::shared_ptr<Node<T>> rewrite_unary(OpCode op, const std::shared_ptr<Node<T>>& value) {
+    if (is_constant(value) && can_fold_unary(op, constant_of(value))) {
+        return make_value<T>(apply_unary(op, constant_of(value)));
+    }
+    // For complex numbers ln(exp(z)) is z only inside the principal strip
+    // |Im z| <= pi, so the rule is kept to the other types.
+    if (!std::is_same_v<T, std::complex<double>> && op == OpCode::Ln && value->opcode() == OpCode::Exp) {
+        return value->child(0);
+    }
+    return make_unary<T>(value, op);
+}
+
+// Local rewrites of op(l, r) for already simplified operands. Every rule
+// either folds constants or produces a strictly smaller node, so the nested
+// calls terminate after a bounded number of steps.
+template <typename T>
+std::shared_ptr<Node<T>> rewrite_binary(OpCode op, const std::shared_ptr<Node<T>>& l, const std::shared_ptr<Node<T>>& r) {
+    if (is_constant(l) && is_constant(r) && can_fold_binary(op, constant_of(l), constant_of(r))) {
+        return make_value<T>(apply_binary(op, constant_of(l), constant_of(r)));
+    }
+    const T zero(0);
+    const T one(1);
+    switch (op) {
+        case OpCode::Add:
+        case OpCode::Sub: {
+            if (is_constant_equal(r, zero)) return l;
+            if (op == OpCode::Add && is_constant_equal(l, zero)) return r;
+            if (op == OpCode::Sub && l == r) return make_value<T>(zero);
+            auto [lc, lb] = split_term(l);
+            auto [rc, rb] = split_term(r);
+            if (lb == rb && !is_constant(lb)) {
+                T c = op == OpCode::Add ? lc + rc : lc - rc;
+                return rewrite_binary(OpCode::Mul, make_value<T>(c), lb);
+            }
+            break;
+        }
+        case OpCode::Mul: {
+            if (is_constant_equal(l, zero) || is_constant_equal(r, zero)) return make_value<T>(zero);
+            if (is_constant_equal(l, one)) return r;
+            if (is_constant_equal(r, one)) return l;
+            if (is_constant(r) && !is_constant(l)) {
+                return rewrite_binary(OpCode::Mul, r, l);
+            }
+            if (is_constant(l) && r->opcode() == OpCode::Mul) {
+                auto [rc, rb] = split_term(r);
+                if (rb != r) {
+                    return rewrite_binary(OpCode::Mul, make_value<T>(constant_of(l) * rc), rb);
+                }
+            }
+            if (!is_constant(l) && !is_constant(r)) {
+                auto [lb, le] = split_power(l);
+                auto [rb, re] = split_power(r);
+                if (lb == rb) {
+                    return rewrite_binary(OpCode::Pow, lb, rewrite_binary(OpCode::Add, le, re));
+                }
+            }
+            break;
+        }
+        case OpCode::Div: {
+            if (is_constant_equal(r, one)) return l;
+            if (is_constant_equal(l, zero)) return make_value<T>(zero);
+            if (l == r) return make_value<T>(one);
+            if (!is_constant(l) && !is_constant(r)) {
+                auto [lb, le] = split_power(l);
+                auto [rb, re] = split_power(r);
+                if (lb == rb) {
+                    return rewrite_binary(OpCode::Pow, lb, rewrite_binary(OpCode::Sub, le, re));
+                }
+            }
+            break;
+        }
+        case OpCode::Pow: {
+            if (is_constant_equal(r, zero)) return make_value<T>(one);
+            if (is_constant_equal(r, one)) return l;
+            if (is_constant_equal(l, one)) return make_value<T>(one);
+            if (l->opcode() == OpCode::Pow && is_integer_constant(r)) {
+                return rewrite_binary(OpCode::Pow, l->child(0), rewrite_binary(OpCode::Mul, l->child(1), r));
+            }
+            break;
+        }
+        default:
+            break;
+    }
+    return make_binary<T>(l, r, op);
+}
+
+// Post-order walk on an explicit stack; every operation is rewritten once its
+// simplified operands are on top of `results`, left below right.
+template <typename T>
+std::shared_ptr<Node<T>> simplify_node(const std::shared_ptr<Node<T>>& node, NodeMemo<T>& memo) {
+    struct Frame {
+        const std::shared_ptr<Node<T>>* node;
+        bool expanded;
+    };
+    std::vector<Frame> stack{{&node, false}};
+    std::vector<std::shared_ptr<Node<T>>> results;
+    while (!stack.empty()) {
+        Frame frame = stack.back();
+        const std::shared_ptr<Node<T>>& current = *frame.node;
+        if (!frame.expanded) {
+            if (current->arity() == 0) {
+                results.push_back(current);
+                stack.pop_back();
+                continue;
+            }
+            auto it = memo.find(current.get());
+            if (it != memo.end()) {
+                results.push_back(it->second);
+                stack.pop_back();
+                continue;
+            }
+            stack.back().expanded = true;
+            for (std::size_t i = current->arity(); i-- > 0;) {
+                stack.push_back({&current->child(i), false});
+            }
+            continue;
+        }
+        stack.pop_back();
+        std::shared_ptr<Node<T>> result;
+        if (current->arity() == 1) {
+            result = rewrite_unary(current->opcode(), results.back());
+            results.pop_back();
+        } else {
+            auto r = std::move(results.back());
+            results.pop_back();
+            result = rewrite_binary(current->opcode(), results.back(), r);
+            results.pop_back();
+        }
+        memo.emplace(current.get(), result);
+        results.push_back(std::move(result));
+    }
+    return results.back();
+}
+
+// Post-order walk on an explicit stack, so operands are emitted before the
+// operations using them without recursing per level.
+template<typename T>
+std::uint32_t Compiler<T>::lower(const std::shared_ptr<Node<T>>& node) {
+    struct Frame {
+        const Node<T>* node;
+        bool expanded;
+    };
+    std::vector<Frame> stack{{node.get(), false}};
+    std::vector<std::uint32_t> results;
+    while (!stack.empty()) {
+        Frame frame = stack.back();
+        const Node<T>* current = frame.node;
+        if (!frame.expanded) {
+            auto it = visited_.find(current);
+            if (it != visited_.end()) {
+                results.push_back(it->second);
+                stack.pop_back();
+                continue;
+            }
+            if (current->arity() > 0) {
+                stack.back().expanded = true;
+                for (std::size_t i = current->arity(); i-- > 0;) {
+                    stack.push_back({current->child(i).get(), false});
+                }
+                continue;
+            }
+        }
+        stack.pop_back();
+        std::uint32_t index;
+        if (current->opcode() == OpCode::Constant) {
+            index = constant(static_cast<const Value<T>*>(current)->get_value());
+        } else if (current->opcode() == OpCode::Variable) {
+            index = variable(static_cast<const Variable<T>*>(current)->get_name());
+        } else if (current->arity() == 2) {
+            std::uint32_t b = results.back();
+            results.pop_back();
+            index = operation(current->opcode(), results.back(), b);
+            results.pop_back();
+        } else {
+            index = operation(current->opcode(), results.back());
+            results.pop_back();
+        }
+        visited_.emplace(current, index);
+        results.push_back(index);
+    }
+    return results.back();
+}
 
 template<typename T>
-Value<T>::~Value() = default;
+std::uint32_t Compiler<T>::constant(T value) {
+    constants_.push_back(value);
+    code_.push_back({OpCode::Constant, 0, static_cast<std::uint32_t>(constants_.size() - 1), 0});
+    return static_cast<std::uint32_t>(code_.size() - 1);
+}
 
 template<typename T>
-std::string Value<T>::to_string() {
-    if constexpr (std::is_same_v<T, std::complex<double>>) {
-        return "(" + std::to_string(value.real()) + "," + std::to_string(value.imag()) + ")";
-    } else {
-        return std::to_string(value);
+std::uint32_t Compiler<T>::variable(const std::string& name) {
+    auto it = slots_.find(name);
+    if (it == slots_.end()) {
+        it = slots_.emplace(name, static_cast<std::uint32_t>(variables_.size())).first;
+        variables_.push_back(name);
     }
+    code_.push_back({OpCode::Variable, 0, it->second, 0});
+    return static_cast<std::uint32_t>(code_.size() - 1);
 }
 
 template<typename T>
-T Value<T>::eval(std::map<std::string, T> context) {
-    (void) context;
-    return value;
+std::uint32_t Compiler<T>::operation(OpCode op, std::uint32_t a, std::uint32_t b) {
+    code_.push_back({op, 0, a, b});
+    return static_cast<std::uint32_t>(code_.size() - 1);
 }
 
+// Until finish() the operands of code_ refer to instruction indices. Here they
+// are rewritten to registers, reusing a register once its last reader has run.
 template<typename T>
-std::shared_ptr<Node<T>> Value<T>::diff(std::string name) {
-    (void) name;
-    return std::make_shared<Value<T>>(0.0);
+Program<T> Compiler<T>::finish() {
+    std::vector<std::uint32_t> last_use(code_.size(), 0);
+    for (std::uint32_t i = 0; i < code_.size(); i++) {
+        code_[i].dst = i;
+        if (is_operation(code_[i].op)) {
+            last_use[code_[i].a] = i;
+            if (is_binary(code_[i].op)) {
+                last_use[code_[i].b] = i;
+            }
+        }
+    }
+    if (!code_.empty()) {
+        last_use.back() = static_cast<std::uint32_t>(code_.size());
+    }
+
+    Program<T> program;
+    std::vector<std::uint32_t> reg(code_.size(), 0);
+    std::vector<std::uint32_t> free_list;
+    for (std::uint32_t i = 0; i < code_.size(); i++) {
+        Instruction ins = code_[i];
+        if (is_operation(ins.op)) {
+            std::uint32_t a = ins.a;
+            std::uint32_t b = ins.b;
+            ins.a = reg[a];
+            ins.b = is_binary(ins.op) ? reg[b] : 0;
+            if (last_use[a] == i) {
+                free_list.push_back(reg[a]);
+            }
+            if (is_binary(ins.op) && b != a && last_use[b] == i) {
+                free_list.push_back(reg[b]);
+            }
+        }
+        if (free_list.empty()) {
+            reg[i] = program.registers_++;
+        } else {
+            reg[i] = free_list.back();
+            free_list.pop_back();
+        }
+        ins.dst = reg[i];
+        program.code_.push_back(ins);
+    }
+    program.ssa_ = std::move(code_);
+    program.constants_ = std::move(constants_);
+    program.variables_ = std::move(variables_);
+    return program;
 }
 
 template<typename T>
-std::shared_ptr<Node<T>> Value<T>::substitute(std::map<std::string, T> context) {
-    (void) context;
-    return std::make_shared<Value<T>>(value);
+T Program<T>::eval(std::span<const T> values) const {
+    if (registers_ <= 64) {
+        std::array<T, 64> registers{};
+        return eval(values, registers);
+    }
+    std::vector<T> registers(registers_);
+    return eval(values, registers);
 }
 
-template<typename T>
-Variable<T>::Variable(std::string n) : name(n) {}
+// Counts a visit per instruction and row, as the tree walk counts one per
+// node it evaluates.
+inline void profile_program(const std::vector<Instruction>& code, std::size_t rows) {
+#ifdef EXPRESSION_PROFILE
+    for (const Instruction& ins : code) {
+        EXPRESSION_PROFILE_VISITS(ins.op, rows);
+    }
+#else
+    (void) code;
+    (void) rows;
+#endif
+}
 
 template<typename T>
-Variable<T>::~Variable() = default;
+T Program<T>::eval(std::span<const T> values, std::span<T> registers) const {
+    EXPRESSION_PROFILE_PHASE(Eval);
+    profile_program(code_, 1);
+    if (values.size() < variables_.size()) {
+        throw std::runtime_error("Not enough values for compiled expression");
+    }
+    if (registers.size() < registers_) {
+        throw std::runtime_error("Not enough registers for compiled expression");
+    }
+    for (const Instruction& ins : code_) {
+        switch (ins.op) {
+            case OpCode::Constant: registers[ins.dst] = constants_[ins.a]; break;
+            case OpCode::Variable: registers[ins.dst] = values[ins.a]; break;
+            case OpCode::Add: registers[ins.dst] = registers[ins.a] + registers[ins.b]; break;
+            case OpCode::Sub: registers[ins.dst] = registers[ins.a] - registers[ins.b]; break;
+            case OpCode::Mul: registers[ins.dst] = registers[ins.a] * registers[ins.b]; break;
+            case OpCode::Div: registers[ins.dst] = registers[ins.a] / registers[ins.b]; break;
+            case OpCode::Pow: registers[ins.dst] = apply_binary(OpCode::Pow, registers[ins.a], registers[ins.b]); break;
+            default: registers[ins.dst] = apply_unary(ins.op, registers[ins.a]); break;
+        }
+    }
+    return registers[code_.back().dst];
+}
 
 template<typename T>
-std::string Variable<T>::to_string() {
-    return name;
+void batch_binary(OpCode op, const T* a, const T* b, T* out, std::size_t n) {
+    if constexpr (std::is_same_v<T, double>) {
+        switch (op) {
+            case OpCode::Add: kernels::add(a, b, out, n); return;
+            case OpCode::Sub: kernels::sub(a, b, out, n); return;
+            case OpCode::Mul: kernels::mul(a, b, out, n); return;
+            case OpCode::Div: kernels::div(a, b, out, n); return;
+            case OpCode::Pow: kernels::pow(a, b, out, n); return;
+            default: throw std::runtime_error("Unknown operation code");
+        }
+    } else {
+        for (std::size_t i = 0; i < n; i++) {
+            out[i] = apply_binary(op, a[i], b[i]);
+        }
+    }
 }
 
 template<typename T>
-T Variable<T>::eval(std::map<std::string, T> context) {
-    auto it = context.find(name);
-    if (it != context.end()) {
-        return context[name];
+void batch_unary(OpCode op, const T* a, T* out, std::size_t n) {
+    if constexpr (std::is_same_v<T, double>) {
+        switch (op) {
+            case OpCode::Sin: kernels::sin(a, out, n); return;
+            case OpCode::Cos: kernels::cos(a, out, n); return;
+            case OpCode::Exp: kernels::exp(a, out, n); return;
+            case OpCode::Ln: kernels::log(a, out, n); return;
+            default: throw std::runtime_error("Unknown operation code");
+        }
+    } else {
+        for (std::size_t i = 0; i < n; i++) {
+            out[i] = apply_unary(op, a[i]);
+        }
     }
-    throw std::runtime_error("Variable not found: " + name);
-    return 0;
+}
+
+// Complex registers are kept split: register r holds `chunk` real parts
+// followed by `chunk` imaginary parts, in the space of `chunk` std::complex
+// values, so the complex kernels see plain arrays of doubles.
+inline void eval_batch_split(const std::vector<Instruction>& code, const std::vector<std::complex<double>>& constants,
+                             std::span<const std::complex<double>* const> columns, std::span<std::complex<double>> out,
+                             std::span<std::complex<double>> scratch, std::size_t chunk) {
+    double* base = reinterpret_cast<double*>(scratch.data());
+    auto real = [&](std::uint32_t reg) { return base + 2 * static_cast<std::size_t>(reg) * chunk; };
+    auto imag = [&](std::uint32_t reg) { return real(reg) + chunk; };
+    for (std::size_t row = 0; row < out.size(); row += chunk) {
+        std::size_t n = std::min(chunk, out.size() - row);
+        for (const Instruction& ins : code) {
+            double* dr = real(ins.dst);
+            double* di = imag(ins.dst);
+            switch (ins.op) {
+                case OpCode::Constant:
+                    std::fill(dr, dr + n, constants[ins.a].real());
+                    std::fill(di, di + n, constants[ins.a].imag());
+                    break;
+                case OpCode::Variable: {
+                    const std::complex<double>* column = columns[ins.a] + row;
+                    for (std::size_t i = 0; i < n; i++) {
+                        dr[i] = column[i].real();
+                        di[i] = column[i].imag();
+                    }
+                    break;
+                }
+                case OpCode::Add:
+                    kernels::add(real(ins.a), real(ins.b), dr, n);
+                    kernels::add(imag(ins.a), imag(ins.b), di, n);
+                    break;
+                case OpCode::Sub:
+                    kernels::sub(real(ins.a), real(ins.b), dr, n);
+                    kernels::sub(imag(ins.a), imag(ins.b), di, n);
+                    break;
+                case OpCode::Mul: kernels::complex_mul(real(ins.a), imag(ins.a), real(ins.b), imag(ins.b), dr, di, n); break;
+                case OpCode::Div: kernels::complex_div(real(ins.a), imag(ins.a), real(ins.b), imag(ins.b), dr, di, n); break;
+                case OpCode::Pow: kernels::complex_pow(real(ins.a), imag(ins.a), real(ins.b), imag(ins.b), dr, di, n); break;
+                case OpCode::Sin: kernels::complex_sin(real(ins.a), imag(ins.a), dr, di, n); break;
+                case OpCode::Cos: kernels::complex_cos(real(ins.a), imag(ins.a), dr, di, n); break;
+                case OpCode::Exp: kernels::complex_exp(real(ins.a), imag(ins.a), dr, di, n); break;
+                case OpCode::Ln: kernels::complex_log(real(ins.a), imag(ins.a), dr, di, n); break;
+            }
+        }
+        const double* rr = real(code.back().dst);
+        const double* ri = imag(code.back().dst);
+        for (std::size_t i = 0; i < n; i++) {
+            out[row + i] = std::complex<double>(rr[i], ri[i]);
+        }
+    }
+}
+
+template<typename T>
+std::size_t Program<T>::batch_scratch_size() const {
+    return static_cast<std::size_t>(registers_) * batch_chunk;
 }
 
 template<typename T>
-std::shared_ptr<Node<T>> Variable<T>::diff(std::string var) {
-    if (var == name) {
-        return std::make_shared<Value<T>>(1.0);
-    } return std::make_shared<Value<T>>(0.0);
+void Program<T>::eval_batch(std::span<const T* const> columns, std::span<T> out) const {
+    std::vector<T> scratch(batch_scratch_size());
+    eval_batch(columns, out, scratch);
 }
 
 template<typename T>
-std::shared_ptr<Node<T>> Variable<T>::substitute(std::map<std::string, T> context) {
-    auto it = context.find(name);
-    if (it != context.end()) {
-        return std::make_shared<Value<T>>(context[name]);
+void Program<T>::eval_batch(std::span<const T* const> columns, std::span<T> out, ThreadPool& pool) const {
+    if (columns.size() < variables_.size()) {
+        throw std::runtime_error("Not enough columns for compiled expression");
     }
-    return std::make_shared<Variable<T>>(name);
+    // Pieces are whole multiples of the chunk, so every row is computed
+    // exactly as in the serial evaluator.
+    const std::size_t grain = batch_chunk * 16;
+    std::vector<std::vector<T>> scratch(pool.size(), std::vector<T>(batch_scratch_size()));
+    std::vector<std::vector<const T*>> shifted(pool.size(), std::vector<const T*>(variables_.size()));
+    pool.parallel_for(out.size(), grain, [&](std::size_t begin, std::size_t end, std::size_t worker) {
+        for (std::size_t slot = 0; slot < variables_.size(); slot++) {
+            shifted[worker][slot] = columns[slot] + begin;
+        }
+        eval_batch(shifted[worker], out.subspan(begin, end - begin), scratch[worker]);
+    });
 }
 
+// Every instruction runs over a whole chunk of rows before the next one, so
+// the per-row dispatch cost is amortised and the kernels see contiguous data.
 template<typename T>
-BinaryOperation<T>::BinaryOperation(std::shared_ptr<Node<T>> l, std::shared_ptr<Node<T>> r, char o)
-    : left(l), right(r), op(o) {}
+void Program<T>::eval_batch(std::span<const T* const> columns, std::span<T> out, std::span<T> scratch) const {
+    EXPRESSION_PROFILE_PHASE(Eval);
+    profile_program(code_, out.size());
+    if (columns.size() < variables_.size()) {
+        throw std::runtime_error("Not enough columns for compiled expression");
+    }
+    if (scratch.size() < batch_scratch_size()) {
+        throw std::runtime_error("Not enough scratch space for compiled expression");
+    }
+    if constexpr (std::is_same_v<T, std::complex<double>>) {
+        eval_batch_split(code_, constants_, columns, out, scratch, batch_chunk);
+        return;
+    }
+    for (std::size_t row = 0; row < out.size(); row += batch_chunk) {
+        std::size_t n = std::min(batch_chunk, out.size() - row);
+        for (const Instruction& ins : code_) {
+            T* dst = scratch.data() + static_cast<std::size_t>(ins.dst) * batch_chunk;
+            const T* a = scratch.data() + static_cast<std::size_t>(ins.a) * batch_chunk;
+            const T* b = scratch.data() + static_cast<std::size_t>(ins.b) * batch_chunk;
+            switch (ins.op) {
+                case OpCode::Constant: std::fill(dst, dst + n, constants_[ins.a]); break;
+                case OpCode::Variable: std::copy(columns[ins.a] + row, columns[ins.a] + row + n, dst); break;
+                case OpCode::Add:
+                case OpCode::Sub:
+                case OpCode::Mul:
+                case OpCode::Div:
+                case OpCode::Pow: batch_binary(ins.op, a, b, dst, n); break;
+                default: batch_unary(ins.op, a, dst, n); break;
+            }
+        }
+        const T* result = scratch.data() + static_cast<std::size_t>(code_.back().dst) * batch_chunk;
+        std::copy(result, result + n, out.data() + row);
+    }
+}
 
 template<typename T>
-BinaryOperation<T>::~BinaryOperation() = default;
+std::vector<const T*> Program<T>::bind_columns(const std::map<std::string, std::span<const T>>& columns, std::size_t rows) const {
+    std::vector<const T*> bound;
+    bound.reserve(variables_.size());
+    for (const auto& name : variables_) {
+        auto it = columns.find(name);
+        if (it == columns.end()) {
+            throw std::runtime_error("Variable not found: " + name);
+        }
+        if (it->second.size() < rows) {
+            throw std::runtime_error("Column is too short: " + name);
+        }
+        bound.push_back(it->second.data());
+    }
+    return bound;
+}
 
 template<typename T>
-std::string BinaryOperation<T>::to_string() {
-    return "(" + left->to_string() + op + right->to_string() + ")";
+std::vector<T> Program<T>::bind(const std::map<std::string, T>& context) const {
+    std::vector<T> values;
+    values.reserve(variables_.size());
+    for (const auto& name : variables_) {
+        auto it = context.find(name);
+        if (it == context.end()) {
+            throw std::runtime_error("Variable not found: " + name);
+        }
+        values.push_back(it->second);
+    }
+    return values;
 }
 
 template<typename T>
-T BinaryOperation<T>::eval(std::map<std::string, T> context) {
-    T a = left->eval(context);
-    T b = right->eval(context);
-    switch (op) {
-        case '+': return a + b;
-        case '-': return a - b;
-        case '*': return a * b;
-        case '/': return a / b;
-        case '^': return pow(a, b);
-        default : throw std::runtime_error("Unknown operation: " + op);
+std::size_t Program<T>::slot(const std::string& name) const {
+    auto it = std::find(variables_.begin(), variables_.end(), name);
+    if (it == variables_.end()) {
+        throw std::runtime_error("Variable not found: " + name);
     }
+    return static_cast<std::size_t>(it - variables_.begin());
 }
 
 template<typename T>
-std::shared_ptr<Node<T>> BinaryOperation<T>::diff(std::string name) {
-    switch (op) {
-        case '+': return std::make_shared<BinaryOperation<T>>(left->diff(name), right->diff(name), '+');
-        case '-': return std::make_shared<BinaryOperation<T>>(left->diff(name), right->diff(name), '-');
-        case '*' : {
-            auto new_left = BinaryOperation<T>(left->diff(name), right, '*');
-            auto new_right = BinaryOperation<T>(left, right->diff(name), '*');
-            return std::make_shared<BinaryOperation<T>>(std::make_shared<BinaryOperation<T>>(new_left), std::make_shared<BinaryOperation<T>>(new_right), '+');
+T Program<T>::gradient(std::span<const T> values, std::span<T> partials) const {
+    std::vector<T> scratch(gradient_scratch_size());
+    return gradient(values, partials, scratch);
+}
+
+// Forward sweep over the SSA form keeping every intermediate value, then one
+// reverse sweep accumulating adjoints. The local derivatives are the rules of
+// BinaryOperation::diff and UnaryOperation::diff. Adjoints of subgraphs that
+// depend on no variable are never needed and are skipped, which also keeps
+// ln(base) out of x^c for constant c.
+template<typename T>
+T Program<T>::gradient(std::span<const T> values, std::span<T> partials, std::span<T> scratch) const {
+    if (values.size() < variables_.size() || partials.size() < variables_.size()) {
+        throw std::runtime_error("Not enough values for compiled expression");
+    }
+    if (scratch.size() < gradient_scratch_size()) {
+        throw std::runtime_error("Not enough scratch space for compiled expression");
+    }
+    const std::size_t n = ssa_.size();
+    T* value = scratch.data();
+    T* adjoint = scratch.data() + n;
+    std::vector<bool> varying(n, false);
+    for (std::size_t i = 0; i < n; i++) {
+        const Instruction& ins = ssa_[i];
+        switch (ins.op) {
+            case OpCode::Constant: value[i] = constants_[ins.a]; break;
+            case OpCode::Variable: value[i] = values[ins.a]; varying[i] = true; break;
+            default:
+                if (is_binary(ins.op)) {
+                    value[i] = apply_binary(ins.op, value[ins.a], value[ins.b]);
+                    varying[i] = varying[ins.a] || varying[ins.b];
+                } else {
+                    value[i] = apply_unary(ins.op, value[ins.a]);
+                    varying[i] = varying[ins.a];
+                }
+                break;
+        }
+        adjoint[i] = T(0);
+    }
+    std::fill(partials.begin(), partials.begin() + variables_.size(), T(0));
+    adjoint[n - 1] = T(1);
+    for (std::size_t i = n; i-- > 0;) {
+        const Instruction& ins = ssa_[i];
+        const T g = adjoint[i];
+        if (!varying[i]) {
+            continue;
         }
-        case '/' : {
-            auto new_left  = std::make_shared<BinaryOperation<T>>(left->diff(name), right, '*');
-            auto new_right = std::make_shared<BinaryOperation<T>>(left, right->diff(name), '*');
-            auto numerator = std::make_shared<BinaryOperation<T>>(new_left, new_right, '-');
-            auto denominator = std::make_shared<BinaryOperation<T>>(right, std::make_shared<Value<T>>(2), '^');
-            return std::make_shared<BinaryOperation<T>>(numerator, denominator, '/');
+        const T a = value[ins.a];
+        const T b = is_binary(ins.op) ? value[ins.b] : T(0);
+        switch (ins.op) {
+            case OpCode::Variable: partials[ins.a] += g; break;
+            case OpCode::Add: adjoint[ins.a] += g; adjoint[ins.b] += g; break;
+            case OpCode::Sub: adjoint[ins.a] += g; adjoint[ins.b] -= g; break;
+            case OpCode::Mul: adjoint[ins.a] += g * b; adjoint[ins.b] += g * a; break;
+            case OpCode::Div:
+                adjoint[ins.a] += g / b;
+                adjoint[ins.b] -= g * a / apply_binary(OpCode::Pow, b, T(2));
+                break;
+            case OpCode::Pow:
+                if (varying[ins.a]) {
+                    adjoint[ins.a] += g * b * apply_binary(OpCode::Pow, a, b - T(1));
+                }
+                if (varying[ins.b]) {
+                    adjoint[ins.b] += g * value[i] * apply_unary(OpCode::Ln, a);
+                }
+                break;
+            case OpCode::Sin: adjoint[ins.a] += g * apply_unary(OpCode::Cos, a); break;
+            case OpCode::Cos: adjoint[ins.a] += g * (apply_unary(OpCode::Sin, a) * T(-1)); break;
+            case OpCode::Ln: adjoint[ins.a] += g / a; break;
+            case OpCode::Exp: adjoint[ins.a] += g * value[i]; break;
+            default: break;
         }
-        case '^' : {
-            auto left_part1 = std::make_shared<BinaryOperation<T>>(
-                left, std::make_shared<BinaryOperation<T>>(right, std::make_shared<Value<T>>(1),'-'), '^');
-            auto left_part2 = std::make_shared<BinaryOperation<T>>(
-                right, left_part1, '*');
-            auto left_part3 = std::make_shared<BinaryOperation<T>>(
-                left_part2, left->diff(name), '*');
-
-            auto right_part1 = std::make_shared<BinaryOperation<T>>(
-                left, right, '^');
-            auto right_part2 = std::make_shared<BinaryOperation<T>>(
-                right_part1, std::make_shared<UnaryOperation<T>>(left, "ln"), '*');
-            auto right_part3 = std::make_shared<BinaryOperation<T>>(
-                right_part2, right->diff(name), '*');
+    }
+    return value[n - 1];
+}
 
-            return std::make_shared<BinaryOperation<T>>(
-                left_part3, right_part3, '+');
+template<typename T>
+template<std::size_t K>
+Taylor<T, K> Program<T>::eval_taylor(std::span<const T> point, std::span<const T> direction) const {
+    if (point.size() < variables_.size() || direction.size() < variables_.size()) {
+        throw std::runtime_error("Not enough values for compiled expression");
+    }
+    std::array<Taylor<T, K>, 64> fixed;
+    std::vector<Taylor<T, K>> dynamic;
+    Taylor<T, K>* registers = fixed.data();
+    if (registers_ > fixed.size()) {
+        dynamic.resize(registers_);
+        registers = dynamic.data();
+    }
+    for (const Instruction& ins : code_) {
+        Taylor<T, K>& dst = registers[ins.dst];
+        switch (ins.op) {
+            case OpCode::Constant:
+                dst = Taylor<T, K>();
+                dst.c[0] = constants_[ins.a];
+                break;
+            case OpCode::Variable:
+                dst = Taylor<T, K>();
+                dst.c[0] = point[ins.a];
+                if constexpr (K > 0) {
+                    dst.c[1] = direction[ins.a];
+                }
+                break;
+            case OpCode::Add: dst = registers[ins.a] + registers[ins.b]; break;
+            case OpCode::Sub: dst = registers[ins.a] - registers[ins.b]; break;
+            case OpCode::Mul: dst = registers[ins.a] * registers[ins.b]; break;
+            case OpCode::Div: dst = registers[ins.a] / registers[ins.b]; break;
+            case OpCode::Pow: dst = pow(registers[ins.a], registers[ins.b]); break;
+            case OpCode::Sin: dst = sin(registers[ins.a]); break;
+            case OpCode::Cos: dst = cos(registers[ins.a]); break;
+            case OpCode::Exp: dst = exp(registers[ins.a]); break;
+            case OpCode::Ln: dst = ln(registers[ins.a]); break;
         }
-        default: throw std::runtime_error("Unknown operation: " + op);
     }
+    return registers[code_.back().dst];
 }
 
 template<typename T>
-std::shared_ptr<Node<T>> BinaryOperation<T>::substitute(std::map<std::string, T> context) {
-    return std::make_shared<BinaryOperation<T>>(left->substitute(context), right->substitute(context), op);
+std::size_t Program<T>::gradient_scratch_size() const {
+    return 2 * ssa_.size();
 }
 
 template<typename T>
-UnaryOperation<T>::UnaryOperation(std::shared_ptr<Node<T>> val, std::string o)
-    : value(val), op(o) {}
+const std::vector<Instruction>& Program<T>::code() const {
+    return code_;
+}
 
 template<typename T>
-UnaryOperation<T>::~UnaryOperation() = default;
+const std::vector<Instruction>& Program<T>::ssa() const {
+    return ssa_;
+}
 
 template<typename T>
-std::string UnaryOperation<T>::to_string() {
-    return op + "(" + value->to_string() + ")";
+const std::vector<T>& Program<T>::constants() const {
+    return constants_;
 }
 
 template<typename T>
-T UnaryOperation<T>::eval(std::map<std::string, T> context) {
-    T a = value->eval(context);
-    if (op == "sin") return std::sin(a);
-    if (op == "cos") return std::cos(a);
-    if (op == "ln") return std::log(a);
-    if (op == "exp") return std::exp(a);
-    throw std::runtime_error("Unknown function: " + op);
+const std::vector<std::string>& Program<T>::variables() const {
+    return variables_;
 }
 
 template<typename T>
-std::shared_ptr<Node<T>> UnaryOperation<T>::diff(std::string name) {
-    if (op == "sin") {
-        return std::make_shared<BinaryOperation<T>>(
-            std::make_shared<UnaryOperation<T>>(value, "cos"), value->diff(name), '*');
+std::uint32_t Program<T>::registers() const {
+    return registers_;
+}
+
+// Spelling of T and of its values in generated source. Floating constants
+// are written as hex literals so they round-trip exactly.
+template <typename T>
+std::string native_type_name() {
+    if constexpr (std::is_same_v<T, float>) return "float";
+    else if constexpr (std::is_same_v<T, double>) return "double";
+    else if constexpr (std::is_same_v<T, long double>) return "long double";
+    else if constexpr (std::is_same_v<T, int>) return "int";
+    else if constexpr (std::is_same_v<T, long>) return "long";
+    else if constexpr (std::is_same_v<T, long long>) return "long long";
+    else if constexpr (std::is_same_v<T, std::complex<float>>) return "std::complex<float>";
+    else if constexpr (std::is_same_v<T, std::complex<double>>) return "std::complex<double>";
+    else if constexpr (std::is_same_v<T, std::complex<long double>>) return "std::complex<long double>";
+    else throw std::runtime_error("No native code generation for this value type");
+}
+
+template <typename T>
+std::string native_literal(T value) {
+    if constexpr (std::is_integral_v<T>) {
+        return "T(" + std::to_string(value) + "LL)";
+    } else if constexpr (std::is_floating_point_v<T>) {
+        std::ostringstream out;
+        if (std::isnan(value)) {
+            out << "__builtin_nanl(\"\")";
+        } else if (std::isinf(value)) {
+            out << (value < 0 ? "-" : "") << "__builtin_infl()";
+        } else {
+            out << std::hexfloat << static_cast<long double>(value) << "L";
+        }
+        return out.str();
+    } else {
+        return "T(" + native_literal(value.real()) + ", " + native_literal(value.imag()) + ")";
     }
-    if (op == "cos") {
-        return std::make_shared<BinaryOperation<T>>(
-            std::make_shared<BinaryOperation<T>>(std::make_shared<UnaryOperation<T>>(value, "sin"),std::make_shared<Value<T>>(-1),'*'),
-            value->diff(name), '*');
+}
+
+template<typename T>
+std::string Program<T>::native_source() const {
+    std::ostringstream out;
+    out << "#include <cmath>\n#include <complex>\n#include <cstddef>\n\n"
+        << "using T = " << native_type_name<T>() << ";\n"
+        << "using std::pow;\n\n"
+        << "template <typename Load>\n"
+        << "static inline T evaluate(Load load) {\n";
+    for (std::size_t i = 0; i < ssa_.size(); i++) {
+        const Instruction& ins = ssa_[i];
+        out << "    T r" << i << " = ";
+        switch (ins.op) {
+            case OpCode::Constant: out << "T(" << native_literal(constants_[ins.a]) << ")"; break;
+            case OpCode::Variable: out << "load(" << ins.a << ")"; break;
+            case OpCode::Add:
+            case OpCode::Sub:
+            case OpCode::Mul:
+            case OpCode::Div: out << "r" << ins.a << " " << binary_symbol(ins.op) << " r" << ins.b; break;
+            case OpCode::Pow: out << "T(pow(r" << ins.a << ", r" << ins.b << "))"; break;
+            case OpCode::Ln: out << "T(std::log(r" << ins.a << "))"; break;
+            default: out << "T(std::" << unary_name(ins.op) << "(r" << ins.a << "))"; break;
+        }
+        out << ";\n";
     }
-    if (op == "ln") {
-        return std::make_shared<BinaryOperation<T>>(
-            value->diff(name), value, '/');
+    out << "    return r" << ssa_.size() - 1 << ";\n}\n\n"
+        << "extern \"C\" void expression_eval(const T* values, T* result) {\n"
+        << "    *result = evaluate([&](std::size_t slot) { return values[slot]; });\n}\n\n"
+        << "extern \"C\" void expression_eval_batch(const T* const* columns, T* out, std::size_t rows) {\n"
+        << "    for (std::size_t row = 0; row < rows; row++) {\n"
+        << "        out[row] = evaluate([&](std::size_t slot) { return columns[slot][row]; });\n"
+        << "    }\n}\n";
+    return out.str();
+}
+
+template<typename T>
+NativeProgram<T> Program<T>::compile_native(const NativeOptions& options) const {
+    NativeProgram<T> result;
+    result.library_ = NativeLibrary::load(native_source(), options);
+    result.scalar_ = reinterpret_cast<typename NativeProgram<T>::Scalar>(result.library_->symbol("expression_eval"));
+    result.batch_ = reinterpret_cast<typename NativeProgram<T>::Batch>(result.library_->symbol("expression_eval_batch"));
+    result.variables_ = variables_;
+    return result;
+}
+
+template<typename T>
+T NativeProgram<T>::eval(std::span<const T> values) const {
+    EXPRESSION_PROFILE_PHASE(Eval);
+    if (values.size() < variables_.size()) {
+        throw std::runtime_error("Not enough values for compiled expression");
     }
-    if (op == "exp") {
-        return std::make_shared<BinaryOperation<T>>(
-            std::make_shared<UnaryOperation<T>>(value, "exp"), value->diff(name), '*');
+    T result;
+    scalar_(values.data(), &result);
+    return result;
+}
+
+template<typename T>
+void NativeProgram<T>::eval_batch(std::span<const T* const> columns, std::span<T> out) const {
+    EXPRESSION_PROFILE_PHASE(Eval);
+    if (columns.size() < variables_.size()) {
+        throw std::runtime_error("Not enough columns for compiled expression");
     }
-    throw std::runtime_error("Unknown function: " + op);
+    batch_(columns.data(), out.data(), out.size());
 }
 
 template<typename T>
-std::shared_ptr<Node<T>> UnaryOperation<T>::substitute(std::map<std::string, T> context) {
-    return std::make_shared<UnaryOperation<T>>(value->substitute(context),op);
+const std::vector<std::string>& NativeProgram<T>::variables() const {
+    return variables_;
+}
+
+template<typename T>
+std::size_t NativeProgram<T>::slot(const std::string& name) const {
+    auto it = std::find(variables_.begin(), variables_.end(), name);
+    if (it == variables_.end()) {
+        throw std::runtime_error("Variable not found: " + name);
+    }
+    return static_cast<std::size_t>(it - variables_.begin());
+}
+
+template<typename T>
+const NativeLibrary& NativeProgram<T>::library() const {
+    return *library_;
 }
 
 template<typename T>
 Expression<T>::Expression(std::shared_ptr<Node<T>> impl) : impl_(impl) {}
 
 template<typename T>
-Expression<T>::Expression(std::string variable) : impl_(std::make_shared<Variable<T>>(variable)) {}
+Expression<T>::Expression(std::string variable) : impl_(make_variable<T>(variable)) {}
+
+template<typename T>
+Expression<T>::Expression(T value) : impl_(make_value<T>(value)) {}
+
+
+template<typename T>
+T Expression<T>::eval(const EvalContext<T>& context) {
+    EXPRESSION_PROFILE_PHASE(Eval);
+    EvalMemo<T> memo;
+    return impl_->eval(context, memo);
+}
+
+template<typename T>
+void Expression<T>::eval_batch(const std::map<std::string, std::span<const T>>& columns, std::span<T> out) {
+    auto program = compile();
+    program.eval_batch(program.bind_columns(columns, out.size()), out);
+}
+
+template<typename T>
+void Expression<T>::eval_batch(const std::map<std::string, std::span<const T>>& columns, std::span<T> out, ThreadPool& pool) {
+    auto program = compile();
+    program.eval_batch(program.bind_columns(columns, out.size()), out, pool);
+}
+
+template<typename T>
+Gradient<T> Expression<T>::gradient(const std::map<std::string, T>& context) {
+    auto program = compile();
+    std::vector<T> partials(program.variables().size());
+    Gradient<T> result;
+    result.value = program.gradient(program.bind(context), partials);
+    for (const auto& entry : context) {
+        result.partials[entry.first] = T(0);
+    }
+    for (std::size_t i = 0; i < partials.size(); i++) {
+        result.partials[program.variables()[i]] = partials[i];
+    }
+    return result;
+}
+
+template<typename T>
+template<std::size_t K>
+std::array<T, K + 1> Expression<T>::derivatives(const std::map<std::string, T>& context, const std::map<std::string, T>& direction) {
+    auto program = compile();
+    std::vector<T> along(program.variables().size(), T(0));
+    for (std::size_t i = 0; i < along.size(); i++) {
+        auto it = direction.find(program.variables()[i]);
+        if (it != direction.end()) {
+            along[i] = it->second;
+        }
+    }
+    auto series = program.template eval_taylor<K>(program.bind(context), along);
+    std::array<T, K + 1> result;
+    for (std::size_t k = 0; k <= K; k++) {
+        result[k] = series.derivative(k);
+    }
+    return result;
+}
+
+template<typename T>
+Expression<T> Expression<T>::diff(std::string name, bool simplified) {
+    EXPRESSION_PROFILE_PHASE(Diff);
+    NodeMemo<T> memo;
+    Expression<T> result(diff_node(impl_, variable_id<T>(name), memo));
+    return simplified ? result.simplify() : result;
+}
+
+template<typename T>
+Expression<T> Expression<T>::diff(const std::string& name, DiffCache<T>& cache, bool simplified) {
+    EXPRESSION_PROFILE_PHASE(Diff);
+    Expression<T> result(cache.diff(impl_, name));
+    return simplified ? result.simplify() : result;
+}
+
+template<typename T>
+ExpressionMatrix<T> Expression<T>::hessian(const std::vector<std::string>& variables, bool simplified) {
+    DiffCache<T> cache;
+    return hessian(variables, cache, simplified);
+}
+
+template<typename T>
+ExpressionMatrix<T> Expression<T>::hessian(const std::vector<std::string>& variables, DiffCache<T>& cache, bool simplified) {
+    std::size_t n = variables.size();
+    std::vector<Expression<T>> first;
+    first.reserve(n);
+    for (const auto& name : variables) {
+        first.push_back(diff(name, cache, simplified));
+    }
+    ExpressionMatrix<T> result(n);
+    for (std::size_t i = 0; i < n; i++) {
+        result[i].reserve(n);
+        for (std::size_t j = 0; j < i; j++) {
+            result[i].push_back(result[j][i]);
+        }
+        for (std::size_t j = i; j < n; j++) {
+            result[i].push_back(first[i].diff(variables[j], cache, simplified));
+        }
+    }
+    return result;
+}
+
+template <typename T>
+ExpressionMatrix<T> jacobian(const std::vector<Expression<T>>& functions, const std::vector<std::string>& variables, bool simplified) {
+    DiffCache<T> cache;
+    return jacobian(functions, variables, cache, simplified);
+}
+
+template <typename T>
+ExpressionMatrix<T> jacobian(const std::vector<Expression<T>>& functions, const std::vector<std::string>& variables, DiffCache<T>& cache, bool simplified) {
+    ExpressionMatrix<T> result;
+    result.reserve(functions.size());
+    for (Expression<T> function : functions) {
+        std::vector<Expression<T>> row;
+        row.reserve(variables.size());
+        for (const auto& name : variables) {
+            row.push_back(function.diff(name, cache, simplified));
+        }
+        result.push_back(std::move(row));
+    }
+    return result;
+}
+
+template <typename T>
+SparseMatrix<T> sparse_jacobian(const std::vector<Expression<T>>& functions, const std::vector<std::string>& variables, bool simplified) {
+    DiffCache<T> cache;
+    return sparse_jacobian(functions, variables, cache, simplified);
+}
+
+template <typename T>
+SparseMatrix<T> sparse_jacobian(const std::vector<Expression<T>>& functions, const std::vector<std::string>& variables, DiffCache<T>& cache, bool simplified) {
+    SparseMatrix<T> result;
+    for (std::size_t i = 0; i < functions.size(); i++) {
+        Expression<T> function = functions[i];
+        for (std::size_t j = 0; j < variables.size(); j++) {
+            if (!function.depends_on(variables[j])) {
+                continue;
+            }
+            Expression<T> partial = function.diff(variables[j], cache, simplified);
+            if (!is_constant_equal(partial.node(), T(0))) {
+                result.push_back({i, j, std::move(partial)});
+            }
+        }
+    }
+    return result;
+}
+
+template<typename T>
+SparseMatrix<T> Expression<T>::sparse_hessian(const std::vector<std::string>& variables, bool simplified) {
+    DiffCache<T> cache;
+    return sparse_hessian(variables, cache, simplified);
+}
+
+template<typename T>
+SparseMatrix<T> Expression<T>::sparse_hessian(const std::vector<std::string>& variables, DiffCache<T>& cache, bool simplified) {
+    SparseMatrix<T> result;
+    for (std::size_t i = 0; i < variables.size(); i++) {
+        if (!depends_on(variables[i])) {
+            continue;
+        }
+        Expression<T> first = diff(variables[i], cache, simplified);
+        for (std::size_t j = i; j < variables.size(); j++) {
+            if (!first.depends_on(variables[j])) {
+                continue;
+            }
+            Expression<T> second = first.diff(variables[j], cache, simplified);
+            if (is_constant_equal(second.node(), T(0))) {
+                continue;
+            }
+            if (i != j) {
+                result.push_back({j, i, second});
+            }
+            result.push_back({i, j, std::move(second)});
+        }
+    }
+    std::sort(result.begin(), result.end(), [](const SparseEntry<T>& a, const SparseEntry<T>& b) {
+        return a.row != b.row ? a.row < b.row : a.col < b.col;
+    });
+    return result;
+}
 
 template<typename T>
-Expression<T>::Expression(T value) : impl_(std::make_shared<Value<T>>(value)) {}
+bool Expression<T>::depends_on(const std::string& name) const {
+    return impl_->dependencies().contains(variable_id<T>(name));
+}
 
+template<typename T>
+Expression<T> Expression<T>::substitute(const EvalContext<T>& context, bool simplified) {
+    EXPRESSION_PROFILE_PHASE(Substitute);
+    NodeMemo<T> memo;
+    Expression<T> result(substitute_node(impl_, context, memo));
+    return simplified ? result.simplify() : result;
+}
 
 template<typename T>
-T Expression<T>::eval(std::map<std::string, T> context) {
-    return impl_->eval(context);
+Expression<T> Expression<T>::simplify() {
+    NodeMemo<T> memo;
+    return Expression<T>(simplify_node(impl_, memo));
 }
 
 template<typename T>
-Expression<T> Expression<T>::diff(std::string name) {
-    return Expression<T>(impl_->diff(name));
+Program<T> Expression<T>::compile() {
+    Compiler<T> compiler;
+    compiler.lower(impl_);
+    return compiler.finish();
 }
 
 template<typename T>
-Expression<T> Expression<T>::substitute(std::map<std::string, T> context) {
-    return Expression<T>(impl_->substitute(context));
+NativeProgram<T> Expression<T>::compile_native(const NativeOptions& options) {
+    return compile().compile_native(options);
 }
 
+// Writes an expression graph as text. Work items sit on an explicit stack,
+// so deep trees do not recurse, and text is collected in a buffer handed to
+// the stream in large pieces.
+template <typename T>
+class ExpressionWriter {
+public:
+    ExpressionWriter(const WriteOptions& options, std::ostream* out) : options_(options), out_(out) {}
+
+    // Writes the expression; returns what was not yet handed to the stream
+    // (everything when there is none).
+    std::string run(const Node<T>* root) {
+        bind(root);
+        for (std::size_t k = 0; k < bindings_.size(); k++) {
+            switch (options_.format) {
+                case OutputFormat::Infix: emit("let "); emit(names_[k]); emit(" = "); break;
+                case OutputFormat::LaTeX: emit(k == 0 ? "\\begin{aligned}\n" : ""); emit(names_[k]); emit(" &= "); break;
+                case OutputFormat::C: emit("const "); emit(c_type()); emit(" "); emit(names_[k]); emit(" = "); break;
+            }
+            expression(bindings_[k]);
+            emit(options_.format == OutputFormat::LaTeX ? " \\\\\n" : options_.format == OutputFormat::C ? ";\n" : "\n");
+        }
+        bool wrapped = !bindings_.empty();
+        if (wrapped && options_.format == OutputFormat::LaTeX) {
+            emit("f &= ");
+        } else if (wrapped && options_.format == OutputFormat::C) {
+            emit("return ");
+        }
+        expression(root);
+        if (wrapped && options_.format == OutputFormat::LaTeX) {
+            emit("\n\\end{aligned}");
+        } else if (wrapped && options_.format == OutputFormat::C) {
+            emit(";");
+        }
+        if (out_) {
+            out_->write(buffer_.data(), static_cast<std::streamsize>(buffer_.size()));
+            buffer_.clear();
+        }
+        return std::move(buffer_);
+    }
+
+private:
+    struct Item {
+        const Node<T>* node;  // nullptr for a piece of text
+        std::string_view text;
+        bool expand;          // a bound node's definition rather than its name
+    };
+
+    // Finds the operations reached through several parents and orders them
+    // so every binding comes after the bindings it uses.
+    void bind(const Node<T>* root) {
+        if (!options_.share_subexpressions) {
+            return;
+        }
+        std::unordered_map<const Node<T>*, std::size_t> parents = {{root, 0}};
+        std::unordered_set<std::string> variables;
+        std::vector<const Node<T>*> pending = {root};
+        while (!pending.empty()) {
+            const Node<T>* node = pending.back();
+            pending.pop_back();
+            if (node->opcode() == OpCode::Variable) {
+                variables.insert(static_cast<const Variable<T>*>(node)->get_name());
+            }
+            for (std::size_t i = 0; i < node->arity(); i++) {
+                const Node<T>* child = node->child(i).get();
+                if (parents[child]++ == 0) {
+                    pending.push_back(child);
+                }
+            }
+        }
+        std::unordered_set<const Node<T>*> done;
+        std::vector<std::pair<const Node<T>*, bool>> stack = {{root, false}};
+        while (!stack.empty()) {
+            auto [node, expanded] = stack.back();
+            stack.pop_back();
+            if (expanded) {
+                if (node != root && node->arity() > 0 && parents[node] > 1) {
+                    bound_.emplace(node, bindings_.size());
+                    bindings_.push_back(node);
+                }
+                continue;
+            }
+            if (!done.insert(node).second) {
+                continue;
+            }
+            stack.push_back({node, true});
+            for (std::size_t i = node->arity(); i-- > 0;) {
+                stack.push_back({node->child(i).get(), false});
+            }
+        }
+        std::size_t counter = 0;
+        for (std::size_t k = 0; k < bindings_.size(); k++) {
+            std::string name;
+            do {
+                name = options_.format == OutputFormat::LaTeX ? "t_{" + std::to_string(counter++) + "}" : "t" + std::to_string(counter++);
+            } while (variables.count(name));
+            names_.push_back(std::move(name));
+        }
+    }
+
+    void expression(const Node<T>* root) {
+        stack_.push_back({root, {}, true});
+        while (!stack_.empty()) {
+            Item item = stack_.back();
+            stack_.pop_back();
+            if (!item.node) {
+                emit(item.text);
+                continue;
+            }
+            const Node<T>* node = item.node;
+            if (!item.expand && !bound_.empty()) {
+                auto it = bound_.find(node);
+                if (it != bound_.end()) {
+                    emit(names_[it->second]);
+                    continue;
+                }
+            }
+            OpCode op = node->opcode();
+            if (op == OpCode::Constant) {
+                constant(static_cast<const Value<T>*>(node)->get_value());
+            } else if (op == OpCode::Variable) {
+                emit(static_cast<const Variable<T>*>(node)->get_name());
+            } else if (!is_binary(op)) {
+                // Items are pushed in reverse order of output.
+                push(options_.format == OutputFormat::LaTeX ? "\\right)" : ")");
+                push(node->child(0).get());
+                push(function_open(op));
+            } else {
+                binary(node, op);
+            }
+        }
+    }
+
+    void binary(const Node<T>* node, OpCode op) {
+        const Node<T>* left = node->child(0).get();
+        const Node<T>* right = node->child(1).get();
+        bool wrap = !options_.minimal_parentheses;
+        if (wrap) {
+            push(")");
+        }
+        if (options_.format == OutputFormat::C && op == OpCode::Pow) {
+            push(")");
+            operand(right, op, true);
+            push(", ");
+            operand(left, op, false);
+            push(std::is_same_v<T, std::complex<double>> ? "cpow(" : "pow(");
+        } else if (options_.format == OutputFormat::LaTeX && op == OpCode::Div) {
+            push("}");
+            operand(right, op, true);
+            push("}{");
+            operand(left, op, false);
+            push("\\frac{");
+        } else if (options_.format == OutputFormat::LaTeX && op == OpCode::Pow) {
+            push("}");
+            operand(right, op, true);
+            push("}^{");
+            operand(left, op, false);
+            push("{");
+        } else {
+            operand(right, op, true);
+            push(operator_text(op));
+            operand(left, op, false);
+        }
+        if (wrap) {
+            push("(");
+        }
+    }
+
+    void operand(const Node<T>* child, OpCode parent, bool right) {
+        bool parens = options_.minimal_parentheses && needs_parentheses(child, parent, right);
+        if (parens) {
+            push(options_.format == OutputFormat::LaTeX ? "\\right)" : ")");
+        }
+        push(child);
+        if (parens) {
+            push(options_.format == OutputFormat::LaTeX ? "\\left(" : "(");
+        }
+    }
+
+    // Infix follows the parser, which groups equal priorities to the right:
+    // only a left operand of the same priority needs parentheses. C and
+    // LaTeX group to the left, so there it is the right operand, which
+    // keeps the tree, and with it the rounding, exactly as built.
+    bool needs_parentheses(const Node<T>* child, OpCode parent, bool right) const {
+        bool latex = options_.format == OutputFormat::LaTeX;
+        bool c = options_.format == OutputFormat::C;
+        if ((c && parent == OpCode::Pow) || (latex && parent == OpCode::Div) || (latex && parent == OpCode::Pow && right)) {
+            return false;
+        }
+        if (bound_.count(child)) {
+            return false;
+        }
+        OpCode op = child->opcode();
+        if (op == OpCode::Constant) {
+            return compound(static_cast<const Value<T>*>(child)->get_value());
+        }
+        if (latex && parent == OpCode::Pow) {
+            return op != OpCode::Variable;
+        }
+        if (!is_binary(op)) {
+            return false;
+        }
+        if ((c && op == OpCode::Pow) || (latex && op == OpCode::Div)) {
+            return false;
+        }
+        int inner = priority(op);
+        int outer = priority(parent);
+        if (options_.format == OutputFormat::Infix) {
+            return right ? inner < outer : inner <= outer;
+        }
+        return right ? inner <= outer : inner < outer;
+    }
+
+    static int priority(OpCode op) {
+        switch (op) {
+            case OpCode::Add: case OpCode::Sub: return 1;
+            case OpCode::Mul: case OpCode::Div: return 2;
+            default: return 3;
+        }
+    }
+
+    // Constants written with a sign or as a sum, which need parentheses
+    // as operands.
+    bool compound(const T& value) const {
+        if constexpr (std::is_same_v<T, std::complex<double>>) {
+            if (options_.format == OutputFormat::C) {
+                return false;
+            }
+            if (value.real() != 0 && value.imag() != 0) {
+                return true;
+            }
+            return std::signbit(value.imag() == 0 ? value.real() : value.imag());
+        } else if constexpr (std::is_integral_v<T>) {
+            return value < 0;
+        } else {
+            // Infix writes non-finite values parenthesized already.
+            return std::signbit(value) && (std::isfinite(value) || options_.format != OutputFormat::Infix);
+        }
+    }
+
+    std::string_view operator_text(OpCode op) const {
+        bool spaced = options_.format != OutputFormat::Infix;
+        switch (op) {
+            case OpCode::Add: return spaced ? " + " : "+";
+            case OpCode::Sub: return spaced ? " - " : "-";
+            case OpCode::Mul: return options_.format == OutputFormat::LaTeX ? " \\cdot " : spaced ? " * " : "*";
+            case OpCode::Div: return spaced ? " / " : "/";
+            default: return "^";
+        }
+    }
+
+    std::string_view function_open(OpCode op) const {
+        static constexpr std::string_view infix[] = {"sin(", "cos(", "exp(", "ln("};
+        static constexpr std::string_view latex[] = {"\\sin\\left(", "\\cos\\left(", "\\exp\\left(", "\\ln\\left("};
+        static constexpr std::string_view c_real[] = {"sin(", "cos(", "exp(", "log("};
+        static constexpr std::string_view c_complex[] = {"csin(", "ccos(", "cexp(", "clog("};
+        std::size_t index = static_cast<std::size_t>(op) - static_cast<std::size_t>(OpCode::Sin);
+        switch (options_.format) {
+            case OutputFormat::LaTeX: return latex[index];
+            case OutputFormat::C: return std::is_same_v<T, std::complex<double>> ? c_complex[index] : c_real[index];
+            default: return infix[index];
+        }
+    }
+
+    static std::string_view c_type() {
+        if constexpr (std::is_same_v<T, std::complex<double>>) {
+            return "double complex";
+        } else if constexpr (std::is_integral_v<T>) {
+            return "long long";
+        } else {
+            return "double";
+        }
+    }
+
+    void constant(const T& value) {
+        if constexpr (std::is_same_v<T, std::complex<double>>) {
+            if (!options_.exact_numbers) {
+                emit("(" + std::to_string(value.real()) + "," + std::to_string(value.imag()) + ")");
+            } else if (options_.format == OutputFormat::C) {
+                emit("CMPLX(");
+                real(value.real());
+                emit(", ");
+                real(value.imag());
+                emit(")");
+            } else if (options_.format == OutputFormat::Infix
+                       && (!std::isfinite(value.real()) || !std::isfinite(value.imag()))) {
+                // A quotient like (1/0) read back as complex would not give
+                // the same parts.
+                throw std::runtime_error("Non-finite complex constant has no infix form");
+            } else if (value.imag() == 0) {
+                real(value.real());
+            } else {
+                bool latex = options_.format == OutputFormat::LaTeX;
+                if (value.real() != 0) {
+                    real(value.real());
+                    emit(std::signbit(value.imag()) ? (latex ? " - " : "-") : (latex ? " + " : "+"));
+                    real(std::abs(value.imag()));
+                } else {
+                    real(value.imag());
+                }
+                emit("i");
+            }
+        } else if constexpr (std::is_integral_v<T>) {
+            emit(std::to_string(value));
+        } else if (!options_.exact_numbers) {
+            emit(std::to_string(value));
+        } else {
+            real(value);
+        }
+    }
+
+    // Shortest round-trip decimal, spelled for the format.
+    void real(double value) {
+        if (std::isnan(value) || std::isinf(value)) {
+            const char* sign = std::signbit(value) ? "-" : "";
+            switch (options_.format) {
+                case OutputFormat::C: emit(std::isnan(value) ? "NAN" : std::string(sign) + "INFINITY"); break;
+                case OutputFormat::LaTeX: emit(std::isnan(value) ? "\\mathrm{NaN}" : std::string(sign) + "\\infty"); break;
+                // Quotients of constants the parser reads back as the same
+                // value, where `inf` would be read as a variable.
+                default: emit(std::isnan(value) ? "(0/0)" : "(" + std::string(sign) + "1/0)"); break;
+            }
+            return;
+        }
+        char text[32];
+        auto end = std::to_chars(text, text + sizeof(text), value).ptr;
+        std::string_view number(text, static_cast<std::size_t>(end - text));
+        std::size_t e = number.find('e');
+        if (options_.format == OutputFormat::LaTeX && e != std::string_view::npos) {
+            std::string_view exponent = number.substr(e + 1);
+            bool negative = exponent[0] == '-';
+            exponent.remove_prefix(exponent[0] == '-' || exponent[0] == '+' ? 1 : 0);
+            while (exponent.size() > 1 && exponent[0] == '0') {
+                exponent.remove_prefix(1);
+            }
+            emit(number.substr(0, e));
+            emit(" \\cdot 10^{");
+            emit(negative ? "-" : "");
+            emit(exponent);
+            emit("}");
+            return;
+        }
+        emit(number);
+        if (options_.format == OutputFormat::C && number.find_first_of(".e") == std::string_view::npos) {
+            emit(".0");
+        }
+    }
+
+    void push(std::string_view text) {
+        stack_.push_back({nullptr, text, false});
+    }
+
+    void push(const Node<T>* node) {
+        stack_.push_back({node, {}, false});
+    }
+
+    void emit(std::string_view text) {
+        buffer_.append(text);
+        if (out_ && buffer_.size() >= (1 << 16)) {
+            out_->write(buffer_.data(), static_cast<std::streamsize>(buffer_.size()));
+            buffer_.clear();
+        }
+    }
+
+    const WriteOptions& options_;
+    std::ostream* out_;
+    std::string buffer_;
+    std::vector<Item> stack_;
+    std::vector<const Node<T>*> bindings_;
+    std::vector<std::string> names_;
+    std::unordered_map<const Node<T>*, std::size_t> bound_;
+};
+
 template<typename T>
 std::string Expression<T>::to_string() {
-    return impl_->to_string();
+    return to_string(WriteOptions{OutputFormat::Infix, false, false, false});
+}
+
+template<typename T>
+std::string Expression<T>::to_string(const WriteOptions& options) {
+    return ExpressionWriter<T>(options, nullptr).run(impl_.get());
+}
+
+template<typename T>
+void Expression<T>::write(std::ostream& out, const WriteOptions& options) {
+    ExpressionWriter<T>(options, &out).run(impl_.get());
+}
+
+template<typename T>
+std::size_t Expression<T>::node_count() {
+    std::unordered_set<const Node<T>*> seen;
+    std::vector<const Node<T>*> stack = {impl_.get()};
+    while (!stack.empty()) {
+        const Node<T>* node = stack.back();
+        stack.pop_back();
+        if (!seen.insert(node).second) {
+            continue;
+        }
+        for (std::size_t i = 0; i < node->arity(); i++) {
+            stack.push_back(node->child(i).get());
+        }
+    }
+    return seen.size();
+}
+
+// Post-order walk with an explicit stack; every node is finished once its
+// children are, so shared subtrees are measured once.
+template<typename T>
+ExpressionShape Expression<T>::shape() {
+    struct Measure {
+        std::size_t depth;
+        std::uint64_t total;
+    };
+    std::unordered_map<const Node<T>*, Measure> measured;
+    std::vector<std::pair<const Node<T>*, bool>> stack = {{impl_.get(), false}};
+    while (!stack.empty()) {
+        auto [node, expanded] = stack.back();
+        stack.pop_back();
+        if (measured.count(node)) {
+            continue;
+        }
+        if (!expanded) {
+            stack.push_back({node, true});
+            for (std::size_t i = 0; i < node->arity(); i++) {
+                stack.push_back({node->child(i).get(), false});
+            }
+            continue;
+        }
+        Measure measure{1, 1};
+        for (std::size_t i = 0; i < node->arity(); i++) {
+            const Measure& child = measured.at(node->child(i).get());
+            measure.depth = std::max(measure.depth, child.depth + 1);
+            measure.total = child.total > UINT64_MAX - measure.total ? UINT64_MAX : measure.total + child.total;
+        }
+        measured.emplace(node, measure);
+    }
+    const Measure& root = measured.at(impl_.get());
+    return ExpressionShape{root.depth, measured.size(), root.total};
 }
 
 template<typename T>
@@ -233,47 +2656,47 @@ std::shared_ptr<Node<T>> Expression<T>::node() {
 
 template<typename T>
 Expression<T> operator+(const Expression<T>& lhs, const Expression<T>& rhs) {
-    return Expression<T>(std::make_shared<BinaryOperation<T>>(lhs.impl_, rhs.impl_, '+'));
+    return Expression<T>(make_binary<T>(lhs.impl_, rhs.impl_, OpCode::Add));
 }
 
 template<typename T>
 Expression<T> operator-(const Expression<T>& lhs, const Expression<T>& rhs) {
-    return Expression<T>(std::make_shared<BinaryOperation<T>>(lhs.impl_, rhs.impl_, '-'));
+    return Expression<T>(make_binary<T>(lhs.impl_, rhs.impl_, OpCode::Sub));
 }
 
 template<typename T>
 Expression<T> operator*(const Expression<T>& lhs, const Expression<T>& rhs) {
-    return Expression<T>(std::make_shared<BinaryOperation<T>>(lhs.impl_, rhs.impl_, '*'));
+    return Expression<T>(make_binary<T>(lhs.impl_, rhs.impl_, OpCode::Mul));
 }
 
 template<typename T>
 Expression<T> operator/(const Expression<T>& lhs, const Expression<T>& rhs) {
-    return Expression<T>(std::make_shared<BinaryOperation<T>>(lhs.impl_, rhs.impl_, '/'));
+    return Expression<T>(make_binary<T>(lhs.impl_, rhs.impl_, OpCode::Div));
 }
 
 template<typename T>
 Expression<T> operator^(const Expression<T>& lhs, const Expression<T>& rhs) {
-    return Expression<T>(std::make_shared<BinaryOperation<T>>(lhs.impl_, rhs.impl_, '^'));
+    return Expression<T>(make_binary<T>(lhs.impl_, rhs.impl_, OpCode::Pow));
 }
 
 template<typename T>
 Expression<T> sin(const Expression<T>& that) {
-    return Expression<T>(std::make_shared<UnaryOperation<T>>(that.impl_, "sin"));
+    return Expression<T>(make_unary<T>(that.impl_, OpCode::Sin));
 }
 
 template<typename T>
 Expression<T> cos(const Expression<T>& that) {
-    return Expression<T>(std::make_shared<UnaryOperation<T>>(that.impl_, "cos"));
+    return Expression<T>(make_unary<T>(that.impl_, OpCode::Cos));
 }
 
 template<typename T>
 Expression<T> exp(const Expression<T>& that) {
-    return Expression<T>(std::make_shared<UnaryOperation<T>>(that.impl_, "exp"));
+    return Expression<T>(make_unary<T>(that.impl_, OpCode::Exp));
 }
 
 template<typename T>
 Expression<T> ln(const Expression<T>& that) {
-    return Expression<T>(std::make_shared<UnaryOperation<T>>(that.impl_, "ln"));
+    return Expression<T>(make_unary<T>(that.impl_, OpCode::Ln));
 }
 
 /*
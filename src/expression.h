@@ -5,16 +5,158 @@
 #include <memory>
 #include <string>
 #include <map>
+#include <array>
+#include <cstdint>
+#include <initializer_list>
+#include <span>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
+#include "native.h"
+#include "profile.h"
+#include "thread_pool.h"
+
+// Operation codes shared by the node classes and the compiled Program.
+enum class OpCode : std::uint8_t {
+    Constant,
+    Variable,
+    Add,
+    Sub,
+    Mul,
+    Div,
+    Pow,
+    Sin,
+    Cos,
+    Exp,
+    Ln
+};
+
+// One step of a compiled Program: registers[dst] = op(registers[a], registers[b]).
+// For Constant `a` indexes the constant pool, for Variable it is the variable slot.
+struct Instruction {
+    OpCode op;
+    std::uint32_t dst;
+    std::uint32_t a;
+    std::uint32_t b;
+};
+
+template <typename T>
+class Compiler;
+
+// Truncated Taylor series c[0] + c[1] t + ... + c[K] t^K. Evaluating a program
+// over it with x = point + t * direction yields the directional derivatives
+// f^(j) = j! * c[j]. Taylor<T, 1> is a dual number.
+template <typename T, std::size_t K>
+struct Taylor {
+    std::array<T, K + 1> c{};
+
+    T derivative(std::size_t order) const;
+};
+
+template <typename T, std::size_t K>
+Taylor<T, K> operator+(const Taylor<T, K>& a, const Taylor<T, K>& b);
+template <typename T, std::size_t K>
+Taylor<T, K> operator-(const Taylor<T, K>& a, const Taylor<T, K>& b);
+template <typename T, std::size_t K>
+Taylor<T, K> operator*(const Taylor<T, K>& a, const Taylor<T, K>& b);
+template <typename T, std::size_t K>
+Taylor<T, K> operator/(const Taylor<T, K>& a, const Taylor<T, K>& b);
+template <typename T, std::size_t K>
+Taylor<T, K> pow(const Taylor<T, K>& a, const Taylor<T, K>& b);
+template <typename T, std::size_t K>
+Taylor<T, K> sin(const Taylor<T, K>& a);
+template <typename T, std::size_t K>
+Taylor<T, K> cos(const Taylor<T, K>& a);
+template <typename T, std::size_t K>
+Taylor<T, K> exp(const Taylor<T, K>& a);
+template <typename T, std::size_t K>
+Taylor<T, K> ln(const Taylor<T, K>& a);
+
+template <typename T>
+class Node;
+
+// Per-call caches keyed by node identity, so a node reachable through several
+// parents is evaluated, differentiated or substituted once per call.
 template <typename T>
-class Node {
+using EvalMemo = std::unordered_map<const Node<T>*, T>;
+template <typename T>
+using NodeMemo = std::unordered_map<const Node<T>*, std::shared_ptr<Node<T>>>;
+
+// Id that no interned variable has; nothing depends on it.
+constexpr std::uint32_t no_variable = UINT32_MAX;
+
+// Set of interned variable ids. Ids below 64 are stored inline, so only
+// expressions over many variables pay for a heap allocation.
+class VariableSet {
+private:
+    std::uint64_t low_ = 0;
+    std::vector<std::uint64_t> high_;
 public:
-    Node() = default;
-    virtual ~Node() = default;
-    virtual std::string to_string() = 0;
-    virtual T eval(std::map<std::string,T> context) = 0;
-    virtual std::shared_ptr<Node<T>> diff(std::string name) = 0;
-    virtual std::shared_ptr<Node<T>> substitute(std::map<std::string,T> context) = 0;
+    VariableSet() = default;
+    explicit VariableSet(std::uint32_t id);
+    bool contains(std::uint32_t id) const;
+    bool empty() const;
+    bool intersects(const VariableSet& other) const;
+    VariableSet& operator|=(const VariableSet& other);
+    // Ids in increasing order.
+    std::vector<std::uint32_t> ids() const;
+};
+
+// Variable values indexed by interned variable id (see variable_id), so
+// evaluation reads a variable with one array load instead of a name lookup.
+// The name-based members intern names on first use, so a context may be
+// filled before the expressions using it are built. Converts implicitly from
+// a name -> value map or list, so `f.eval({{"x", 1.0}})` keeps working.
+template <typename T>
+class EvalContext {
+private:
+    std::vector<T> values_;
+    VariableSet bound_;
+public:
+    EvalContext() = default;
+    EvalContext(const std::map<std::string,T>& values);
+    EvalContext(std::initializer_list<std::pair<const std::string,T>> values);
+    void set(std::uint32_t id, T value);
+    void set(const std::string& name, T value);
+    // nullptr for variables without a value.
+    const T* find(std::uint32_t id) const;
+    const T* find(const std::string& name) const;
+    // Ids of the variables that have a value.
+    const VariableSet& variables() const;
+};
+
+template <typename T>
+class NodeTable;
+
+// Nodes are tagged with their OpCode and dispatched with a switch over it
+// instead of virtual calls; the concrete class is implied by the tag, so a
+// node carries no vtable pointer and no operator name.
+template <typename T>
+class Node : public std::enable_shared_from_this<Node<T>> {
+private:
+    // Low bits of the slot hash in the interning table, 0 for nodes that are
+    // not registered.
+    std::uint32_t interned_hash_ = 0;
+    OpCode op_;
+    friend class NodeTable<T>;
+protected:
+    // Variables the node's value depends on, fixed at construction.
+    VariableSet dependencies_;
+
+    explicit Node(OpCode op);
+    ~Node();
+public:
+    Node(const Node&) = delete;
+    Node& operator=(const Node&) = delete;
+    const VariableSet& dependencies() const;
+    OpCode opcode() const;
+    std::size_t arity() const;
+    const std::shared_ptr<Node<T>>& child(std::size_t index) const;
+    // Walks the tree with an explicit stack, so its depth is not bounded by
+    // the call stack.
+    T eval(const EvalContext<T>& context, EvalMemo<T>& memo);
 };
 
 template <typename T>
@@ -23,24 +165,24 @@ private:
     T value;
 public:
     explicit Value(T val);
-    ~Value() override;
-    std::string to_string() override;
-    T eval(std::map<std::string,T> context) override;
-    std::shared_ptr<Node<T>> diff(std::string name) override;
-    std::shared_ptr<Node<T>> substitute(std::map<std::string,T> context) override;
+    ~Value();
+    T get_value() const;
 };
 
 template <typename T>
 class Variable : public Node<T> {
 private:
-    std::string name;
+    // Points into the interning table's name list, which never moves or
+    // drops a name.
+    const std::string* name;
+    std::uint32_t id;
 public:
-    explicit Variable(std::string);
-    ~Variable() override;
-    std::string to_string() override;
-    T eval(std::map<std::string,T> context) override;
-    std::shared_ptr<Node<T>> diff(std::string name) override;
-    std::shared_ptr<Node<T>> substitute(std::map<std::string,T> context) override;
+    explicit Variable(const std::string& n, std::uint32_t i);
+    ~Variable();
+    const std::string& get_name() const;
+    std::uint32_t get_id() const;
+    std::shared_ptr<Node<T>> diff(std::uint32_t variable);
+    std::shared_ptr<Node<T>> substitute(const EvalContext<T>& context);
 };
 
 template <typename T>
@@ -48,28 +190,230 @@ class BinaryOperation : public Node<T> {
 private:
     std::shared_ptr<Node<T>> left;
     std::shared_ptr<Node<T>> right;
-    char op;
 public:
-    explicit BinaryOperation(std::shared_ptr<Node<T>> l, std::shared_ptr<Node<T>> r, char o);
-    ~BinaryOperation() override;
-    std::string to_string() override;
-    T eval(std::map<std::string,T> context) override;
-    std::shared_ptr<Node<T>> diff(std::string name) override;
-    std::shared_ptr<Node<T>> substitute(std::map<std::string,T> context) override;
+    explicit BinaryOperation(std::shared_ptr<Node<T>> l, std::shared_ptr<Node<T>> r, OpCode o);
+    ~BinaryOperation();
+    const std::shared_ptr<Node<T>>& child(std::size_t index) const;
+    // Derivative given those of the operands, null for an operand that does
+    // not depend on the variable.
+    std::shared_ptr<Node<T>> diff(const std::shared_ptr<Node<T>>& dl, const std::shared_ptr<Node<T>>& dr);
+    // The node with its operands replaced, folded when both are constant.
+    std::shared_ptr<Node<T>> substitute(std::shared_ptr<Node<T>> l, std::shared_ptr<Node<T>> r);
 };
 
 template <typename T>
 class UnaryOperation : public Node<T> {
 private:
     std::shared_ptr<Node<T>> value;
-    std::string op;
 public:
-    explicit UnaryOperation(std::shared_ptr<Node<T>> val, std::string o);
-    ~UnaryOperation() override;
-    std::string to_string() override;
-    T eval(std::map<std::string,T> context) override;
-    std::shared_ptr<Node<T>> diff(std::string name) override;
-    std::shared_ptr<Node<T>> substitute(std::map<std::string,T> context) override;
+    explicit UnaryOperation(std::shared_ptr<Node<T>> val, OpCode o);
+    ~UnaryOperation();
+    const std::shared_ptr<Node<T>>& child(std::size_t index) const;
+    std::shared_ptr<Node<T>> diff(const std::shared_ptr<Node<T>>& dv);
+    std::shared_ptr<Node<T>> substitute(std::shared_ptr<Node<T>> v);
+};
+
+// Node factories. Nodes are hash-consed: structurally identical
+// subexpressions built through these functions are the same node.
+template <typename T>
+std::shared_ptr<Node<T>> make_value(T value);
+template <typename T>
+std::shared_ptr<Node<T>> make_variable(const std::string& name);
+template <typename T>
+std::shared_ptr<Node<T>> make_binary(std::shared_ptr<Node<T>> left, std::shared_ptr<Node<T>> right, char op);
+template <typename T>
+std::shared_ptr<Node<T>> make_unary(std::shared_ptr<Node<T>> value, const std::string& op);
+template <typename T>
+std::shared_ptr<Node<T>> make_binary(std::shared_ptr<Node<T>> left, std::shared_ptr<Node<T>> right, OpCode op);
+template <typename T>
+std::shared_ptr<Node<T>> make_unary(std::shared_ptr<Node<T>> value, OpCode op);
+// Number of live interned nodes of type T.
+template <typename T>
+std::size_t interned_nodes();
+// Interned id of a variable name, no_variable if no such variable was built.
+template <typename T>
+std::uint32_t variable_id(const std::string& name);
+// Interned id of a variable name, assigning the next free id to a new name.
+template <typename T>
+std::uint32_t intern_variable_id(const std::string& name);
+template <typename T>
+const std::string& variable_name(std::uint32_t id);
+
+template <typename T>
+class NativeProgram;
+
+// Linear register program lowered from an expression tree. Variables are
+// resolved to integer slots once, so evaluation needs no string lookups.
+template <typename T>
+class Program {
+private:
+    std::vector<Instruction> code_;
+    std::vector<Instruction> ssa_;
+    std::vector<T> constants_;
+    std::vector<std::string> variables_;
+    std::uint32_t registers_ = 0;
+    Program() = default;
+    friend class Compiler<T>;
+public:
+    // Rows evaluated per step of the batch evaluator.
+    static constexpr std::size_t batch_chunk = 256;
+
+    T eval(std::span<const T> values) const;
+    T eval(std::span<const T> values, std::span<T> registers) const;
+    std::vector<T> bind(const std::map<std::string,T>& context) const;
+
+    // Columnar evaluation: columns[slot] points at out.size() values of that
+    // variable, one result per row is written to out.
+    void eval_batch(std::span<const T* const> columns, std::span<T> out) const;
+    void eval_batch(std::span<const T* const> columns, std::span<T> out, std::span<T> scratch) const;
+    // Row ranges spread over the pool, each worker with its own scratch.
+    // Every row goes through the same kernels as in the serial call, so
+    // the results do not depend on the number of threads.
+    void eval_batch(std::span<const T* const> columns, std::span<T> out, ThreadPool& pool) const;
+    std::size_t batch_scratch_size() const;
+    std::vector<const T*> bind_columns(const std::map<std::string,std::span<const T>>& columns, std::size_t rows) const;
+    std::size_t slot(const std::string& name) const;
+
+    // Reverse-mode differentiation: returns the value and writes the partial
+    // derivative with respect to every variable slot into partials.
+    T gradient(std::span<const T> values, std::span<T> partials) const;
+    T gradient(std::span<const T> values, std::span<T> partials, std::span<T> scratch) const;
+    std::size_t gradient_scratch_size() const;
+
+    // Forward-mode evaluation along point + t * direction, truncated after t^K.
+    template <std::size_t K>
+    Taylor<T, K> eval_taylor(std::span<const T> point, std::span<const T> direction) const;
+
+    // C++ source of an evaluator for this program with C entry points
+    // expression_eval(values, result) and expression_eval_batch(columns, out, rows).
+    std::string native_source() const;
+    // Compiles native_source() with the system compiler and loads it.
+    NativeProgram<T> compile_native(const NativeOptions& options = {}) const;
+
+    const std::vector<Instruction>& code() const;
+    // The same program before register allocation: operands are indices of
+    // the instructions producing them and dst is the instruction's own index.
+    const std::vector<Instruction>& ssa() const;
+    const std::vector<T>& constants() const;
+    const std::vector<std::string>& variables() const;
+    std::uint32_t registers() const;
+};
+
+// Machine-code evaluator built by Program::compile_native. Takes the same
+// value slots and column layout as the Program it came from.
+template <typename T>
+class NativeProgram {
+private:
+    using Scalar = void (*)(const T* values, T* result);
+    using Batch = void (*)(const T* const* columns, T* out, std::size_t rows);
+    std::shared_ptr<NativeLibrary> library_;
+    Scalar scalar_ = nullptr;
+    Batch batch_ = nullptr;
+    std::vector<std::string> variables_;
+    NativeProgram() = default;
+    friend class Program<T>;
+public:
+    T eval(std::span<const T> values) const;
+    void eval_batch(std::span<const T* const> columns, std::span<T> out) const;
+    const std::vector<std::string>& variables() const;
+    std::size_t slot(const std::string& name) const;
+    const NativeLibrary& library() const;
+};
+
+// Lowers a node graph into a Program. Nodes reachable through several
+// parents are emitted once.
+template <typename T>
+class Compiler {
+private:
+    std::vector<Instruction> code_;
+    std::vector<T> constants_;
+    std::vector<std::string> variables_;
+    std::unordered_map<std::string, std::uint32_t> slots_;
+    std::unordered_map<const Node<T>*, std::uint32_t> visited_;
+public:
+    std::uint32_t lower(const std::shared_ptr<Node<T>>& node);
+    std::uint32_t constant(T value);
+    std::uint32_t variable(const std::string& name);
+    std::uint32_t operation(OpCode op, std::uint32_t a, std::uint32_t b = 0);
+    Program<T> finish();
+};
+
+template <typename T>
+class Expression;
+
+template <typename T>
+Expression<T> operator+(const Expression<T>& lhs, const Expression<T>& rhs);
+template <typename T>
+Expression<T> operator-(const Expression<T>& lhs, const Expression<T>& rhs);
+template <typename T>
+Expression<T> operator*(const Expression<T>& lhs, const Expression<T>& rhs);
+template <typename T>
+Expression<T> operator/(const Expression<T>& lhs, const Expression<T>& rhs);
+template <typename T>
+Expression<T> operator^(const Expression<T>& lhs, const Expression<T>& rhs);
+template <typename T>
+Expression<T> sin(const Expression<T>& that);
+template <typename T>
+Expression<T> cos(const Expression<T>& that);
+template <typename T>
+Expression<T> ln(const Expression<T>& that);
+template <typename T>
+Expression<T> exp(const Expression<T>& that);
+
+// Derivatives kept across diff calls, keyed by (interned node, variable). Since
+// nodes are hash-consed, a subterm shared by several expressions or partials
+// is differentiated once per variable. Differentiated roots are held alive so
+// the cached keys stay valid until clear().
+template <typename T>
+class DiffCache {
+private:
+    std::unordered_map<std::string, NodeMemo<T>> derivatives_;
+    std::unordered_set<std::shared_ptr<Node<T>>> roots_;
+public:
+    std::shared_ptr<Node<T>> diff(const std::shared_ptr<Node<T>>& node, const std::string& name);
+    // Number of cached (node, variable) derivatives.
+    std::size_t size() const;
+    void clear();
+};
+
+template <typename T>
+using ExpressionMatrix = std::vector<std::vector<Expression<T>>>;
+
+// Non-zero entry of a sparse Jacobian or Hessian.
+template <typename T>
+struct SparseEntry {
+    std::size_t row;
+    std::size_t col;
+    Expression<T> value;
+};
+template <typename T>
+using SparseMatrix = std::vector<SparseEntry<T>>;
+
+template <typename T>
+struct Gradient {
+    T value;
+    std::map<std::string,T> partials;
+};
+
+// Text formats of Expression::write.
+enum class OutputFormat : std::uint8_t {
+    Infix,  // the grammar of parse() and the command line
+    LaTeX,
+    C       // C99; complex values use <complex.h>
+};
+
+struct WriteOptions {
+    OutputFormat format = OutputFormat::Infix;
+    // Shortest decimal form that reads back to the same value, instead of
+    // std::to_string's six decimals.
+    bool exact_numbers = true;
+    // Only the parentheses the format's precedence rules need, instead of
+    // wrapping every binary operation.
+    bool minimal_parentheses = true;
+    // Subexpressions reached through several parents are bound to a name
+    // once (a let line, a LaTeX aligned row or a C declaration) and then
+    // referred to by it; otherwise they are written out at every use.
+    bool share_subexpressions = true;
 };
 
 template <typename T>
@@ -87,10 +431,43 @@ public:
     Expression& operator=(const Expression& other) = default;
     Expression& operator=(Expression&& other) = default;
 
-    T eval(std::map<std::string,T> context);
-    Expression<T> diff(std::string name);
-    Expression<T> substitute(std::map<std::string,T> context);
+    T eval(const EvalContext<T>& context);
+    void eval_batch(const std::map<std::string,std::span<const T>>& columns, std::span<T> out);
+    void eval_batch(const std::map<std::string,std::span<const T>>& columns, std::span<T> out, ThreadPool& pool);
+    // Value and all partial derivatives in one forward and one reverse sweep.
+    Gradient<T> gradient(const std::map<std::string,T>& context);
+    // f, f', ..., f^(K) along `direction` (missing names have direction 0).
+    template <std::size_t K>
+    std::array<T, K + 1> derivatives(const std::map<std::string,T>& context, const std::map<std::string,T>& direction);
+    // With `simplified` set the result is passed through simplify().
+    Expression<T> diff(std::string name, bool simplified = false);
+    Expression<T> diff(const std::string& name, DiffCache<T>& cache, bool simplified = false);
+    // Second partials, each distinct entry built once: H[j][i] is the same
+    // expression as H[i][j].
+    ExpressionMatrix<T> hessian(const std::vector<std::string>& variables, bool simplified = false);
+    ExpressionMatrix<T> hessian(const std::vector<std::string>& variables, DiffCache<T>& cache, bool simplified = false);
+    // Only the entries that can be non-zero, row-major; both (i, j) and
+    // (j, i) are listed for off-diagonal entries.
+    SparseMatrix<T> sparse_hessian(const std::vector<std::string>& variables, bool simplified = false);
+    SparseMatrix<T> sparse_hessian(const std::vector<std::string>& variables, DiffCache<T>& cache, bool simplified = false);
+    bool depends_on(const std::string& name) const;
+    Expression<T> substitute(const EvalContext<T>& context, bool simplified = false);
+    // Constant folding, identity/annihilator elimination, x-x, x/x, power
+    // rules and like-term collection in one bottom-up pass.
+    Expression<T> simplify();
+    Program<T> compile();
+    NativeProgram<T> compile_native(const NativeOptions& options = {});
+    // Fully parenthesized, six-decimal numbers, shared subtrees repeated.
     std::string to_string();
+    std::string to_string(const WriteOptions& options);
+    // Streams the expression out in one pass over its nodes; with
+    // share_subexpressions the output is linear in the number of distinct
+    // nodes. With bindings it is the definitions, one per line, followed
+    // by the expression (a `return` statement in C).
+    void write(std::ostream& out, const WriteOptions& options = {});
+    // Number of distinct nodes reachable from this expression.
+    std::size_t node_count();
+    ExpressionShape shape();
     std::shared_ptr<Node<T>> node();
 
     friend Expression operator+<> (const Expression<T>& lhs, const Expression<T>& rhs);
@@ -99,6 +476,9 @@ public:
     friend Expression operator/<> (const Expression<T>& lhs, const Expression<T>& rhs);
     friend Expression operator^<> (const Expression<T>& lhs, const Expression<T>& rhs);
 
+    template <typename U>
+    friend Expression<U> parse(std::string_view input);
+
     friend Expression<T> sin<>(const Expression<T>& that);
     friend Expression<T> cos<>(const Expression<T>& that);
     friend Expression<T> ln<>(const Expression<T>& that);
@@ -110,6 +490,16 @@ public:
     Expression operator^=(const Expression<T>& that);*/
 };
 
+// J[i][j] = d functions[i] / d variables[j].
+template <typename T>
+ExpressionMatrix<T> jacobian(const std::vector<Expression<T>>& functions, const std::vector<std::string>& variables, bool simplified = false);
+template <typename T>
+ExpressionMatrix<T> jacobian(const std::vector<Expression<T>>& functions, const std::vector<std::string>& variables, DiffCache<T>& cache, bool simplified = false);
+template <typename T>
+SparseMatrix<T> sparse_jacobian(const std::vector<Expression<T>>& functions, const std::vector<std::string>& variables, bool simplified = false);
+template <typename T>
+SparseMatrix<T> sparse_jacobian(const std::vector<Expression<T>>& functions, const std::vector<std::string>& variables, DiffCache<T>& cache, bool simplified = false);
+
 //template <typename T>
 //Expression<T> operator""_val(T value);
 
@@ -0,0 +1,141 @@
+#include "incremental.h"
+
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <numeric>
+#include <stdexcept>
+
+template <typename T>
+IncrementalEvaluator<T>::IncrementalEvaluator(const Program<T>& program, std::span<const T> values)
+    : nodes_(program.ssa()), constants_(program.constants()), variables_(program.variables()),
+      values_(nodes_.size()), queued_(nodes_.size(), false) {
+    if (values.size() < variables_.size()) {
+        throw std::runtime_error("Not enough values for incremental evaluation");
+    }
+    inputs_.assign(values.begin(), values.begin() + variables_.size());
+
+    // Counting sort of (operand -> reader) edges and (slot -> Variable node).
+    parent_offsets_.assign(nodes_.size() + 1, 0);
+    slot_offsets_.assign(variables_.size() + 1, 0);
+    for (const Instruction& node : nodes_) {
+        if (node.op == OpCode::Variable) {
+            slot_offsets_[node.a + 1]++;
+        } else if (is_operation(node.op)) {
+            parent_offsets_[node.a + 1]++;
+            if (is_binary(node.op) && node.b != node.a) {
+                parent_offsets_[node.b + 1]++;
+            }
+        }
+    }
+    std::partial_sum(parent_offsets_.begin(), parent_offsets_.end(), parent_offsets_.begin());
+    std::partial_sum(slot_offsets_.begin(), slot_offsets_.end(), slot_offsets_.begin());
+    parents_.resize(parent_offsets_.back());
+    slot_nodes_.resize(slot_offsets_.back());
+    std::vector<std::uint32_t> parent_fill(parent_offsets_.begin(), parent_offsets_.end() - 1);
+    std::vector<std::uint32_t> slot_fill(slot_offsets_.begin(), slot_offsets_.end() - 1);
+    for (std::uint32_t i = 0; i < nodes_.size(); i++) {
+        const Instruction& node = nodes_[i];
+        if (node.op == OpCode::Variable) {
+            slot_nodes_[slot_fill[node.a]++] = i;
+        } else if (is_operation(node.op)) {
+            parents_[parent_fill[node.a]++] = i;
+            if (is_binary(node.op) && node.b != node.a) {
+                parents_[parent_fill[node.b]++] = i;
+            }
+        }
+    }
+
+    for (std::uint32_t i = 0; i < nodes_.size(); i++) {
+        recompute(i);
+    }
+}
+
+template <typename T>
+IncrementalEvaluator<T>::IncrementalEvaluator(const Program<T>& program, const std::map<std::string,T>& context)
+    : IncrementalEvaluator(program, program.bind(context)) {}
+
+template <typename T>
+void IncrementalEvaluator<T>::recompute(std::uint32_t index) {
+    const Instruction& node = nodes_[index];
+    switch (node.op) {
+        case OpCode::Constant: values_[index] = constants_[node.a]; break;
+        case OpCode::Variable: values_[index] = inputs_[node.a]; break;
+        case OpCode::Add: values_[index] = values_[node.a] + values_[node.b]; break;
+        case OpCode::Sub: values_[index] = values_[node.a] - values_[node.b]; break;
+        case OpCode::Mul: values_[index] = values_[node.a] * values_[node.b]; break;
+        case OpCode::Div: values_[index] = values_[node.a] / values_[node.b]; break;
+        case OpCode::Pow: values_[index] = apply_binary(OpCode::Pow, values_[node.a], values_[node.b]); break;
+        default: values_[index] = apply_unary(node.op, values_[node.a]); break;
+    }
+}
+
+template <typename T>
+void IncrementalEvaluator<T>::set(std::size_t slot, T value) {
+    if (slot >= variables_.size()) {
+        throw std::runtime_error("Variable slot out of range");
+    }
+    inputs_[slot] = value;
+    for (std::uint32_t k = slot_offsets_[slot]; k < slot_offsets_[slot + 1]; k++) {
+        std::uint32_t node = slot_nodes_[k];
+        if (!queued_[node]) {
+            queued_[node] = true;
+            pending_.push_back(node);
+            std::push_heap(pending_.begin(), pending_.end(), std::greater<>());
+        }
+    }
+}
+
+template <typename T>
+void IncrementalEvaluator<T>::set(const std::string& name, T value) {
+    set(slot(name), value);
+}
+
+// Operands always precede their readers, so taking the smallest pending
+// index first recomputes every node after all of its dirty operands.
+template <typename T>
+T IncrementalEvaluator<T>::value() {
+    recomputed_ = 0;
+    while (!pending_.empty()) {
+        std::pop_heap(pending_.begin(), pending_.end(), std::greater<>());
+        std::uint32_t index = pending_.back();
+        pending_.pop_back();
+        queued_[index] = false;
+        T previous = values_[index];
+        recompute(index);
+        recomputed_++;
+        // Compared bit for bit: -0.0 == 0.0 would stop a sign change that
+        // 1/x still sees, and NaN != NaN would propagate an unchanged NaN.
+        if (std::memcmp(&values_[index], &previous, sizeof(T)) == 0) {
+            continue;
+        }
+        for (std::uint32_t k = parent_offsets_[index]; k < parent_offsets_[index + 1]; k++) {
+            std::uint32_t parent = parents_[k];
+            if (!queued_[parent]) {
+                queued_[parent] = true;
+                pending_.push_back(parent);
+                std::push_heap(pending_.begin(), pending_.end(), std::greater<>());
+            }
+        }
+    }
+    return values_.back();
+}
+
+template <typename T>
+std::size_t IncrementalEvaluator<T>::slot(const std::string& name) const {
+    auto it = std::find(variables_.begin(), variables_.end(), name);
+    if (it == variables_.end()) {
+        throw std::runtime_error("Variable not found: " + name);
+    }
+    return static_cast<std::size_t>(it - variables_.begin());
+}
+
+template <typename T>
+const std::vector<std::string>& IncrementalEvaluator<T>::variables() const {
+    return variables_;
+}
+
+template <typename T>
+std::size_t IncrementalEvaluator<T>::recomputed() const {
+    return recomputed_;
+}
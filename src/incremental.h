@@ -0,0 +1,51 @@
+#ifndef EXPRESSION_INCREMENTAL_H
+#define EXPRESSION_INCREMENTAL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <span>
+#include <string>
+#include <vector>
+
+#include "expression.h"
+
+// Evaluator that keeps the value of every node of a compiled program, so
+// after set() only the nodes downstream of the changed variables are
+// recomputed, in dependency order. Propagation stops at nodes whose value
+// did not change. Several set() calls between value() calls share the work.
+template <typename T>
+class IncrementalEvaluator {
+public:
+    IncrementalEvaluator(const Program<T>& program, std::span<const T> values);
+    IncrementalEvaluator(const Program<T>& program, const std::map<std::string,T>& context);
+
+    void set(std::size_t slot, T value);
+    void set(const std::string& name, T value);
+    // Value of the expression, bringing dirty nodes up to date first.
+    T value();
+
+    std::size_t slot(const std::string& name) const;
+    const std::vector<std::string>& variables() const;
+    // Nodes recomputed by the last value() call.
+    std::size_t recomputed() const;
+
+private:
+    void recompute(std::uint32_t index);
+    std::vector<Instruction> nodes_;
+    std::vector<T> constants_;
+    std::vector<std::string> variables_;
+    std::vector<T> inputs_;
+    std::vector<T> values_;
+    // Readers of each node and Variable nodes of each slot, as offset ranges.
+    std::vector<std::uint32_t> parent_offsets_;
+    std::vector<std::uint32_t> parents_;
+    std::vector<std::uint32_t> slot_offsets_;
+    std::vector<std::uint32_t> slot_nodes_;
+    // Min-heap of node indices waiting to be recomputed.
+    std::vector<std::uint32_t> pending_;
+    std::vector<bool> queued_;
+    std::size_t recomputed_ = 0;
+};
+
+#endif //EXPRESSION_INCREMENTAL_H
@@ -0,0 +1,216 @@
+#include "kernels.h"
+
+#include <cmath>
+#include <complex>
+
+namespace kernels {
+
+#define KERNELS_DECLARE(ns) \
+    namespace ns { \
+        void add(const double*, const double*, double*, std::size_t); \
+        void sub(const double*, const double*, double*, std::size_t); \
+        void mul(const double*, const double*, double*, std::size_t); \
+        void div(const double*, const double*, double*, std::size_t); \
+        void pow(const double*, const double*, double*, std::size_t); \
+        void sin(const double*, double*, std::size_t); \
+        void cos(const double*, double*, std::size_t); \
+        void exp(const double*, double*, std::size_t); \
+        void log(const double*, double*, std::size_t); \
+        void complex_mul(const double*, const double*, const double*, const double*, double*, double*, std::size_t); \
+        void complex_div(const double*, const double*, const double*, const double*, double*, double*, std::size_t); \
+        void complex_pow(const double*, const double*, const double*, const double*, double*, double*, std::size_t); \
+        void complex_sin(const double*, const double*, double*, double*, std::size_t); \
+        void complex_cos(const double*, const double*, double*, double*, std::size_t); \
+        void complex_exp(const double*, const double*, double*, double*, std::size_t); \
+        void complex_log(const double*, const double*, double*, double*, std::size_t); \
+    }
+
+#define KERNELS_TABLE(ns) \
+    Table{#ns, ns::add, ns::sub, ns::mul, ns::div, ns::pow, ns::sin, ns::cos, ns::exp, ns::log, \
+          ns::complex_mul, ns::complex_div, ns::complex_pow, ns::complex_sin, ns::complex_cos, \
+          ns::complex_exp, ns::complex_log}
+
+namespace {
+
+struct Table {
+    const char* name;
+    void (*add)(const double*, const double*, double*, std::size_t);
+    void (*sub)(const double*, const double*, double*, std::size_t);
+    void (*mul)(const double*, const double*, double*, std::size_t);
+    void (*div)(const double*, const double*, double*, std::size_t);
+    void (*pow)(const double*, const double*, double*, std::size_t);
+    void (*sin)(const double*, double*, std::size_t);
+    void (*cos)(const double*, double*, std::size_t);
+    void (*exp)(const double*, double*, std::size_t);
+    void (*log)(const double*, double*, std::size_t);
+    void (*complex_mul)(const double*, const double*, const double*, const double*, double*, double*, std::size_t);
+    void (*complex_div)(const double*, const double*, const double*, const double*, double*, double*, std::size_t);
+    void (*complex_pow)(const double*, const double*, const double*, const double*, double*, double*, std::size_t);
+    void (*complex_sin)(const double*, const double*, double*, double*, std::size_t);
+    void (*complex_cos)(const double*, const double*, double*, double*, std::size_t);
+    void (*complex_exp)(const double*, const double*, double*, double*, std::size_t);
+    void (*complex_log)(const double*, const double*, double*, double*, std::size_t);
+};
+
+}
+
+#if defined(__x86_64__)
+KERNELS_DECLARE(sse2)
+KERNELS_DECLARE(avx2)
+#endif
+
+namespace scalar {
+
+void add(const double* a, const double* b, double* out, std::size_t n) {
+    for (std::size_t i = 0; i < n; i++) out[i] = a[i] + b[i];
+}
+
+void sub(const double* a, const double* b, double* out, std::size_t n) {
+    for (std::size_t i = 0; i < n; i++) out[i] = a[i] - b[i];
+}
+
+void mul(const double* a, const double* b, double* out, std::size_t n) {
+    for (std::size_t i = 0; i < n; i++) out[i] = a[i] * b[i];
+}
+
+void div(const double* a, const double* b, double* out, std::size_t n) {
+    for (std::size_t i = 0; i < n; i++) out[i] = a[i] / b[i];
+}
+
+void pow(const double* a, const double* b, double* out, std::size_t n) {
+    for (std::size_t i = 0; i < n; i++) out[i] = std::pow(a[i], b[i]);
+}
+
+void sin(const double* a, double* out, std::size_t n) {
+    for (std::size_t i = 0; i < n; i++) out[i] = std::sin(a[i]);
+}
+
+void cos(const double* a, double* out, std::size_t n) {
+    for (std::size_t i = 0; i < n; i++) out[i] = std::cos(a[i]);
+}
+
+void exp(const double* a, double* out, std::size_t n) {
+    for (std::size_t i = 0; i < n; i++) out[i] = std::exp(a[i]);
+}
+
+void log(const double* a, double* out, std::size_t n) {
+    for (std::size_t i = 0; i < n; i++) out[i] = std::log(a[i]);
+}
+
+template <typename Op>
+void complex_binary(const double* ar, const double* ai, const double* br, const double* bi,
+                    double* outr, double* outi, std::size_t n, Op op) {
+    for (std::size_t i = 0; i < n; i++) {
+        std::complex<double> z = op(std::complex<double>(ar[i], ai[i]), std::complex<double>(br[i], bi[i]));
+        outr[i] = z.real();
+        outi[i] = z.imag();
+    }
+}
+
+template <typename Op>
+void complex_unary(const double* ar, const double* ai, double* outr, double* outi, std::size_t n, Op op) {
+    for (std::size_t i = 0; i < n; i++) {
+        std::complex<double> z = op(std::complex<double>(ar[i], ai[i]));
+        outr[i] = z.real();
+        outi[i] = z.imag();
+    }
+}
+
+void complex_mul(const double* ar, const double* ai, const double* br, const double* bi,
+                 double* outr, double* outi, std::size_t n) {
+    complex_binary(ar, ai, br, bi, outr, outi, n, [](auto a, auto b) { return a * b; });
+}
+
+void complex_div(const double* ar, const double* ai, const double* br, const double* bi,
+                 double* outr, double* outi, std::size_t n) {
+    complex_binary(ar, ai, br, bi, outr, outi, n, [](auto a, auto b) { return a / b; });
+}
+
+void complex_pow(const double* ar, const double* ai, const double* br, const double* bi,
+                 double* outr, double* outi, std::size_t n) {
+    complex_binary(ar, ai, br, bi, outr, outi, n, [](auto a, auto b) { return std::pow(a, b); });
+}
+
+void complex_sin(const double* ar, const double* ai, double* outr, double* outi, std::size_t n) {
+    complex_unary(ar, ai, outr, outi, n, [](auto a) { return std::sin(a); });
+}
+
+void complex_cos(const double* ar, const double* ai, double* outr, double* outi, std::size_t n) {
+    complex_unary(ar, ai, outr, outi, n, [](auto a) { return std::cos(a); });
+}
+
+void complex_exp(const double* ar, const double* ai, double* outr, double* outi, std::size_t n) {
+    complex_unary(ar, ai, outr, outi, n, [](auto a) { return std::exp(a); });
+}
+
+void complex_log(const double* ar, const double* ai, double* outr, double* outi, std::size_t n) {
+    complex_unary(ar, ai, outr, outi, n, [](auto a) { return std::log(a); });
+}
+
+}
+
+namespace {
+
+const Table& table() {
+    static const Table selected = [] {
+#if defined(__x86_64__)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            return KERNELS_TABLE(avx2);
+        }
+        return KERNELS_TABLE(sse2);
+#else
+        return KERNELS_TABLE(scalar);
+#endif
+    }();
+    return selected;
+}
+
+}
+
+void add(const double* a, const double* b, double* out, std::size_t n) { table().add(a, b, out, n); }
+void sub(const double* a, const double* b, double* out, std::size_t n) { table().sub(a, b, out, n); }
+void mul(const double* a, const double* b, double* out, std::size_t n) { table().mul(a, b, out, n); }
+void div(const double* a, const double* b, double* out, std::size_t n) { table().div(a, b, out, n); }
+void pow(const double* a, const double* b, double* out, std::size_t n) { table().pow(a, b, out, n); }
+void sin(const double* a, double* out, std::size_t n) { table().sin(a, out, n); }
+void cos(const double* a, double* out, std::size_t n) { table().cos(a, out, n); }
+void exp(const double* a, double* out, std::size_t n) { table().exp(a, out, n); }
+void log(const double* a, double* out, std::size_t n) { table().log(a, out, n); }
+
+void complex_mul(const double* ar, const double* ai, const double* br, const double* bi,
+                 double* outr, double* outi, std::size_t n) {
+    table().complex_mul(ar, ai, br, bi, outr, outi, n);
+}
+
+void complex_div(const double* ar, const double* ai, const double* br, const double* bi,
+                 double* outr, double* outi, std::size_t n) {
+    table().complex_div(ar, ai, br, bi, outr, outi, n);
+}
+
+void complex_pow(const double* ar, const double* ai, const double* br, const double* bi,
+                 double* outr, double* outi, std::size_t n) {
+    table().complex_pow(ar, ai, br, bi, outr, outi, n);
+}
+
+void complex_sin(const double* ar, const double* ai, double* outr, double* outi, std::size_t n) {
+    table().complex_sin(ar, ai, outr, outi, n);
+}
+
+void complex_cos(const double* ar, const double* ai, double* outr, double* outi, std::size_t n) {
+    table().complex_cos(ar, ai, outr, outi, n);
+}
+
+void complex_exp(const double* ar, const double* ai, double* outr, double* outi, std::size_t n) {
+    table().complex_exp(ar, ai, outr, outi, n);
+}
+
+void complex_log(const double* ar, const double* ai, double* outr, double* outi, std::size_t n) {
+    table().complex_log(ar, ai, outr, outi, n);
+}
+
+const char* isa() {
+    return table().name;
+}
+
+}
@@ -0,0 +1,44 @@
+#ifndef EXPRESSION_KERNELS_H
+#define EXPRESSION_KERNELS_H
+
+#include <cstddef>
+
+// Element-wise kernels over contiguous arrays of doubles used by the batch
+// evaluator. The implementation is picked once at runtime from the best
+// instruction set the CPU supports (AVX2, then SSE2, then plain scalar code).
+// `out` may alias either input.
+namespace kernels {
+
+void add(const double* a, const double* b, double* out, std::size_t n);
+void sub(const double* a, const double* b, double* out, std::size_t n);
+void mul(const double* a, const double* b, double* out, std::size_t n);
+void div(const double* a, const double* b, double* out, std::size_t n);
+void pow(const double* a, const double* b, double* out, std::size_t n);
+void sin(const double* a, double* out, std::size_t n);
+void cos(const double* a, double* out, std::size_t n);
+void exp(const double* a, double* out, std::size_t n);
+void log(const double* a, double* out, std::size_t n);
+
+// Complex kernels on split storage: each operand is an array of real parts
+// (ar, br) and an array of imaginary parts (ai, bi), results go to outr and
+// outi. Results match std::complex<double> to within a few ulps; lanes
+// outside the fast ranges (zeros, infinities, huge arguments) are computed
+// with std::complex itself. Outputs may alias the inputs. Addition and
+// subtraction are add/sub applied to both halves.
+void complex_mul(const double* ar, const double* ai, const double* br, const double* bi,
+                 double* outr, double* outi, std::size_t n);
+void complex_div(const double* ar, const double* ai, const double* br, const double* bi,
+                 double* outr, double* outi, std::size_t n);
+void complex_pow(const double* ar, const double* ai, const double* br, const double* bi,
+                 double* outr, double* outi, std::size_t n);
+void complex_sin(const double* ar, const double* ai, double* outr, double* outi, std::size_t n);
+void complex_cos(const double* ar, const double* ai, double* outr, double* outi, std::size_t n);
+void complex_exp(const double* ar, const double* ai, double* outr, double* outi, std::size_t n);
+void complex_log(const double* ar, const double* ai, double* outr, double* outi, std::size_t n);
+
+// Name of the instruction set selected by the dispatcher.
+const char* isa();
+
+}
+
+#endif //EXPRESSION_KERNELS_H
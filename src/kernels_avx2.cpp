@@ -0,0 +1,5 @@
+#include "kernels.h"
+
+#define KERNELS_ISA avx2
+#define KERNELS_WIDTH 4
+#include "kernels_impl.h"
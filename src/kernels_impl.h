@@ -0,0 +1,544 @@
+// Generic body of the double kernels, written with GCC vector extensions.
+// Included by one translation unit per instruction set, each of which defines
+// KERNELS_ISA (namespace name) and KERNELS_WIDTH (doubles per vector) and is
+// compiled with the matching -m flags.
+
+#include <array>
+#include <cmath>
+#include <complex>
+#include <cstdint>
+#include <cstring>
+
+namespace kernels::KERNELS_ISA {
+
+constexpr std::size_t W = KERNELS_WIDTH;
+typedef double vd __attribute__((vector_size(W * sizeof(double))));
+typedef std::int64_t vi __attribute__((vector_size(W * sizeof(double))));
+typedef std::uint64_t vu __attribute__((vector_size(W * sizeof(double))));
+
+// Adding 1.5 * 2^52 rounds a double of magnitude below 2^51 to an integer
+// that can be read back from the low mantissa bits.
+constexpr double kRound = 6755399441055744.0;
+
+constexpr double kLn2Hi = 6.93147180369123816490e-01;
+constexpr double kLn2Lo = 1.90821492927058770002e-10;
+constexpr double kLog2e = 1.44269504088896338700e+00;
+constexpr double kPio2_1 = 1.57079632673412561417e+00;
+constexpr double kPio2_2 = 6.07710050630396597660e-11;
+constexpr double kPio2_3 = 2.02226624871116645580e-21;
+constexpr double kTwoOverPi = 6.36619772367581382433e-01;
+constexpr double kPio2Hi = 1.57079632679489655800e+00;
+constexpr double kPio2Lo = 6.12323399573676603587e-17;
+constexpr double kPio4 = 7.85398163397448309616e-01;
+constexpr double kPiHi = 3.14159265358979311600e+00;
+constexpr double kPiLo = 1.22464679914735317720e-16;
+constexpr double kMinNormal = 2.2250738585072014e-308;
+constexpr double kMaxFinite = 1.7976931348623157e308;
+
+constexpr double inverse_factorial(int n) {
+    double result = 1.0;
+    for (int i = 2; i <= n; i++) {
+        result /= i;
+    }
+    return result;
+}
+
+// Taylor coefficients, highest degree first, for Horner evaluation.
+constexpr std::array<double, 14> kExpCoeffs = [] {
+    std::array<double, 14> c{};
+    for (int i = 0; i <= 13; i++) {
+        c[13 - i] = inverse_factorial(i);
+    }
+    return c;
+}();
+
+constexpr std::array<double, 11> kLogCoeffs = [] {
+    std::array<double, 11> c{};
+    for (int k = 0; k <= 10; k++) {
+        c[10 - k] = 1.0 / (2 * k + 1);
+    }
+    return c;
+}();
+
+constexpr std::array<double, 9> kSinCoeffs = [] {
+    std::array<double, 9> c{};
+    for (int i = 0; i <= 8; i++) {
+        c[8 - i] = (i % 2 ? -1.0 : 1.0) * inverse_factorial(2 * i + 1);
+    }
+    return c;
+}();
+
+constexpr std::array<double, 10> kCosCoeffs = [] {
+    std::array<double, 10> c{};
+    for (int i = 0; i <= 9; i++) {
+        c[9 - i] = (i % 2 ? -1.0 : 1.0) * inverse_factorial(2 * i);
+    }
+    return c;
+}();
+
+// sinh(x) / x for |x| < 1/2 as a polynomial in x^2.
+constexpr std::array<double, 8> kSinhCoeffs = [] {
+    std::array<double, 8> c{};
+    for (int i = 0; i <= 7; i++) {
+        c[7 - i] = inverse_factorial(2 * i + 1);
+    }
+    return c;
+}();
+
+// atan(x) = x + x^3 P(x^2) / Q(x^2) on |x| <= 0.66 (Cephes); Q is monic.
+constexpr std::array<double, 5> kAtanP = {
+    -8.750608600031904122785e-01, -1.615753718733365076637e+01, -7.500855792314704667340e+01,
+    -1.228866684490136173410e+02, -6.485021904942025371773e+01};
+constexpr std::array<double, 6> kAtanQ = {
+    1.0, 2.485846490142306297962e+01, 1.650270098316988542046e+02,
+    4.328810604912902668951e+02, 4.853903996359136964868e+02, 1.945506571482613964425e+02};
+constexpr double kAtanMoreBits = 6.123233995736765886130e-17;
+
+inline vd broadcast(double x) {
+    vd v;
+    for (std::size_t i = 0; i < W; i++) {
+        v[i] = x;
+    }
+    return v;
+}
+
+template <std::size_t N>
+inline vd horner(vd x, const std::array<double, N>& coeffs) {
+    vd p = broadcast(coeffs[0]);
+    for (std::size_t i = 1; i < N; i++) {
+        p = p * x + coeffs[i];
+    }
+    return p;
+}
+
+inline vd load(const double* p) {
+    vd v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+inline void store(double* p, vd v) {
+    std::memcpy(p, &v, sizeof(v));
+}
+
+// Branch-free OR over the lanes, which the compiler turns into a vector test.
+inline bool any(vi mask) {
+    std::int64_t bits = 0;
+    for (std::size_t i = 0; i < W; i++) {
+        bits |= mask[i];
+    }
+    return bits != 0;
+}
+
+inline vd bits_to_double(vi bits) {
+    vd v;
+    std::memcpy(&v, &bits, sizeof(v));
+    return v;
+}
+
+inline vi double_to_bits(vd v) {
+    vi bits;
+    std::memcpy(&bits, &v, sizeof(v));
+    return bits;
+}
+
+// Rounds to the nearest integer, returning it both as a double and as an integer.
+inline vd round_nearest(vd x, vi& n) {
+    vd t = x + kRound;
+    n = double_to_bits(t) - double_to_bits(broadcast(kRound));
+    return t - kRound;
+}
+
+// exp on |x| <= 708: x = n*ln2 + r, |r| <= ln2/2, Taylor polynomial for e^r.
+inline vd exp_core(vd x) {
+    vi n;
+    vd k = round_nearest(x * kLog2e, n);
+    vd r = (x - k * kLn2Hi) - k * kLn2Lo;
+    vd p = horner(r, kExpCoeffs);
+    vi scale = (n + 1023) << 52;
+    return p * bits_to_double(scale);
+}
+
+// log on positive normal x: x = 2^e * m, sqrt(1/2) <= m < sqrt(2),
+// log(m) = 2 atanh((m - 1) / (m + 1)).
+inline vd log_core(vd x) {
+    vu bits = (vu) double_to_bits(x);
+    vi e = (vi) (bits >> 52) - 1023;
+    vu mantissa = (bits & 0x000fffffffffffffULL) | 0x3ff0000000000000ULL;
+    vd m = bits_to_double((vi) mantissa);
+    vi large = m > 1.41421356237309504880;
+    m = large ? m * 0.5 : m;
+    e = e - large;
+    vd s = (m - 1.0) / (m + 1.0);
+    vd z = s * s;
+    vd p = horner(z, kLogCoeffs);
+    vd ed = bits_to_double(e + double_to_bits(broadcast(kRound))) - kRound;
+    return ed * kLn2Hi + (2.0 * s * p + ed * kLn2Lo);
+}
+
+// Reduces |x| <= 1e5 to x = n*pi/2 + r with |r| <= pi/4, returning sin(r),
+// cos(r) and the quadrant n mod 4.
+inline void sincos_core(vd x, vd& s, vd& c, vi& quadrant) {
+    vi n;
+    vd k = round_nearest(x * kTwoOverPi, n);
+    vd r = ((x - k * kPio2_1) - k * kPio2_2) - k * kPio2_3;
+    vd z = r * r;
+    s = r * horner(z, kSinCoeffs);
+    c = horner(z, kCosCoeffs);
+    quadrant = n & 3;
+}
+
+inline vd sin_of(vd s, vd c, vi quadrant) {
+    return (quadrant == 0) ? s : (quadrant == 1) ? c : (quadrant == 2) ? -s : -c;
+}
+
+inline vd cos_of(vd s, vd c, vi quadrant) {
+    return (quadrant == 0) ? c : (quadrant == 1) ? -s : (quadrant == 2) ? -c : s;
+}
+
+// cosh and sinh of |x| <= 708 from e^x and e^-x, with a series for sinh
+// near 0 where e^x - e^-x would cancel.
+inline void cosh_sinh(vd x, vd& ch, vd& sh) {
+    vd ep = exp_core(x);
+    vd em = 1.0 / ep;
+    ch = 0.5 * (ep + em);
+    vi small = (x > -0.5) & (x < 0.5);
+    sh = small ? x * horner(x * x, kSinhCoeffs) : 0.5 * (ep - em);
+}
+
+// atan2(y, x) for (x, y) != (0, 0), both finite: atan of the smaller over
+// the larger magnitude in [0, 1], then moved to the right octant.
+inline vd atan2_core(vd y, vd x) {
+    vd ax = x < 0.0 ? -x : x;
+    vd ay = y < 0.0 ? -y : y;
+    vi steep = ay > ax;
+    vd t = (steep ? ax : ay) / (steep ? ay : ax);
+    vi upper = t > 0.66;
+    vd u = upper ? (t - 1.0) / (t + 1.0) : t;
+    vd z = u * u;
+    vd p = u + u * z * horner(z, kAtanP) / horner(z, kAtanQ);
+    vd r = upper ? (kPio4 + (p + 0.5 * kAtanMoreBits)) : p;
+    r = steep ? (kPio2Hi - r) + kPio2Lo : r;
+    r = x < 0.0 ? (kPiHi - r) + kPiLo : r;
+    vi sign = double_to_bits(y) & (vi) (vu{} + 0x8000000000000000ULL);
+    return bits_to_double(double_to_bits(r) | sign);
+}
+
+// Fast-path complex functions: each returns false when some lane is outside
+// its range, leaving the results unspecified.
+inline bool complex_exp_core(vd xr, vd xi, vd& yr, vd& yi) {
+    vi inside = (xr >= -708.0) & (xr <= 708.0) & (xi >= -1e5) & (xi <= 1e5);
+    if (any(~inside)) {
+        return false;
+    }
+    vd e = exp_core(xr);
+    vd s, c;
+    vi q;
+    sincos_core(xi, s, c, q);
+    yr = e * cos_of(s, c, q);
+    yi = e * sin_of(s, c, q);
+    return true;
+}
+
+// log z = log |z| + i arg z, with log |z| = log(|z|^2) / 2.
+inline bool complex_log_core(vd xr, vd xi, vd& yr, vd& yi) {
+    vd norm = xr * xr + xi * xi;
+    vi inside = (norm >= kMinNormal) & (norm <= kMaxFinite);
+    if (any(~inside)) {
+        return false;
+    }
+    yr = 0.5 * log_core(norm);
+    yi = atan2_core(xi, xr);
+    return true;
+}
+
+// `vector` computes a whole vector and returns false when some lane is outside
+// its fast range; such vectors are recomputed lane by lane with `scalar`.
+template <typename Vector, typename Scalar>
+inline void unary(const double* a, double* out, std::size_t n, Vector vector, Scalar scalar) {
+    auto step = [&](vd x, double* dst, std::size_t lanes) {
+        vd y;
+        if (!vector(x, y)) {
+            for (std::size_t j = 0; j < lanes; j++) {
+                y[j] = scalar(x[j]);
+            }
+        }
+        for (std::size_t j = 0; j < lanes; j++) {
+            dst[j] = y[j];
+        }
+    };
+    std::size_t i = 0;
+    for (; i + W <= n; i += W) {
+        vd x = load(a + i);
+        vd y;
+        if (vector(x, y)) {
+            store(out + i, y);
+        } else {
+            step(x, out + i, W);
+        }
+    }
+    if (i < n) {
+        vd x = broadcast(1.0);
+        for (std::size_t j = 0; i + j < n; j++) {
+            x[j] = a[i + j];
+        }
+        step(x, out + i, n - i);
+    }
+}
+
+// Complex counterparts of `unary`: `vector` works on split real and
+// imaginary vectors; where it fails, the lanes are recomputed from the
+// inputs with `scalar` on std::complex. The last partial vector is padded
+// with 1 + 0i.
+template <typename Vector, typename Scalar>
+inline void complex_unary(const double* ar, const double* ai, double* outr, double* outi, std::size_t n,
+                          Vector vector, Scalar scalar) {
+    auto lanes = [&](std::size_t i, std::size_t count) {
+        for (std::size_t j = i; j < i + count; j++) {
+            std::complex<double> z = scalar(std::complex<double>(ar[j], ai[j]));
+            outr[j] = z.real();
+            outi[j] = z.imag();
+        }
+    };
+    std::size_t i = 0;
+    for (; i + W <= n; i += W) {
+        vd yr, yi;
+        if (vector(load(ar + i), load(ai + i), yr, yi)) {
+            store(outr + i, yr);
+            store(outi + i, yi);
+        } else {
+            lanes(i, W);
+        }
+    }
+    if (i < n) {
+        vd xr = broadcast(1.0);
+        vd xi = broadcast(0.0);
+        for (std::size_t j = 0; i + j < n; j++) {
+            xr[j] = ar[i + j];
+            xi[j] = ai[i + j];
+        }
+        vd yr, yi;
+        if (!vector(xr, xi, yr, yi)) {
+            lanes(i, n - i);
+            return;
+        }
+        for (std::size_t j = 0; i + j < n; j++) {
+            outr[i + j] = yr[j];
+            outi[i + j] = yi[j];
+        }
+    }
+}
+
+template <typename Vector, typename Scalar>
+inline void complex_binary(const double* ar, const double* ai, const double* br, const double* bi,
+                           double* outr, double* outi, std::size_t n, Vector vector, Scalar scalar) {
+    auto lanes = [&](std::size_t i, std::size_t count) {
+        for (std::size_t j = i; j < i + count; j++) {
+            std::complex<double> z = scalar(std::complex<double>(ar[j], ai[j]), std::complex<double>(br[j], bi[j]));
+            outr[j] = z.real();
+            outi[j] = z.imag();
+        }
+    };
+    std::size_t i = 0;
+    for (; i + W <= n; i += W) {
+        vd yr, yi;
+        if (vector(load(ar + i), load(ai + i), load(br + i), load(bi + i), yr, yi)) {
+            store(outr + i, yr);
+            store(outi + i, yi);
+        } else {
+            lanes(i, W);
+        }
+    }
+    if (i < n) {
+        vd xr = broadcast(1.0);
+        vd xi = broadcast(0.0);
+        vd zr = broadcast(1.0);
+        vd zi = broadcast(0.0);
+        for (std::size_t j = 0; i + j < n; j++) {
+            xr[j] = ar[i + j];
+            xi[j] = ai[i + j];
+            zr[j] = br[i + j];
+            zi[j] = bi[i + j];
+        }
+        vd yr, yi;
+        if (!vector(xr, xi, zr, zi, yr, yi)) {
+            lanes(i, n - i);
+            return;
+        }
+        for (std::size_t j = 0; i + j < n; j++) {
+            outr[i + j] = yr[j];
+            outi[i + j] = yi[j];
+        }
+    }
+}
+
+template <typename Op>
+inline void binary(const double* a, const double* b, double* out, std::size_t n, Op op) {
+    std::size_t i = 0;
+    for (; i + W <= n; i += W) {
+        store(out + i, op(load(a + i), load(b + i)));
+    }
+    for (; i < n; i++) {
+        vd x = broadcast(a[i]);
+        vd y = broadcast(b[i]);
+        out[i] = op(x, y)[0];
+    }
+}
+
+void add(const double* a, const double* b, double* out, std::size_t n) {
+    binary(a, b, out, n, [](vd x, vd y) { return x + y; });
+}
+
+void sub(const double* a, const double* b, double* out, std::size_t n) {
+    binary(a, b, out, n, [](vd x, vd y) { return x - y; });
+}
+
+void mul(const double* a, const double* b, double* out, std::size_t n) {
+    binary(a, b, out, n, [](vd x, vd y) { return x * y; });
+}
+
+void div(const double* a, const double* b, double* out, std::size_t n) {
+    binary(a, b, out, n, [](vd x, vd y) { return x / y; });
+}
+
+void pow(const double* a, const double* b, double* out, std::size_t n) {
+    for (std::size_t i = 0; i < n; i++) {
+        out[i] = std::pow(a[i], b[i]);
+    }
+}
+
+void exp(const double* a, double* out, std::size_t n) {
+    unary(a, out, n, [](vd x, vd& y) {
+        vi inside = (x >= -708.0) & (x <= 708.0);
+        if (any(~inside)) {
+            return false;
+        }
+        y = exp_core(x);
+        return true;
+    }, [](double x) { return std::exp(x); });
+}
+
+void log(const double* a, double* out, std::size_t n) {
+    unary(a, out, n, [](vd x, vd& y) {
+        vi inside = (x >= 2.2250738585072014e-308) & (x <= 1.7976931348623157e308);
+        if (any(~inside)) {
+            return false;
+        }
+        y = log_core(x);
+        return true;
+    }, [](double x) { return std::log(x); });
+}
+
+void sin(const double* a, double* out, std::size_t n) {
+    unary(a, out, n, [](vd x, vd& y) {
+        vi inside = (x >= -1e5) & (x <= 1e5);
+        if (any(~inside)) {
+            return false;
+        }
+        vd s, c;
+        vi q;
+        sincos_core(x, s, c, q);
+        y = sin_of(s, c, q);
+        return true;
+    }, [](double x) { return std::sin(x); });
+}
+
+void cos(const double* a, double* out, std::size_t n) {
+    unary(a, out, n, [](vd x, vd& y) {
+        vi inside = (x >= -1e5) & (x <= 1e5);
+        if (any(~inside)) {
+            return false;
+        }
+        vd s, c;
+        vi q;
+        sincos_core(x, s, c, q);
+        y = cos_of(s, c, q);
+        return true;
+    }, [](double x) { return std::cos(x); });
+}
+
+// Products and quotients that come out NaN (from infinite or NaN operands)
+// are redone by std::complex, which recovers infinities as C Annex G asks.
+void complex_mul(const double* ar, const double* ai, const double* br, const double* bi,
+                 double* outr, double* outi, std::size_t n) {
+    complex_binary(ar, ai, br, bi, outr, outi, n, [](vd xr, vd xi, vd zr, vd zi, vd& yr, vd& yi) {
+        yr = xr * zr - xi * zi;
+        yi = xr * zi + xi * zr;
+        return !any((yr != yr) | (yi != yi));
+    }, [](std::complex<double> a, std::complex<double> b) { return a * b; });
+}
+
+// Smith's algorithm, dividing through by the larger part of the divisor.
+void complex_div(const double* ar, const double* ai, const double* br, const double* bi,
+                 double* outr, double* outi, std::size_t n) {
+    complex_binary(ar, ai, br, bi, outr, outi, n, [](vd xr, vd xi, vd zr, vd zi, vd& yr, vd& yi) {
+        vd azr = zr < 0.0 ? -zr : zr;
+        vd azi = zi < 0.0 ? -zi : zi;
+        vi wide = azr >= azi;
+        vd big = wide ? zr : zi;
+        vd r = (wide ? zi : zr) / big;
+        vd d = big + (wide ? zi : zr) * r;
+        vd pr = wide ? xr + xi * r : xr * r + xi;
+        vd pi = wide ? xi - xr * r : xi * r - xr;
+        yr = pr / d;
+        yi = pi / d;
+        vi finite = (yr == yr) & (yi == yi) & (yr - yr == 0.0) & (yi - yi == 0.0);
+        return !any(~finite);
+    }, [](std::complex<double> a, std::complex<double> b) { return a / b; });
+}
+
+// a^b = exp(b log a); a = 0 and out-of-range lanes go through std::pow.
+void complex_pow(const double* ar, const double* ai, const double* br, const double* bi,
+                 double* outr, double* outi, std::size_t n) {
+    complex_binary(ar, ai, br, bi, outr, outi, n, [](vd xr, vd xi, vd zr, vd zi, vd& yr, vd& yi) {
+        vd lr, li;
+        if (!complex_log_core(xr, xi, lr, li)) {
+            return false;
+        }
+        return complex_exp_core(zr * lr - zi * li, zr * li + zi * lr, yr, yi);
+    }, [](std::complex<double> a, std::complex<double> b) { return std::pow(a, b); });
+}
+
+// sin(x + iy) = sin x cosh y + i cos x sinh y
+void complex_sin(const double* ar, const double* ai, double* outr, double* outi, std::size_t n) {
+    complex_unary(ar, ai, outr, outi, n, [](vd xr, vd xi, vd& yr, vd& yi) {
+        vi inside = (xr >= -1e5) & (xr <= 1e5) & (xi >= -708.0) & (xi <= 708.0);
+        if (any(~inside)) {
+            return false;
+        }
+        vd s, c, ch, sh;
+        vi q;
+        sincos_core(xr, s, c, q);
+        cosh_sinh(xi, ch, sh);
+        yr = sin_of(s, c, q) * ch;
+        yi = cos_of(s, c, q) * sh;
+        return true;
+    }, [](std::complex<double> a) { return std::sin(a); });
+}
+
+// cos(x + iy) = cos x cosh y - i sin x sinh y
+void complex_cos(const double* ar, const double* ai, double* outr, double* outi, std::size_t n) {
+    complex_unary(ar, ai, outr, outi, n, [](vd xr, vd xi, vd& yr, vd& yi) {
+        vi inside = (xr >= -1e5) & (xr <= 1e5) & (xi >= -708.0) & (xi <= 708.0);
+        if (any(~inside)) {
+            return false;
+        }
+        vd s, c, ch, sh;
+        vi q;
+        sincos_core(xr, s, c, q);
+        cosh_sinh(xi, ch, sh);
+        yr = cos_of(s, c, q) * ch;
+        yi = -(sin_of(s, c, q) * sh);
+        return true;
+    }, [](std::complex<double> a) { return std::cos(a); });
+}
+
+void complex_exp(const double* ar, const double* ai, double* outr, double* outi, std::size_t n) {
+    complex_unary(ar, ai, outr, outi, n, complex_exp_core, [](std::complex<double> a) { return std::exp(a); });
+}
+
+void complex_log(const double* ar, const double* ai, double* outr, double* outi, std::size_t n) {
+    complex_unary(ar, ai, outr, outi, n, complex_log_core, [](std::complex<double> a) { return std::log(a); });
+}
+
+}
@@ -0,0 +1,5 @@
+#include "kernels.h"
+
+#define KERNELS_ISA sse2
+#define KERNELS_WIDTH 2
+#include "kernels_impl.h"
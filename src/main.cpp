@@ -1,202 +1,92 @@
 #include "expression.h"
 #include "expression.cpp"
+#include "parser.h"
+#include "parser.cpp"
+#include "stream.h"
+#include "stream.cpp"
+#include "mapped.h"
+#include "mapped.cpp"
+#include "tokenizer.h"
+#include "tokenizer.cpp"
+#include "profile.h"
+#include <cstdio>
 #include <iostream>
 #include <map>
 #include <sstream>
 #include <vector>
 
-enum TokenType {
-    NUMBER,
-    COMPLEX_NUMBER,
-    VARIABLE,
-    OPERATION,
-    FUNCTION,
-    LEFT_BRACKET,
-    RIGHT_BRACKET,
-    EQUAL
-};
+// Prints a parse error with a caret under the offending position.
+void report(const ParseError& error, const std::string& input) {
+    std::cerr << "Error: " << error.what() << "\n  " << input << "\n  "
+              << std::string(std::min(error.offset(), input.size()), ' ') << "^\n";
+}
 
-struct Token {
-    TokenType ttype;
-    std::string value;
-};
+// The formula's tokenization is the Tokenize phase of --profile; the
+// assignments of --eval go through the same tokenizer uncounted.
+std::vector<Token> tokenize_formula(const std::string& formula) {
+    EXPRESSION_PROFILE_PHASE(Tokenize);
+    return tokenizer(formula, false);
+}
 
-std::vector<Token> tokenizer(std::string input, bool is_eqaul_expected) {
-    std::vector<Token> result;
-    result.push_back({LEFT_BRACKET, "("});
-    for (size_t i = 0; i < input.size(); i++) {
-        if (input[i] == ' ') {
-            continue;
-        }
-        if (input[i] == '+' || input[i] == '-' || input[i] == '*' || input[i] == '/' || input[i] == '^') {
-            result.push_back({OPERATION,std::string(1,input[i])});
-            continue;
-        }
-        if (isdigit(input[i]) || input[i] == '.') {
-            std::string number = "";
-            while (i < input.size() && (isdigit(input[i]) || input[i] == '.' || input[i] == 'i')) {
-                number += input[i];
-                i++;
-            }
-            i--;
-            if (input[i] == 'i') {
-                result.push_back({COMPLEX_NUMBER,number});
-            } else {
-                result.push_back({NUMBER,number});
-            }
+// `expression` receives the formula argument once the options are taken out,
+// so that parse errors can be reported against it.
+int run(int argc, char* argv[], std::string& expression) {
+    // --threads N, --complex, --profile and --format F may appear anywhere
+    // after the mode.
+    std::size_t threads = 1;
+    bool force_complex = false;
+    bool profile = false;
+    bool formatted = false;
+    WriteOptions format;
+    std::vector<char*> args;
+    for (int i = 0; i < argc; i++) {
+        if (std::string(argv[i]) == "--threads" && i + 1 < argc) {
+            threads = std::stoul(argv[++i]);
             continue;
         }
-        if (input[i] == '(') {
-            result.push_back({LEFT_BRACKET, "("});
+        if (std::string(argv[i]) == "--complex") {
+            force_complex = true;
             continue;
         }
-        if (input[i] == ')') {
-            result.push_back({RIGHT_BRACKET, ")"});
+        if (std::string(argv[i]) == "--profile") {
+            profile = true;
             continue;
         }
-        if (isalpha(input[i])) {
-            std::string lambda;
-            while (i < input.size() && isalpha(input[i])) {
-                lambda += input[i];
-                ++i;
-            }
-            i--;
-            if (lambda == "sin" || lambda == "cos" || lambda == "exp" || lambda == "ln") {
-                result.push_back({FUNCTION, lambda});
-            } else {
-                result.push_back({VARIABLE, lambda});
+        if (std::string(argv[i]) == "--format" && i + 1 < argc) {
+            std::string name = argv[++i];
+            if (name == "latex") {
+                format.format = OutputFormat::LaTeX;
+            } else if (name == "c") {
+                format.format = OutputFormat::C;
+            } else if (name != "infix") {
+                throw std::runtime_error("Unknown format: " + name + " (infix, latex or c)");
             }
+            formatted = true;
             continue;
         }
-        if (input[i] == '=') {
-            if (is_eqaul_expected) {
-                result.push_back({EQUAL, "="});
-                continue;
-            }
-            throw std::runtime_error("Equal sign is not accepted");
-        }
-        throw std::runtime_error("Unknown symbole: " + input[i]);
+        args.push_back(argv[i]);
     }
-    result.push_back({RIGHT_BRACKET, ")"});
-    return result;
-}
+    argc = static_cast<int>(args.size());
+    argv = args.data();
 
-std::vector<Token> polish_order(std::vector<Token> input) {
-    std::map<std::string,int> priority = {
-        {"(", 0},
-        {"+", 1},
-        {"-", 1},
-        {"*", 2},
-        {"/", 2},
-        {"^", 3}, 
-        {"sin", 4},
-        {"cos", 4},
-        {"exp", 4},
-        {"ln", 4}
-    };
-    std::vector<Token> stack;
-    std::vector<Token> result;
-    for (size_t i = 0; i < input.size(); i++) {
-        auto c = input[i];
-        if (c.ttype == NUMBER || c.ttype == COMPLEX_NUMBER || c.ttype == VARIABLE) {
-            result.push_back(c);
-        }
-        if (c.ttype == LEFT_BRACKET) {
-            stack.push_back(c);
-        }
-        if (c.ttype == OPERATION || c.ttype == FUNCTION) {
-            while (stack.size() > 0) {
-                size_t temp = stack.size() - 1;
-                if (priority[stack[temp].value] > priority[c.value]) {
-                    result.push_back(stack[temp]);
-                    stack.pop_back();
-                } else {
-                    break;
-                }
-            }
-            stack.push_back(c);
-        }
-        if (c.ttype == RIGHT_BRACKET) {
-            while (stack.size() > 0) {
-                size_t temp = stack.size() - 1;
-                if (stack[temp].ttype == LEFT_BRACKET) {
-                    stack.pop_back();
-                    break;
-                }
-                result.push_back(stack[temp]);
-                stack.pop_back();
-            }
-        }
-    }
-    return result;
-}
-
-template <typename T>
-Expression<T> rec_lexer_double(std::vector<Token>& input) {
-    auto temp = input[input.size() - 1];
-    input.pop_back();
-    if constexpr(std::is_same_v<T, std::complex<double>>) {
-        if (temp.ttype == NUMBER) {
-            std::complex<double> x(std::stod(temp.value), 0.0);
-            return Expression<T>(x);
-        }
-        if (temp.ttype == COMPLEX_NUMBER) {
-            temp.value.pop_back();
-            std::complex<double> x(0.0, std::stod(temp.value));
-            return Expression<T>(x);
-        }
-    } else {
-        if (temp.ttype == NUMBER) {
-            return Expression<T>(std::stod(temp.value));
-        }
-    }
-
-    if (temp.ttype == VARIABLE) {
-        return Expression<T>(temp.value);
-    }
-    if (temp.ttype == OPERATION) {
-        auto right = rec_lexer_double<T>(input);
-        auto left = rec_lexer_double<T>(input);
-        switch (temp.value[0]) {
-            case '+': return left + right;
-            case '-': return left - right;
-            case '*': return left * right;
-            case '/': return left / right;
-            case '^': return left ^ right;
-            default: throw std::runtime_error("Unknown operation: " + temp.ttype);
-        }
-    }
-    if (temp.ttype == FUNCTION) {
-        auto value = rec_lexer_double<T>(input);
-        if (temp.value == "sin") return sin(value);
-        if (temp.value == "cos") return cos(value);
-        if (temp.value == "exp") return exp(value);
-        if (temp.value == "ln") return ln(value);
-        throw std::runtime_error("Unknown function: " + temp.value);
-    }
-    throw std::runtime_error("Unknown token type: " + std::to_string(temp.ttype));
-
-}
-
-template <typename T>
-Expression<T> parser(std::string input) {
-    auto tokenized = tokenizer(input, false);
-    auto sorted = polish_order(tokenized);
-    return rec_lexer_double<T>(sorted);
-}
-
-int main(int argc, char* argv[]) {
-    if (argc < 2) {
-        std::cerr << "Usage: differentiator [--eval|--diff] <expression> [args]\n";
+    if (argc < 3) {
+        std::cerr << "Usage: differentiator [--eval|--diff] <expression> [args]\n"
+                  << "       differentiator --eval-stream <expression> [file.csv|file.tsv|-] [--threads N]\n"
+                  << "       differentiator --eval-columns <expression> <out.bin> name=file.bin... [--complex] [--threads N]\n"
+                  << "       (--threads 0 uses every hardware thread)\n"
+                  << "       --profile with any mode reports phase times and node counts to stderr\n"
+                  << "       --format infix|latex|c prints --parse and --diff results with minimal\n"
+                  << "       parentheses, exact numbers and shared subexpressions bound once\n";
         return 1;
     }
 
     std::string mode = argv[1];
     std::string expr_str = argv[2];
+    expression = expr_str;
 
     if (mode == "--parse") {
         try {
-            std::vector<Token> tokens = tokenizer(expr_str, false);
+            std::vector<Token> tokens = tokenize_formula(expr_str);
             for (const auto& token : tokens) {
                 std::cout << "Token type: ";
                 switch (token.ttype) {
@@ -231,7 +121,7 @@ int main(int argc, char* argv[]) {
             std::cerr << "Error: " << e.what() << "\n";
             return 1;
         }
-        std::vector<Token> tokens = tokenizer(expr_str, false);
+        std::vector<Token> tokens = tokenize_formula(expr_str);
         std::vector<Token> polish = polish_order(tokens);
         std::cout << "Result ordered in polish notation: ";
         for (size_t i = 0; i < polish.size(); i++) {
@@ -239,21 +129,76 @@ int main(int argc, char* argv[]) {
         }
         std::cout << std::endl;
 
-        bool is_complex = false;
-        for (size_t i = 0; i < polish.size(); i++) {
-            if (polish[i].ttype == COMPLEX_NUMBER) {
-                is_complex = true;
+        if (has_imaginary_literal(expr_str)) {
+            auto result = parse<std::complex<double>>(expr_str);
+            std::cout << (formatted ? result.to_string(format) : result.to_string()) << std::endl;
+        } else {
+            auto result = parse<double>(expr_str);
+            std::cout << (formatted ? result.to_string(format) : result.to_string()) << std::endl;
+        }
+
+
+    } else if (mode == "--eval-stream") {
+        // Header row with variable names, then one row of values per line;
+        // results are written one per line. Values are complex when the
+        // expression or the first row contains an imaginary number.
+        // Closes the input on every exit, including a parse or evaluation error.
+        std::unique_ptr<std::FILE, decltype(&std::fclose)> file(nullptr, &std::fclose);
+        std::FILE* in = stdin;
+        if (argc > 3 && std::string(argv[3]) != "-") {
+            file.reset(std::fopen(argv[3], "rb"));
+            if (!file) {
+                throw std::runtime_error(std::string("Cannot open ") + argv[3]);
             }
+            in = file.get();
+        }
+        std::unique_ptr<ThreadPool> pool;
+        if (threads != 1) {
+            pool = std::make_unique<ThreadPool>(threads);
+        }
+        std::size_t workers = pool ? pool->size() : 1;
+        RecordReader reader(in, std::max<std::size_t>(1 << 20, workers << 18));
+        std::vector<std::string_view> fields;
+        if (!reader.next(fields)) {
+            throw std::runtime_error("Expected a header row");
+        }
+        std::vector<std::string> header(fields.begin(), fields.end());
+        bool is_complex = has_imaginary_literal(expr_str);
+        if (reader.next(fields)) {
+            is_complex = is_complex || std::any_of(fields.begin(), fields.end(), is_complex_field);
+            reader.unread();
         }
+        std::setvbuf(stdout, nullptr, _IOFBF, 1 << 16);
         if (is_complex) {
-            auto result = parser<std::complex<double>>(expr_str);
-            std::cout << result.to_string() << std::endl;
+            eval_stream(parse<std::complex<double>>(expr_str).compile(), header, reader, stdout, 4096, pool.get());
         } else {
-            auto result = parser<double>(expr_str);
-            std::cout << result.to_string() << std::endl;
+            eval_stream(parse<double>(expr_str).compile(), header, reader, stdout, 4096, pool.get());
+        }
+        std::fflush(stdout);
+    } else if (mode == "--eval-columns") {
+        // Raw native-endian columns: float64 values, or complex128 re/im
+        // pairs with --complex or an imaginary literal in the expression.
+        if (argc < 5) {
+            throw std::runtime_error("Args usage: <out.bin> [name]=[file.bin]...");
+        }
+        std::map<std::string, std::string> columns;
+        for (int i = 4; i < argc; i++) {
+            std::string arg = argv[i];
+            std::size_t eq = arg.find('=');
+            if (eq == std::string::npos || eq == 0) {
+                throw std::runtime_error("Args usage: [name]=[file.bin]");
+            }
+            columns[arg.substr(0, eq)] = arg.substr(eq + 1);
+        }
+        std::unique_ptr<ThreadPool> pool;
+        if (threads != 1) {
+            pool = std::make_unique<ThreadPool>(threads);
+        }
+        if (force_complex || has_imaginary_literal(expr_str)) {
+            eval_columns(parse<std::complex<double>>(expr_str).compile(), columns, argv[3], pool.get());
+        } else {
+            eval_columns(parse<double>(expr_str).compile(), columns, argv[3], pool.get());
         }
-
-
     } else if (mode == "--eval") {
         std::cout << "Input expression: " << expr_str << std::endl;
         bool is_complex = 0;
@@ -273,11 +218,8 @@ int main(int argc, char* argv[]) {
             }
         }
 
-        std::vector<Token> tokens = tokenizer(expr_str, false);
-        std::vector<Token> polish = polish_order(tokens);
-
-        if (is_complex) {
-            std::map<std::string,std::complex<double>> context;
+        if (is_complex || has_imaginary_literal(expr_str)) {
+            EvalContext<std::complex<double>> context;
             for (size_t i = 0; i < tokened_args.size(); i++) {
                 auto temp = tokened_args[i];
                 
@@ -288,7 +230,7 @@ int main(int argc, char* argv[]) {
                     temp[2].ttype == EQUAL && 
                     temp[3].ttype == NUMBER &&
                     temp[4].ttype == RIGHT_BRACKET) {
-                        context[temp[1].value] = std::complex<double>(std::stod(temp[3].value), 0.0);
+                        context.set(temp[1].value, std::complex<double>(std::stod(temp[3].value), 0.0));
                     } 
                     else if (temp.size() == 5 && 
                     temp[0].ttype == LEFT_BRACKET &&
@@ -296,7 +238,7 @@ int main(int argc, char* argv[]) {
                     temp[2].ttype == EQUAL && 
                     temp[3].ttype == COMPLEX_NUMBER &&
                     temp[4].ttype == RIGHT_BRACKET) {
-                        context[temp[1].value] = std::complex<double>(0.0, std::stod(temp[3].value));
+                        context.set(temp[1].value, std::complex<double>(0.0, std::stod(temp[3].value)));
                     } 
                     else if (temp.size() == 7 && 
                     temp[0].ttype == LEFT_BRACKET &&
@@ -306,7 +248,7 @@ int main(int argc, char* argv[]) {
                     temp[4].value == "+" &&
                     temp[5].ttype == COMPLEX_NUMBER &&
                     temp[6].ttype == RIGHT_BRACKET) {
-                        context[temp[1].value] = std::complex<double>(std::stod(temp[3].value), std::stod(temp[5].value));
+                        context.set(temp[1].value, std::complex<double>(std::stod(temp[3].value), std::stod(temp[5].value)));
                     }
                     else if (temp.size() == 7 && 
                     temp[0].ttype == LEFT_BRACKET &&
@@ -316,17 +258,17 @@ int main(int argc, char* argv[]) {
                     temp[4].value == "-" &&
                     temp[5].ttype == COMPLEX_NUMBER &&
                     temp[6].ttype == RIGHT_BRACKET) {
-                        context[temp[1].value] = std::complex<double>(std::stod(temp[3].value), -std::stod(temp[5].value));
+                        context.set(temp[1].value, std::complex<double>(std::stod(temp[3].value), -std::stod(temp[5].value)));
                     }
                     else {
                         throw std::runtime_error("Wrong for " + temp[1].value +"Args usage: [name]=[number | real_part(+-)imag_part]");
                     }
                 }
             }
-            auto ans = parser<std::complex<double>>(expr_str);
+            auto ans = parse<std::complex<double>>(expr_str);
             std::cout << ans.eval(context) << std::endl;
         } else {
-            std::map<std::string,double> context;
+            EvalContext<double> context;
             for (size_t i = 0; i < tokened_args.size(); i++) {
                 auto temp = tokened_args[i];
                 if (temp.size() == 5 &&
@@ -335,12 +277,12 @@ int main(int argc, char* argv[]) {
                 temp[2].ttype == EQUAL && 
                 temp[3].ttype == NUMBER &&
                 temp[4].ttype == RIGHT_BRACKET) {
-                    context[temp[1].value] = std::stod(temp[3].value);
+                    context.set(temp[1].value, std::stod(temp[3].value));
                 } else {
                     throw std::runtime_error("Args usage: [name]=[number | real_part+imag_part]");
                 }
             }
-            auto ans = parser<double>(expr_str);
+            auto ans = parse<double>(expr_str);
             std::cout << ans.eval(context)<< std::endl;
         }
         
@@ -348,24 +290,24 @@ int main(int argc, char* argv[]) {
     
     else if (mode == "--diff") {
         std::cout << "Input expression: " << expr_str << std::endl;
-        std::vector<Token> tokens = tokenizer(expr_str, false);
-        std::vector<Token> polish = polish_order(tokens);
-        bool is_complex = false;
         if (argc != 4) {
             throw std::runtime_error("Args usage: [name]");
         }
         std::string name = argv[3];
-        for (size_t i = 0; i < polish.size(); i++) {
-            if (polish[i].ttype == COMPLEX_NUMBER) {
-                is_complex = true;
+        if (has_imaginary_literal(expr_str)) {
+            auto ans = parse<std::complex<double>>(expr_str).diff(name);
+            if (formatted) {
+                ans.write(std::cout, format);
+            } else {
+                std::cout << ans.to_string();
             }
-        }
-        if (is_complex) {
-            auto ans = parser<std::complex<double>>(expr_str);
-            std::cout << ans.diff(name).to_string();
         } else {
-            auto ans = parser<double>(expr_str);
-            std::cout << ans.diff(name).to_string();
+            auto ans = parse<double>(expr_str).diff(name);
+            if (formatted) {
+                ans.write(std::cout, format);
+            } else {
+                std::cout << ans.to_string();
+            }
         }
     }
     else {
@@ -373,5 +315,30 @@ int main(int argc, char* argv[]) {
         return 1;
     }
 
+    if (profile) {
+        // Snapshot first, so measuring the shape does not count as a phase.
+        ProfileStats stats = profile_stats();
+        if (force_complex || has_imaginary_literal(expr_str)) {
+            stats.shape = parse<std::complex<double>>(expr_str).shape();
+        } else {
+            stats.shape = parse<double>(expr_str).shape();
+        }
+        std::cout << std::flush;
+        std::cerr << "Profile:\n" << profile_report(stats);
+    }
     return 0;
-}
\ No newline at end of file
+}
+
+int main(int argc, char* argv[]) {
+    std::string expression;
+    try {
+        return run(argc, argv, expression);
+    } catch (const ParseError& e) {
+        report(e, expression);
+        return 1;
+    } catch (const std::exception& e) {
+        std::fflush(stdout);
+        std::cerr << "Error: " << e.what() << "\n";
+        return 1;
+    }
+}
@@ -0,0 +1,162 @@
+#include "mapped.h"
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+inline std::runtime_error system_failure(const std::string& what, const std::string& path) {
+    return std::runtime_error(what + " " + path + ": " + std::strerror(errno));
+}
+
+inline MappedFile::MappedFile(std::byte* data, std::size_t size) : data_(data), size_(size) {}
+
+inline MappedFile MappedFile::open(const std::string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw system_failure("Cannot open", path);
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        ::close(fd);
+        throw system_failure("Cannot stat", path);
+    }
+    std::size_t size = static_cast<std::size_t>(info.st_size);
+    void* data = nullptr;
+    if (size > 0) {
+        data = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    ::close(fd);
+    if (data == MAP_FAILED) {
+        throw system_failure("Cannot map", path);
+    }
+    return MappedFile(static_cast<std::byte*>(data), size);
+}
+
+inline MappedFile MappedFile::create(const std::string& path, std::size_t size) {
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        throw system_failure("Cannot create", path);
+    }
+    if (ftruncate(fd, static_cast<off_t>(size)) != 0) {
+        ::close(fd);
+        throw system_failure("Cannot resize", path);
+    }
+    void* data = nullptr;
+    if (size > 0) {
+        data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    ::close(fd);
+    if (data == MAP_FAILED) {
+        throw system_failure("Cannot map", path);
+    }
+    return MappedFile(static_cast<std::byte*>(data), size);
+}
+
+inline MappedFile::MappedFile(MappedFile&& other) noexcept
+    : data_(std::exchange(other.data_, nullptr)), size_(std::exchange(other.size_, 0)) {}
+
+inline MappedFile& MappedFile::operator=(MappedFile&& other) noexcept {
+    std::swap(data_, other.data_);
+    std::swap(size_, other.size_);
+    return *this;
+}
+
+inline MappedFile::~MappedFile() {
+    if (data_) {
+        munmap(data_, size_);
+    }
+}
+
+inline std::byte* MappedFile::data() const {
+    return data_;
+}
+
+inline std::size_t MappedFile::size() const {
+    return size_;
+}
+
+inline void MappedFile::advise(std::size_t offset, std::size_t length, int advice) const {
+    if (!data_ || offset >= size_) {
+        return;
+    }
+    const std::size_t page = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+    std::size_t begin = offset / page * page;
+    std::size_t end = std::min(size_, offset + length);
+    madvise(data_ + begin, end - begin, advice);
+}
+
+template <typename T>
+std::size_t eval_columns(const Program<T>& program, const std::map<std::string, std::string>& columns,
+                         const std::string& output, ThreadPool* pool, std::size_t chunk_bytes) {
+    const auto& variables = program.variables();
+    if (columns.empty()) {
+        throw std::runtime_error("No input columns");
+    }
+    std::map<std::string, MappedFile> files;
+    std::size_t rows = 0;
+    bool first = true;
+    for (const auto& [name, path] : columns) {
+        MappedFile file = MappedFile::open(path);
+        if (file.size() % sizeof(T) != 0) {
+            throw std::runtime_error("Column " + path + " is not a whole number of values");
+        }
+        if (!first && file.size() / sizeof(T) != rows) {
+            throw std::runtime_error("Column " + path + " has " + std::to_string(file.size() / sizeof(T)) +
+                                     " rows, expected " + std::to_string(rows));
+        }
+        rows = file.size() / sizeof(T);
+        first = false;
+        file.advise(0, file.size(), MADV_SEQUENTIAL);
+        files.emplace(name, std::move(file));
+    }
+    std::vector<const MappedFile*> inputs;
+    std::vector<const T*> bound;
+    for (const auto& name : variables) {
+        auto it = files.find(name);
+        if (it == files.end()) {
+            throw std::runtime_error("No column for variable: " + name);
+        }
+        inputs.push_back(&it->second);
+        bound.push_back(reinterpret_cast<const T*>(it->second.data()));
+    }
+
+    MappedFile result = MappedFile::create(output, rows * sizeof(T));
+    T* out = reinterpret_cast<T*>(result.data());
+    const std::size_t page = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+    chunk_bytes = std::max(page, chunk_bytes / page * page);
+    const std::size_t chunk_rows = chunk_bytes / sizeof(T);
+    const std::size_t chunks = (rows + chunk_rows - 1) / chunk_rows;
+
+    std::size_t workers = pool ? pool->size() : 1;
+    std::vector<std::vector<T>> scratch(workers, std::vector<T>(program.batch_scratch_size()));
+    std::vector<std::vector<const T*>> shifted(workers, std::vector<const T*>(bound.size()));
+    auto run = [&](std::size_t begin, std::size_t end, std::size_t worker) {
+        for (std::size_t chunk = begin; chunk < end; chunk++) {
+            std::size_t row = chunk * chunk_rows;
+            std::size_t count = std::min(chunk_rows, rows - row);
+            for (std::size_t slot = 0; slot < bound.size(); slot++) {
+                shifted[worker][slot] = bound[slot] + row;
+            }
+            program.eval_batch(shifted[worker], std::span<T>(out + row, count), scratch[worker]);
+            // Shared file pages stay in the page cache, written ones included,
+            // so dropping them only releases this process's resident set.
+            for (const MappedFile* input : inputs) {
+                input->advise(row * sizeof(T), count * sizeof(T), MADV_DONTNEED);
+            }
+            result.advise(row * sizeof(T), count * sizeof(T), MADV_DONTNEED);
+        }
+    };
+    if (pool) {
+        pool->parallel_for(chunks, 1, run);
+    } else {
+        run(0, chunks, 0);
+    }
+    return rows;
+}
@@ -0,0 +1,47 @@
+#ifndef EXPRESSION_MAPPED_H
+#define EXPRESSION_MAPPED_H
+
+#include <cstddef>
+#include <map>
+#include <string>
+
+#include "expression.h"
+#include "thread_pool.h"
+
+// A whole file mapped into memory, read-only or read-write.
+class MappedFile {
+public:
+    // Maps an existing file read-only.
+    static MappedFile open(const std::string& path);
+    // Creates (or truncates) a file of `size` bytes and maps it read-write.
+    static MappedFile create(const std::string& path, std::size_t size);
+
+    MappedFile(MappedFile&& other) noexcept;
+    MappedFile& operator=(MappedFile&& other) noexcept;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile();
+
+    std::byte* data() const;
+    std::size_t size() const;
+    // madvise over the pages covering [offset, offset + length).
+    void advise(std::size_t offset, std::size_t length, int advice) const;
+
+private:
+    MappedFile(std::byte* data, std::size_t size);
+    std::byte* data_ = nullptr;
+    std::size_t size_ = 0;
+};
+
+// Evaluates `program` over raw binary columns, one file of native T values
+// (float64, or complex128 as re/im pairs) per variable, and writes one T
+// per row into a new file at `output`. Inputs are read and results written
+// in place through the mappings, with no intermediate copies, in chunks of
+// `chunk_bytes` (a multiple of the page size). Inputs are advised as
+// sequential, and each finished chunk is released from the resident set. With a pool,
+// chunks are spread over its workers. Returns the number of rows.
+template <typename T>
+std::size_t eval_columns(const Program<T>& program, const std::map<std::string, std::string>& columns,
+                         const std::string& output, ThreadPool* pool = nullptr, std::size_t chunk_bytes = 1 << 20);
+
+#endif //EXPRESSION_MAPPED_H
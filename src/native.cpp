@@ -0,0 +1,194 @@
+#include "native.h"
+
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <system_error>
+#include <filesystem>
+
+#include <dlfcn.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+std::string environment(const char* name) {
+    const char* value = std::getenv(name);
+    return value ? value : "";
+}
+
+std::filesystem::path cache_directory(const NativeOptions& options) {
+    if (!options.cache_dir.empty()) {
+        return options.cache_dir;
+    }
+    if (auto dir = environment("EXPRESSION_CACHE_DIR"); !dir.empty()) {
+        return dir;
+    }
+    if (auto dir = environment("XDG_CACHE_HOME"); !dir.empty()) {
+        return std::filesystem::path(dir) / "expression";
+    }
+    if (auto home = environment("HOME"); !home.empty()) {
+        return std::filesystem::path(home) / ".cache" / "expression";
+    }
+    return {};
+}
+
+// Last resort under the shared temporary directory: a directory of the
+// current user's own, refused if anyone else could have planted objects in it.
+std::filesystem::path private_temp_directory() {
+    std::filesystem::path dir =
+        std::filesystem::temp_directory_path() / ("expression-" + std::to_string(getuid()));
+    if (mkdir(dir.c_str(), 0700) != 0 && errno != EEXIST) {
+        throw std::runtime_error("Cannot create " + dir.string());
+    }
+    struct stat info;
+    if (lstat(dir.c_str(), &info) != 0 || !S_ISDIR(info.st_mode) || info.st_uid != getuid() ||
+        (info.st_mode & (S_IRWXG | S_IRWXO)) != 0) {
+        throw std::runtime_error("Refusing cache directory " + dir.string() +
+                                 ": not a private directory of the current user");
+    }
+    return dir;
+}
+
+std::string quote(const std::string& text) {
+    std::string result = "'";
+    for (char c : text) {
+        if (c == '\'') {
+            result += "'\\''";
+        } else {
+            result += c;
+        }
+    }
+    return result + "'";
+}
+
+std::string read_file(const std::filesystem::path& path) {
+    std::ifstream in(path);
+    std::stringstream buffer;
+    buffer << in.rdbuf();
+    return buffer.str();
+}
+
+}
+
+std::uint64_t native_hash(const std::string& text) {
+    std::uint64_t hash = 14695981039346656037ull;
+    for (unsigned char c : text) {
+        hash ^= c;
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+NativeLibrary::NativeLibrary(void* handle, std::string path, bool cached)
+    : handle_(handle), path_(std::move(path)), cached_(cached) {}
+
+NativeLibrary::~NativeLibrary() {
+    dlclose(handle_);
+}
+
+std::shared_ptr<NativeLibrary> NativeLibrary::load(const std::string& source, const NativeOptions& options) {
+    std::string compiler = options.compiler;
+    if (compiler.empty()) {
+        compiler = environment("CXX");
+    }
+    if (compiler.empty()) {
+        compiler = "c++";
+    }
+    std::filesystem::path dir = cache_directory(options);
+    if (dir.empty()) {
+        dir = private_temp_directory();
+    } else {
+        std::filesystem::create_directories(dir);
+    }
+
+    // The hash only names the files; the full input is kept beside the
+    // object and compared before a cached object is loaded.
+    std::string input = compiler + '\n' + options.flags + '\n' + source;
+    char key[17];
+    std::snprintf(key, sizeof(key), "%016llx", static_cast<unsigned long long>(native_hash(input)));
+    std::filesystem::path object = dir / ("expr-" + std::string(key) + ".so");
+    std::filesystem::path recorded = dir / ("expr-" + std::string(key) + ".key");
+
+    bool collision = false;
+    if (std::filesystem::exists(object) && std::filesystem::exists(recorded)) {
+        if (read_file(recorded) != input) {
+            collision = true;
+        } else if (void* handle = dlopen(object.c_str(), RTLD_NOW | RTLD_LOCAL)) {
+            return std::shared_ptr<NativeLibrary>(new NativeLibrary(handle, object.string(), true));
+        }
+    }
+
+    // Build under a private name and rename into place, so concurrent
+    // builds, in other processes or on other threads, never load a
+    // half-written object.
+    static std::atomic<std::uint64_t> builds{0};
+    std::string unique = std::string(key) + "." + std::to_string(getpid()) + "." + std::to_string(builds++);
+    std::filesystem::path cpp = dir / ("expr-" + unique + ".cpp");
+    std::filesystem::path temporary = dir / ("expr-" + unique + ".so");
+    std::filesystem::path log = dir / ("expr-" + unique + ".log");
+    std::filesystem::path temporary_key = dir / ("expr-" + unique + ".key");
+    {
+        std::ofstream out(cpp);
+        out << source;
+        if (!out) {
+            throw std::runtime_error("Cannot write " + cpp.string());
+        }
+    }
+    std::string command = compiler + " " + options.flags + " -shared -fPIC -o " + quote(temporary.string()) +
+                          " " + quote(cpp.string()) + " > " + quote(log.string()) + " 2>&1";
+    int status = std::system(command.c_str());
+    std::error_code ignored;
+    if (status != 0) {
+        std::string output = read_file(log);
+        std::filesystem::remove(cpp, ignored);
+        std::filesystem::remove(log, ignored);
+        std::filesystem::remove(temporary, ignored);
+        throw std::runtime_error("Native compilation failed: " + command + "\n" + output);
+    }
+    std::filesystem::remove(cpp, ignored);
+    std::filesystem::remove(log, ignored);
+
+    // Another input with the same hash keeps its cache entry; this one is
+    // loaded from its private name and not cached.
+    std::filesystem::path loaded = collision ? temporary : object;
+    if (!collision) {
+        {
+            std::ofstream out(temporary_key, std::ios::binary);
+            out << input;
+            if (!out) {
+                throw std::runtime_error("Cannot write " + temporary_key.string());
+            }
+        }
+        std::filesystem::rename(temporary_key, recorded);
+        std::filesystem::rename(temporary, object);
+    }
+    void* handle = dlopen(loaded.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if (collision) {
+        std::filesystem::remove(temporary, ignored);
+    }
+    if (!handle) {
+        throw std::runtime_error(std::string("Cannot load ") + loaded.string() + ": " + dlerror());
+    }
+    return std::shared_ptr<NativeLibrary>(new NativeLibrary(handle, loaded.string(), false));
+}
+
+void* NativeLibrary::symbol(const char* name) const {
+    void* address = dlsym(handle_, name);
+    if (!address) {
+        throw std::runtime_error(std::string("Symbol not found: ") + name);
+    }
+    return address;
+}
+
+const std::string& NativeLibrary::path() const {
+    return path_;
+}
+
+bool NativeLibrary::cached() const {
+    return cached_;
+}
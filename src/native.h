@@ -0,0 +1,48 @@
+#ifndef EXPRESSION_NATIVE_H
+#define EXPRESSION_NATIVE_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+// How generated evaluators are built. Empty fields fall back to $CXX (or
+// "c++") and to $EXPRESSION_CACHE_DIR, $XDG_CACHE_HOME/expression,
+// ~/.cache/expression or, without a home, a 0700 directory of the user's
+// own under the temporary directory.
+struct NativeOptions {
+    std::string compiler;
+    std::string flags = "-O2";
+    std::string cache_dir;
+};
+
+// A shared object built from generated C++ source and loaded with dlopen.
+// Objects are cached on disk under a hash of the source, the compiler and
+// the flags, so the same expression is compiled once across runs. That
+// input is stored beside each object and must match before a cached object
+// is loaded.
+class NativeLibrary {
+public:
+    ~NativeLibrary();
+    NativeLibrary(const NativeLibrary&) = delete;
+    NativeLibrary& operator=(const NativeLibrary&) = delete;
+
+    // Compiles `source` unless a cached object exists, then loads it.
+    // Throws std::runtime_error with the compiler output on failure.
+    static std::shared_ptr<NativeLibrary> load(const std::string& source, const NativeOptions& options = {});
+
+    void* symbol(const char* name) const;
+    const std::string& path() const;
+    // True when the object came from the disk cache without compiling.
+    bool cached() const;
+
+private:
+    NativeLibrary(void* handle, std::string path, bool cached);
+    void* handle_;
+    std::string path_;
+    bool cached_;
+};
+
+// 64-bit FNV-1a, used for the cache keys.
+std::uint64_t native_hash(const std::string& text);
+
+#endif //EXPRESSION_NATIVE_H
@@ -0,0 +1,234 @@
+#include "parser.h"
+
+#include <charconv>
+#include <complex>
+#include <memory>
+#include <vector>
+
+inline ParseError::ParseError(const std::string& message, std::size_t offset)
+    : std::runtime_error(message + " at offset " + std::to_string(offset)), offset_(offset) {}
+
+inline std::size_t ParseError::offset() const {
+    return offset_;
+}
+
+inline bool is_identifier_start(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+}
+
+inline bool is_identifier_char(char c) {
+    return is_identifier_start(c) || (c >= '0' && c <= '9');
+}
+
+inline bool is_number_start(char c) {
+    return (c >= '0' && c <= '9') || c == '.';
+}
+
+// Length of the number literal starting at `begin`, without an `i` suffix.
+inline std::size_t scan_number(std::string_view input, std::size_t begin) {
+    std::size_t i = begin;
+    auto digits = [&] {
+        while (i < input.size() && input[i] >= '0' && input[i] <= '9') {
+            i++;
+        }
+    };
+    digits();
+    if (i < input.size() && input[i] == '.') {
+        i++;
+        digits();
+    }
+    if (i < input.size() && (input[i] == 'e' || input[i] == 'E')) {
+        std::size_t mark = i++;
+        if (i < input.size() && (input[i] == '+' || input[i] == '-')) {
+            i++;
+        }
+        std::size_t exponent = i;
+        digits();
+        if (i == exponent) {
+            i = mark;
+        }
+    }
+    return i - begin;
+}
+
+inline bool has_imaginary_literal(std::string_view input) {
+    for (std::size_t i = 0; i < input.size();) {
+        if (is_identifier_start(input[i])) {
+            while (i < input.size() && is_identifier_char(input[i])) {
+                i++;
+            }
+        } else if (is_number_start(input[i])) {
+            i += scan_number(input, i);
+            if (i < input.size() && input[i] == 'i') {
+                return true;
+            }
+        } else {
+            i++;
+        }
+    }
+    return false;
+}
+
+// Operator-precedence parser with explicit operand and operator stacks, so
+// neither long operator chains nor deep nesting recurse.
+template <typename T>
+class FormulaParser {
+private:
+    enum class Kind : unsigned char { Binary, Negate, Function, Open };
+    struct Pending {
+        Kind kind;
+        OpCode op;          // binary operation or function
+        int priority;
+        std::size_t offset;
+    };
+    static constexpr int negate_priority = 25;
+    static constexpr int function_priority = 40;
+
+    std::string_view input_;
+    std::size_t pos_ = 0;
+    std::vector<std::shared_ptr<Node<T>>> operands_;
+    std::vector<Pending> operators_;
+
+    static int priority(char op) {
+        switch (op) {
+            case '+': case '-': return 10;
+            case '*': case '/': return 20;
+            default: return 30;
+        }
+    }
+
+    void skip_spaces() {
+        while (pos_ < input_.size() && (input_[pos_] == ' ' || input_[pos_] == '\t' || input_[pos_] == '\n' || input_[pos_] == '\r')) {
+            pos_++;
+        }
+    }
+
+    void reduce() {
+        Pending top = operators_.back();
+        operators_.pop_back();
+        auto operand = std::move(operands_.back());
+        operands_.pop_back();
+        switch (top.kind) {
+            case Kind::Binary: {
+                auto left = std::move(operands_.back());
+                operands_.back() = make_binary<T>(std::move(left), std::move(operand), top.op);
+                break;
+            }
+            case Kind::Negate:
+                if (operand->opcode() == OpCode::Constant) {
+                    operands_.push_back(make_value<T>(-static_cast<const Value<T>*>(operand.get())->get_value()));
+                } else {
+                    operands_.push_back(make_binary<T>(make_value<T>(T(-1)), std::move(operand), OpCode::Mul));
+                }
+                break;
+            case Kind::Function:
+                operands_.push_back(make_unary<T>(std::move(operand), top.op));
+                break;
+            case Kind::Open:
+                break;
+        }
+    }
+
+    // Operators still waiting on the stack that bind tighter than `priority`
+    // are applied; equal priorities wait, which groups them to the right.
+    void reduce_above(int priority) {
+        while (!operators_.empty() && operators_.back().kind != Kind::Open && operators_.back().priority > priority) {
+            reduce();
+        }
+    }
+
+    std::shared_ptr<Node<T>> number() {
+        std::size_t begin = pos_;
+        std::size_t length = scan_number(input_, begin);
+        double value = 0;
+        auto [end, error] = std::from_chars(input_.data() + begin, input_.data() + begin + length, value);
+        if (error != std::errc() || end != input_.data() + begin + length) {
+            throw ParseError("Malformed number", begin);
+        }
+        pos_ = begin + length;
+        if (pos_ < input_.size() && input_[pos_] == 'i') {
+            pos_++;
+            if constexpr (std::is_same_v<T, std::complex<double>> || std::is_same_v<T, std::complex<float>>) {
+                return make_value<T>(T(0, value));
+            } else {
+                throw ParseError("Imaginary number in a real expression", begin);
+            }
+        }
+        return make_value<T>(static_cast<T>(value));
+    }
+
+public:
+    explicit FormulaParser(std::string_view input) : input_(input) {}
+
+    std::shared_ptr<Node<T>> run() {
+        while (true) {
+            // Operand position: prefix operators, then one primary.
+            skip_spaces();
+            if (pos_ >= input_.size()) {
+                throw ParseError("Expected an operand", pos_);
+            }
+            char c = input_[pos_];
+            if (c == '(') {
+                operators_.push_back({Kind::Open, OpCode::Constant, 0, pos_++});
+                continue;
+            }
+            if (c == '-') {
+                operators_.push_back({Kind::Negate, OpCode::Mul, negate_priority, pos_++});
+                continue;
+            }
+            if (is_number_start(c)) {
+                operands_.push_back(number());
+            } else if (is_identifier_start(c)) {
+                std::size_t begin = pos_;
+                while (pos_ < input_.size() && is_identifier_char(input_[pos_])) {
+                    pos_++;
+                }
+                std::string_view word = input_.substr(begin, pos_ - begin);
+                OpCode function = word == "sin" ? OpCode::Sin : word == "cos" ? OpCode::Cos
+                                : word == "exp" ? OpCode::Exp : word == "ln" ? OpCode::Ln : OpCode::Constant;
+                if (function != OpCode::Constant) {
+                    operators_.push_back({Kind::Function, function, function_priority, begin});
+                    continue;
+                }
+                operands_.push_back(make_variable<T>(std::string(word)));
+            } else {
+                throw ParseError(std::string("Unexpected character '") + c + "'", pos_);
+            }
+
+            // Operator position: closing brackets, then a binary operator or the end.
+            while (true) {
+                skip_spaces();
+                if (pos_ < input_.size() && input_[pos_] == ')') {
+                    reduce_above(-1);
+                    if (operators_.empty()) {
+                        throw ParseError("Unmatched ')'", pos_);
+                    }
+                    operators_.pop_back();
+                    pos_++;
+                    continue;
+                }
+                break;
+            }
+            if (pos_ >= input_.size()) {
+                break;
+            }
+            char op = input_[pos_];
+            if (op != '+' && op != '-' && op != '*' && op != '/' && op != '^') {
+                throw ParseError(std::string("Unexpected character '") + op + "'", pos_);
+            }
+            reduce_above(priority(op));
+            operators_.push_back({Kind::Binary, binary_opcode(op), priority(op), pos_++});
+        }
+        reduce_above(-1);
+        if (!operators_.empty()) {
+            throw ParseError("Unmatched '('", operators_.back().offset);
+        }
+        return operands_.back();
+    }
+};
+
+template <typename T>
+Expression<T> parse(std::string_view input) {
+    EXPRESSION_PROFILE_PHASE(Build);
+    return Expression<T>(FormulaParser<T>(input).run());
+}
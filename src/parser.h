@@ -0,0 +1,37 @@
+#ifndef EXPRESSION_PARSER_H
+#define EXPRESSION_PARSER_H
+
+#include <cstddef>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+#include "expression.h"
+
+// Syntax error with the byte offset in the input where it was detected.
+class ParseError : public std::runtime_error {
+public:
+    ParseError(const std::string& message, std::size_t offset);
+    std::size_t offset() const;
+private:
+    std::size_t offset_;
+};
+
+// Parses a formula in one pass over the input, building interned nodes
+// directly. The grammar is that of the command line:
+//   numbers      12, 0.5, .5, 1e-3, 2.5E+4, with an `i` suffix for
+//                imaginary literals (complex value types only)
+//   variables    letters, then letters, digits or '_'
+//   functions    sin cos exp ln, applied to the operand that follows
+//   operators    + - * / ^ and unary minus
+// with the priorities of polish_order: functions bind tightest, then ^,
+// then * and /, then + and -. Operators of equal priority group to the
+// right, so a-b-c is a-(b-c). Unary minus binds looser than ^ and tighter
+// than * and /, so -x^2 is -(x^2). Throws ParseError on malformed input.
+template <typename T>
+Expression<T> parse(std::string_view input);
+
+// True if the input contains an imaginary literal such as 2i.
+bool has_imaginary_literal(std::string_view input);
+
+#endif //EXPRESSION_PARSER_H
@@ -0,0 +1,113 @@
+#include "profile.h"
+
+#include <atomic>
+#include <cstdio>
+
+namespace {
+
+struct Counters {
+    std::array<std::atomic<std::uint64_t>, profile_kind_count> visits{};
+    std::array<std::atomic<std::uint64_t>, profile_phase_count> phase_calls{};
+    std::array<std::atomic<std::uint64_t>, profile_phase_count> phase_nanoseconds{};
+    std::array<std::atomic<std::uint64_t>, profile_phase_count> phase_allocations{};
+};
+
+Counters counters;
+// Phase of the innermost active ProfileScope on this thread, -1 if none.
+thread_local int current_phase = -1;
+
+const char* kind_names[profile_kind_count] = {"Value", "Variable", "+", "-", "*", "/", "^", "sin", "cos", "exp", "ln"};
+const char* phase_names[profile_phase_count] = {"tokenize", "shunting-yard", "build", "eval", "diff", "substitute"};
+
+template <std::size_t N>
+void load(const std::array<std::atomic<std::uint64_t>, N>& from, std::array<std::uint64_t, N>& to) {
+    for (std::size_t i = 0; i < N; i++) {
+        to[i] = from[i].load(std::memory_order_relaxed);
+    }
+}
+
+template <std::size_t N>
+void clear(std::array<std::atomic<std::uint64_t>, N>& counters) {
+    for (auto& counter : counters) {
+        counter.store(0, std::memory_order_relaxed);
+    }
+}
+
+}
+
+ProfileStats profile_stats() {
+    ProfileStats stats;
+    load(counters.visits, stats.visits);
+    load(counters.phase_calls, stats.phase_calls);
+    load(counters.phase_nanoseconds, stats.phase_nanoseconds);
+    load(counters.phase_allocations, stats.phase_allocations);
+    return stats;
+}
+
+void profile_reset() {
+    clear(counters.visits);
+    clear(counters.phase_calls);
+    clear(counters.phase_nanoseconds);
+    clear(counters.phase_allocations);
+}
+
+std::string profile_report(const ProfileStats& stats) {
+    std::string report;
+    char line[128];
+    std::snprintf(line, sizeof(line), "shape: depth %zu, unique nodes %zu, total nodes %llu\n", stats.shape.depth,
+                  stats.shape.unique_nodes, static_cast<unsigned long long>(stats.shape.total_nodes));
+    report += line;
+    if (!profiling_enabled()) {
+        return report + "counters: compiled out (build with make PROFILE=1)\n";
+    }
+    for (std::size_t i = 0; i < profile_phase_count; i++) {
+        if (stats.phase_calls[i] == 0) {
+            continue;
+        }
+        std::snprintf(line, sizeof(line), "phase %s: %llu calls, %.3f ms, %llu nodes allocated\n", phase_names[i],
+                      static_cast<unsigned long long>(stats.phase_calls[i]), stats.phase_nanoseconds[i] / 1e6,
+                      static_cast<unsigned long long>(stats.phase_allocations[i]));
+        report += line;
+    }
+    std::uint64_t total = 0;
+    std::string visits;
+    for (std::size_t i = 0; i < profile_kind_count; i++) {
+        if (stats.visits[i] == 0) {
+            continue;
+        }
+        total += stats.visits[i];
+        visits += std::string(visits.empty() ? "" : ", ") + kind_names[i] + " " + std::to_string(stats.visits[i]);
+    }
+    report += "visits: " + std::to_string(total) + (visits.empty() ? "" : " (" + visits + ")") + "\n";
+    return report;
+}
+
+void profile_visit(std::size_t kind, std::uint64_t count) {
+    counters.visits[kind].fetch_add(count, std::memory_order_relaxed);
+}
+
+void profile_allocation() {
+    if (current_phase >= 0) {
+        counters.phase_allocations[current_phase].fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+ProfileScope::ProfileScope(ProfilePhase phase)
+    : phase_(phase), previous_(current_phase), active_(current_phase != static_cast<int>(phase)) {
+    if (active_) {
+        current_phase = static_cast<int>(phase);
+        start_ = std::chrono::steady_clock::now();
+    }
+}
+
+ProfileScope::~ProfileScope() {
+    if (!active_) {
+        return;
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start_;
+    std::size_t index = static_cast<std::size_t>(phase_);
+    counters.phase_calls[index].fetch_add(1, std::memory_order_relaxed);
+    counters.phase_nanoseconds[index].fetch_add(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count(), std::memory_order_relaxed);
+    current_phase = previous_;
+}
@@ -0,0 +1,98 @@
+#ifndef EXPRESSION_PROFILE_H
+#define EXPRESSION_PROFILE_H
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Opt-in instrumentation. The hooks below compile to nothing unless
+// EXPRESSION_PROFILE is defined (make PROFILE=1); the counters they feed
+// and the reporting functions always exist, so callers need no #ifdefs.
+
+// Phases timed by ProfileScope.
+enum class ProfilePhase : std::uint8_t {
+    Tokenize,
+    ShuntingYard,
+    Build,
+    Eval,
+    Diff,
+    Substitute
+};
+
+constexpr std::size_t profile_phase_count = 6;
+// One counter per OpCode, in OpCode order.
+constexpr std::size_t profile_kind_count = 11;
+
+// Shape of an expression graph: `depth` counts the nodes on the longest
+// root-to-leaf path, `unique_nodes` the distinct (interned) nodes and
+// `total_nodes` the nodes of the same expression written out as a tree,
+// saturating at UINT64_MAX.
+struct ExpressionShape {
+    std::size_t depth = 0;
+    std::size_t unique_nodes = 0;
+    std::uint64_t total_nodes = 0;
+};
+
+struct ProfileStats {
+    // Node evaluations by kind (memoized revisits of shared nodes excluded).
+    std::array<std::uint64_t, profile_kind_count> visits{};
+    std::array<std::uint64_t, profile_phase_count> phase_calls{};
+    // Summed over the threads that ran the phase, so parallel batches can
+    // report more time than passed.
+    std::array<std::uint64_t, profile_phase_count> phase_nanoseconds{};
+    // Nodes allocated while each phase was active; nodes found in the
+    // interning table are not allocated and not counted.
+    std::array<std::uint64_t, profile_phase_count> phase_allocations{};
+    // Filled in by the caller for the expression of interest.
+    ExpressionShape shape;
+};
+
+constexpr bool profiling_enabled() {
+#ifdef EXPRESSION_PROFILE
+    return true;
+#else
+    return false;
+#endif
+}
+
+// Counters accumulated since the last reset, across all threads.
+ProfileStats profile_stats();
+void profile_reset();
+// Human-readable summary, one item per line.
+std::string profile_report(const ProfileStats& stats);
+
+// `count` visits of one kind at once, as a batch evaluates a node per row.
+void profile_visit(std::size_t kind, std::uint64_t count = 1);
+void profile_allocation();
+
+// Times the enclosing scope as `phase` and attributes node allocations on
+// this thread to it. A scope nested in one of the same phase does nothing.
+class ProfileScope {
+public:
+    explicit ProfileScope(ProfilePhase phase);
+    ~ProfileScope();
+    ProfileScope(const ProfileScope&) = delete;
+    ProfileScope& operator=(const ProfileScope&) = delete;
+
+private:
+    ProfilePhase phase_;
+    int previous_;
+    bool active_;
+    std::chrono::steady_clock::time_point start_;
+};
+
+#ifdef EXPRESSION_PROFILE
+#define EXPRESSION_PROFILE_VISIT(kind) profile_visit(static_cast<std::size_t>(kind))
+#define EXPRESSION_PROFILE_VISITS(kind, count) profile_visit(static_cast<std::size_t>(kind), count)
+#define EXPRESSION_PROFILE_ALLOCATION() profile_allocation()
+#define EXPRESSION_PROFILE_PHASE(phase) ProfileScope expression_profile_scope_(ProfilePhase::phase)
+#else
+#define EXPRESSION_PROFILE_VISIT(kind) ((void)0)
+#define EXPRESSION_PROFILE_VISITS(kind, count) ((void)0)
+#define EXPRESSION_PROFILE_ALLOCATION() ((void)0)
+#define EXPRESSION_PROFILE_PHASE(phase) ((void)0)
+#endif
+
+#endif //EXPRESSION_PROFILE_H
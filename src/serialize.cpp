@@ -0,0 +1,238 @@
+#include "serialize.h"
+
+#include <bit>
+#include <complex>
+#include <cstring>
+#include <stdexcept>
+#include <type_traits>
+
+static_assert(sizeof(SerialHeader) == 32 && sizeof(SerialNode) == 12 && sizeof(SerialName) == 8);
+
+constexpr std::uint16_t serial_version = 1;
+
+template <typename T>
+constexpr std::uint8_t serial_scalar() {
+    if constexpr (std::is_same_v<T, double>) {
+        return 1;
+    } else {
+        static_assert(std::is_same_v<T, std::complex<double>>, "Serialized scalars are double or complex<double>");
+        return 2;
+    }
+}
+
+inline std::uint8_t serial_byte_order() {
+    return std::endian::native == std::endian::little ? 1 : 2;
+}
+
+inline std::size_t serial_align(std::size_t offset) {
+    return (offset + 7) / 8 * 8;
+}
+
+template <typename T>
+std::vector<std::byte> serialize(const Program<T>& program) {
+    const auto& ssa = program.ssa();
+    const auto& constants = program.constants();
+    const auto& variables = program.variables();
+    std::size_t names_size = 0;
+    for (const auto& name : variables) {
+        names_size += name.size();
+    }
+
+    SerialHeader header{};
+    std::memcpy(header.magic, "EXPR", 4);
+    header.version = serial_version;
+    header.scalar = serial_scalar<T>();
+    header.byte_order = serial_byte_order();
+    header.node_count = static_cast<std::uint32_t>(ssa.size());
+    header.constant_count = static_cast<std::uint32_t>(constants.size());
+    header.variable_count = static_cast<std::uint32_t>(variables.size());
+    header.names_size = static_cast<std::uint32_t>(names_size);
+
+    std::size_t nodes_offset = sizeof(SerialHeader);
+    std::size_t constants_offset = serial_align(nodes_offset + ssa.size() * sizeof(SerialNode));
+    std::size_t variables_offset = constants_offset + constants.size() * sizeof(T);
+    std::size_t names_offset = variables_offset + variables.size() * sizeof(SerialName);
+    std::vector<std::byte> bytes(names_offset + names_size);
+
+    std::memcpy(bytes.data(), &header, sizeof(header));
+    for (std::size_t i = 0; i < ssa.size(); i++) {
+        SerialNode node{ssa[i].op, {}, ssa[i].a, is_binary(ssa[i].op) ? ssa[i].b : 0};
+        std::memcpy(bytes.data() + nodes_offset + i * sizeof(SerialNode), &node, sizeof(node));
+    }
+    if (!constants.empty()) {
+        std::memcpy(bytes.data() + constants_offset, constants.data(), constants.size() * sizeof(T));
+    }
+    std::uint32_t offset = 0;
+    for (std::size_t i = 0; i < variables.size(); i++) {
+        SerialName name{offset, static_cast<std::uint32_t>(variables[i].size())};
+        std::memcpy(bytes.data() + variables_offset + i * sizeof(SerialName), &name, sizeof(name));
+        std::memcpy(bytes.data() + names_offset + offset, variables[i].data(), variables[i].size());
+        offset += name.length;
+    }
+    return bytes;
+}
+
+template <typename T>
+std::vector<std::byte> serialize(Expression<T>& expression) {
+    return serialize(expression.compile());
+}
+
+template <typename T>
+SerializedExpression<T> SerializedExpression<T>::load(std::span<const std::byte> bytes) {
+    if (reinterpret_cast<std::uintptr_t>(bytes.data()) % 8 != 0) {
+        throw std::runtime_error("Serialized expression is not 8-byte aligned");
+    }
+    if (bytes.size() < sizeof(SerialHeader)) {
+        throw std::runtime_error("Serialized expression is truncated");
+    }
+    SerializedExpression result;
+    result.header_ = reinterpret_cast<const SerialHeader*>(bytes.data());
+    const SerialHeader& header = *result.header_;
+    if (std::memcmp(header.magic, "EXPR", 4) != 0) {
+        throw std::runtime_error("Not a serialized expression");
+    }
+    if (header.version != serial_version) {
+        throw std::runtime_error("Unsupported serialized expression version " + std::to_string(header.version));
+    }
+    if (header.scalar != serial_scalar<T>()) {
+        throw std::runtime_error("Serialized expression has a different scalar type");
+    }
+    if (header.byte_order != serial_byte_order()) {
+        throw std::runtime_error("Serialized expression has a different byte order");
+    }
+    if (header.node_count == 0) {
+        throw std::runtime_error("Serialized expression has no nodes");
+    }
+    std::size_t nodes_offset = sizeof(SerialHeader);
+    std::size_t constants_offset = serial_align(nodes_offset + std::size_t(header.node_count) * sizeof(SerialNode));
+    std::size_t variables_offset = constants_offset + std::size_t(header.constant_count) * sizeof(T);
+    std::size_t names_offset = variables_offset + std::size_t(header.variable_count) * sizeof(SerialName);
+    if (bytes.size() != names_offset + header.names_size) {
+        throw std::runtime_error("Serialized expression has the wrong size");
+    }
+    result.nodes_ = reinterpret_cast<const SerialNode*>(bytes.data() + nodes_offset);
+    result.constants_ = bytes.data() + constants_offset;
+    result.variables_ = reinterpret_cast<const SerialName*>(bytes.data() + variables_offset);
+    result.names_ = reinterpret_cast<const char*>(bytes.data() + names_offset);
+
+    for (std::uint32_t i = 0; i < header.node_count; i++) {
+        const SerialNode& node = result.nodes_[i];
+        bool valid;
+        switch (node.op) {
+            case OpCode::Constant: valid = node.a < header.constant_count; break;
+            case OpCode::Variable: valid = node.a < header.variable_count; break;
+            default:
+                valid = node.op <= OpCode::Ln && node.a < i && (!is_binary(node.op) || node.b < i);
+                break;
+        }
+        if (!valid) {
+            throw std::runtime_error("Serialized expression has an invalid node " + std::to_string(i));
+        }
+    }
+    for (std::uint32_t i = 0; i < header.variable_count; i++) {
+        const SerialName& name = result.variables_[i];
+        if (name.offset > header.names_size || name.length > header.names_size - name.offset) {
+            throw std::runtime_error("Serialized expression has an invalid variable " + std::to_string(i));
+        }
+    }
+    return result;
+}
+
+template <typename T>
+std::size_t SerializedExpression<T>::size() const {
+    return header_->node_count;
+}
+
+template <typename T>
+std::size_t SerializedExpression<T>::variable_count() const {
+    return header_->variable_count;
+}
+
+template <typename T>
+std::string_view SerializedExpression<T>::variable(std::size_t slot) const {
+    return std::string_view(names_ + variables_[slot].offset, variables_[slot].length);
+}
+
+template <typename T>
+std::size_t SerializedExpression<T>::slot(std::string_view name) const {
+    for (std::size_t i = 0; i < variable_count(); i++) {
+        if (variable(i) == name) {
+            return i;
+        }
+    }
+    return variable_count();
+}
+
+template <typename T>
+T SerializedExpression<T>::constant(std::uint32_t index) const {
+    T value;
+    std::memcpy(&value, constants_ + index * sizeof(T), sizeof(T));
+    return value;
+}
+
+template <typename T>
+T SerializedExpression<T>::eval(std::span<const T> values) const {
+    std::vector<T> scratch(size());
+    return eval(values, scratch);
+}
+
+template <typename T>
+T SerializedExpression<T>::eval(std::span<const T> values, std::span<T> scratch) const {
+    if (values.size() < variable_count()) {
+        throw std::runtime_error("Not enough values for serialized expression");
+    }
+    if (scratch.size() < size()) {
+        throw std::runtime_error("Not enough scratch for serialized expression");
+    }
+    for (std::size_t i = 0; i < size(); i++) {
+        const SerialNode& node = nodes_[i];
+        switch (node.op) {
+            case OpCode::Constant: scratch[i] = constant(node.a); break;
+            case OpCode::Variable: scratch[i] = values[node.a]; break;
+            case OpCode::Add: scratch[i] = scratch[node.a] + scratch[node.b]; break;
+            case OpCode::Sub: scratch[i] = scratch[node.a] - scratch[node.b]; break;
+            case OpCode::Mul: scratch[i] = scratch[node.a] * scratch[node.b]; break;
+            case OpCode::Div: scratch[i] = scratch[node.a] / scratch[node.b]; break;
+            case OpCode::Pow: scratch[i] = apply_binary(OpCode::Pow, scratch[node.a], scratch[node.b]); break;
+            default: scratch[i] = apply_unary(node.op, scratch[node.a]); break;
+        }
+    }
+    return scratch[size() - 1];
+}
+
+template <typename T>
+Program<T> SerializedExpression<T>::program() const {
+    Compiler<T> compiler;
+    for (std::size_t i = 0; i < size(); i++) {
+        const SerialNode& node = nodes_[i];
+        switch (node.op) {
+            case OpCode::Constant: compiler.constant(constant(node.a)); break;
+            case OpCode::Variable: compiler.variable(std::string(variable(node.a))); break;
+            default: compiler.operation(node.op, node.a, node.b); break;
+        }
+    }
+    return compiler.finish();
+}
+
+template <typename T>
+Expression<T> SerializedExpression<T>::expression() const {
+    std::vector<Expression<T>> built;
+    built.reserve(size());
+    for (std::size_t i = 0; i < size(); i++) {
+        const SerialNode& node = nodes_[i];
+        switch (node.op) {
+            case OpCode::Constant: built.emplace_back(constant(node.a)); break;
+            case OpCode::Variable: built.emplace_back(std::string(variable(node.a))); break;
+            case OpCode::Add: built.push_back(built[node.a] + built[node.b]); break;
+            case OpCode::Sub: built.push_back(built[node.a] - built[node.b]); break;
+            case OpCode::Mul: built.push_back(built[node.a] * built[node.b]); break;
+            case OpCode::Div: built.push_back(built[node.a] / built[node.b]); break;
+            case OpCode::Pow: built.push_back(built[node.a] ^ built[node.b]); break;
+            case OpCode::Sin: built.push_back(sin(built[node.a])); break;
+            case OpCode::Cos: built.push_back(cos(built[node.a])); break;
+            case OpCode::Exp: built.push_back(exp(built[node.a])); break;
+            default: built.push_back(ln(built[node.a])); break;
+        }
+    }
+    return built.back();
+}
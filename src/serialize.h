@@ -0,0 +1,87 @@
+#ifndef EXPRESSION_SERIALIZE_H
+#define EXPRESSION_SERIALIZE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "expression.h"
+
+// Binary expression format, version 1. All fields are in the writer's byte
+// order, which the header records; sections follow each other in this order:
+//
+//   header      32 bytes, see SerialHeader
+//   nodes       node_count SerialNode records, children before parents and
+//               the root last; operands are node indices, a Constant's `a`
+//               indexes the constants and a Variable's `a` the variables
+//   constants   constant_count values of T, 8-byte aligned, bit-exact
+//   variables   variable_count (offset, length) pairs into the names
+//   names       names_size bytes of variable names, not terminated
+struct SerialHeader {
+    char magic[4];
+    std::uint16_t version;
+    std::uint8_t scalar;
+    std::uint8_t byte_order;
+    std::uint32_t node_count;
+    std::uint32_t constant_count;
+    std::uint32_t variable_count;
+    std::uint32_t names_size;
+    std::uint64_t reserved;
+};
+
+struct SerialNode {
+    OpCode op;
+    std::uint8_t reserved[3];
+    std::uint32_t a;
+    std::uint32_t b;
+};
+
+struct SerialName {
+    std::uint32_t offset;
+    std::uint32_t length;
+};
+
+template <typename T>
+std::vector<std::byte> serialize(const Program<T>& program);
+template <typename T>
+std::vector<std::byte> serialize(Expression<T>& expression);
+
+// Expression read in place from serialized bytes, e.g. a MappedFile. Loading
+// checks the layout and every index in one pass and allocates nothing; the
+// bytes must stay alive and 8-byte aligned while the view is used.
+template <typename T>
+class SerializedExpression {
+public:
+    // Throws std::runtime_error if the bytes are not a valid version 1 image
+    // for this T.
+    static SerializedExpression load(std::span<const std::byte> bytes);
+
+    std::size_t size() const;
+    std::size_t variable_count() const;
+    std::string_view variable(std::size_t slot) const;
+    // Slot of a variable, variable_count() if the expression has no such variable.
+    std::size_t slot(std::string_view name) const;
+
+    // values[slot] is the value of variable(slot). `scratch` needs size() values.
+    T eval(std::span<const T> values) const;
+    T eval(std::span<const T> values, std::span<T> scratch) const;
+
+    // The same program or interned tree as the serialized expression, for
+    // batch evaluation, differentiation and the rest of the Expression API.
+    Program<T> program() const;
+    Expression<T> expression() const;
+
+private:
+    SerializedExpression() = default;
+    T constant(std::uint32_t index) const;
+    const SerialHeader* header_ = nullptr;
+    const SerialNode* nodes_ = nullptr;
+    const std::byte* constants_ = nullptr;
+    const SerialName* variables_ = nullptr;
+    const char* names_ = nullptr;
+};
+
+#endif //EXPRESSION_SERIALIZE_H
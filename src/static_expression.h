@@ -0,0 +1,658 @@
+#ifndef EXPRESSION_STATIC_EXPRESSION_H
+#define EXPRESSION_STATIC_EXPRESSION_H
+
+#include <array>
+#include <cmath>
+#include <complex>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+#include "expression.h"
+
+// Expressions fixed at build time. Every node is a type, so an expression
+// is an empty (or literal-only) object whose evaluation is inlined into the
+// caller: no heap nodes, no virtual calls and no name lookups at run time.
+//
+//     constexpr auto f = ct::parse<"sin(x*y)+x^2">();
+//     double v = f(0.5, 2.0);                 // arguments in f.variables() order
+//     constexpr auto dfdx = ct::diff<"x">(f); // derivative is a type as well
+//
+// ct::parse accepts the grammar of the command line parser with the same
+// precedence table (equal priorities group to the right, as polish_order
+// does). ct::var, ct::constant and the operators below build the same node
+// types directly from C++.
+namespace ct {
+
+template <std::size_t N>
+struct FixedString {
+    char data[N]{};
+    constexpr FixedString() = default;
+    constexpr FixedString(const char (&text)[N]) {
+        for (std::size_t i = 0; i < N; i++) {
+            data[i] = text[i];
+        }
+    }
+    constexpr std::string_view view() const {
+        return std::string_view(data, N - 1);
+    }
+};
+
+// Distinct variable names in order of first appearance, left to right.
+struct NameList {
+    std::array<std::string_view, 64> names{};
+    std::size_t size = 0;
+
+    constexpr void add(std::string_view name) {
+        if (index(name) != size) {
+            return;
+        }
+        if (size == names.size()) {
+            throw "too many variables in a compile-time expression";
+        }
+        names[size++] = name;
+    }
+    constexpr std::size_t index(std::string_view name) const {
+        std::size_t i = 0;
+        while (i < size && names[i] != name) {
+            i++;
+        }
+        return i;
+    }
+};
+
+template <typename E>
+consteval NameList names_of() {
+    NameList names;
+    E::collect(names);
+    return names;
+}
+
+template <typename E>
+inline constexpr NameList names_v = names_of<E>();
+
+template <typename T>
+struct is_complex : std::false_type {};
+template <typename T>
+struct is_complex<std::complex<T>> : std::true_type {};
+
+// Root behaviour shared by every node type.
+template <typename Derived>
+struct StaticNode {
+    static constexpr const NameList& variables() {
+        return names_v<Derived>;
+    }
+
+    template <typename T>
+    constexpr T eval(std::span<const T> values) const {
+        if (values.size() < names_v<Derived>.size) {
+            throw std::runtime_error("Not enough values for compiled expression");
+        }
+        return static_cast<const Derived&>(*this).template evaluate<Derived>(values.data());
+    }
+
+    // Values are taken in variables() order.
+    template <typename T, typename... Ts>
+    constexpr T operator()(T first, Ts... rest) const {
+        static_assert(sizeof...(Ts) + 1 == names_v<Derived>.size, "one argument per variable");
+        const T values[] = {first, T(rest)...};
+        return static_cast<const Derived&>(*this).template evaluate<Derived>(values);
+    }
+    constexpr double operator()() const requires (names_v<Derived>.size == 0) {
+        return static_cast<const Derived&>(*this).template evaluate<Derived>(static_cast<const double*>(nullptr));
+    }
+
+    template <typename T>
+    Expression<T> to_expression() const {
+        return static_cast<const Derived&>(*this).template build<T>();
+    }
+};
+
+template <typename E>
+concept Static = std::is_base_of_v<StaticNode<E>, E>;
+
+template <typename U>
+concept Scalar = std::is_arithmetic_v<U> || is_complex<U>::value;
+
+template <double V>
+struct Constant : StaticNode<Constant<V>> {
+    static constexpr void collect(NameList&) {}
+    static constexpr bool depends(std::string_view) { return false; }
+
+    template <typename Root, typename T>
+    constexpr T evaluate(const T*) const {
+        return T(V);
+    }
+    template <FixedString Name>
+    constexpr auto derive() const {
+        return Constant<0.0>{};
+    }
+    template <typename T>
+    Expression<T> build() const {
+        return Expression<T>(T(V));
+    }
+};
+
+// Imaginary literal such as 2i; only evaluates for complex value types.
+template <double V>
+struct Imaginary : StaticNode<Imaginary<V>> {
+    static constexpr void collect(NameList&) {}
+    static constexpr bool depends(std::string_view) { return false; }
+
+    template <typename Root, typename T>
+    constexpr T evaluate(const T*) const {
+        static_assert(is_complex<T>::value, "imaginary constant in a real expression");
+        return T(0, V);
+    }
+    template <FixedString Name>
+    constexpr auto derive() const {
+        return Constant<0.0>{};
+    }
+    template <typename T>
+    Expression<T> build() const {
+        static_assert(is_complex<T>::value, "imaginary constant in a real expression");
+        return Expression<T>(T(0, V));
+    }
+};
+
+// Run-time constant mixed into an expression template, as in x * 2.5.
+template <typename U>
+struct Literal : StaticNode<Literal<U>> {
+    U value{};
+    constexpr Literal() = default;
+    constexpr explicit Literal(U v) : value(v) {}
+
+    static constexpr void collect(NameList&) {}
+    static constexpr bool depends(std::string_view) { return false; }
+
+    template <typename Root, typename T>
+    constexpr T evaluate(const T*) const {
+        return T(value);
+    }
+    template <FixedString Name>
+    constexpr auto derive() const {
+        return Constant<0.0>{};
+    }
+    template <typename T>
+    Expression<T> build() const {
+        return Expression<T>(T(value));
+    }
+};
+
+template <FixedString Name>
+struct Variable : StaticNode<Variable<Name>> {
+    static constexpr void collect(NameList& names) {
+        names.add(Name.view());
+    }
+    static constexpr bool depends(std::string_view name) {
+        return name == Name.view();
+    }
+
+    template <typename Root, typename T>
+    constexpr T evaluate(const T* values) const {
+        constexpr std::size_t slot = names_v<Root>.index(Name.view());
+        return values[slot];
+    }
+    template <FixedString Other>
+    constexpr auto derive() const {
+        if constexpr (Other.view() == Name.view()) {
+            return Constant<1.0>{};
+        } else {
+            return Constant<0.0>{};
+        }
+    }
+    template <typename T>
+    Expression<T> build() const {
+        return Expression<T>(std::string(Name.view()));
+    }
+};
+
+template <OpCode Op, typename L, typename R>
+struct Binary : StaticNode<Binary<Op, L, R>> {
+    [[no_unique_address]] L left;
+    [[no_unique_address]] R right;
+    constexpr Binary() = default;
+    constexpr Binary(L l, R r) : left(l), right(r) {}
+
+    static constexpr void collect(NameList& names) {
+        L::collect(names);
+        R::collect(names);
+    }
+    static constexpr bool depends(std::string_view name) {
+        return L::depends(name) || R::depends(name);
+    }
+
+    template <typename Root, typename T>
+    constexpr T evaluate(const T* values) const {
+        T a = left.template evaluate<Root>(values);
+        T b = right.template evaluate<Root>(values);
+        if constexpr (Op == OpCode::Add) return a + b;
+        else if constexpr (Op == OpCode::Sub) return a - b;
+        else if constexpr (Op == OpCode::Mul) return a * b;
+        else if constexpr (Op == OpCode::Div) return a / b;
+        else {
+            using std::pow;
+            return pow(a, b);
+        }
+    }
+
+    // The rules of BinaryOperation<T>::diff, including leaving out the terms
+    // of operands that do not depend on the variable.
+    template <FixedString Name>
+    constexpr auto derive() const;
+
+    template <typename T>
+    Expression<T> build() const {
+        Expression<T> a = left.template build<T>();
+        Expression<T> b = right.template build<T>();
+        if constexpr (Op == OpCode::Add) return a + b;
+        else if constexpr (Op == OpCode::Sub) return a - b;
+        else if constexpr (Op == OpCode::Mul) return a * b;
+        else if constexpr (Op == OpCode::Div) return a / b;
+        else return a ^ b;
+    }
+};
+
+template <OpCode Op, typename A>
+struct Unary : StaticNode<Unary<Op, A>> {
+    [[no_unique_address]] A value;
+    constexpr Unary() = default;
+    constexpr explicit Unary(A v) : value(v) {}
+
+    static constexpr void collect(NameList& names) {
+        A::collect(names);
+    }
+    static constexpr bool depends(std::string_view name) {
+        return A::depends(name);
+    }
+
+    template <typename Root, typename T>
+    constexpr T evaluate(const T* values) const {
+        T a = value.template evaluate<Root>(values);
+        if constexpr (Op == OpCode::Sin) return std::sin(a);
+        else if constexpr (Op == OpCode::Cos) return std::cos(a);
+        else if constexpr (Op == OpCode::Exp) return std::exp(a);
+        else return std::log(a);
+    }
+
+    // The rules of UnaryOperation<T>::diff.
+    template <FixedString Name>
+    constexpr auto derive() const;
+
+    template <typename T>
+    Expression<T> build() const {
+        Expression<T> a = value.template build<T>();
+        if constexpr (Op == OpCode::Sin) return ::sin(a);
+        else if constexpr (Op == OpCode::Cos) return ::cos(a);
+        else if constexpr (Op == OpCode::Exp) return ::exp(a);
+        else return ::ln(a);
+    }
+};
+
+template <OpCode Op, typename L, typename R>
+constexpr Binary<Op, L, R> make(L l, R r) {
+    return Binary<Op, L, R>(l, r);
+}
+
+template <OpCode Op, typename A>
+constexpr Unary<Op, A> make(A a) {
+    return Unary<Op, A>(a);
+}
+
+template <FixedString Name, typename E>
+constexpr auto diff_node(const E& e) {
+    if constexpr (!E::depends(Name.view())) {
+        return Constant<0.0>{};
+    } else {
+        return e.template derive<Name>();
+    }
+}
+
+template <OpCode Op, typename L, typename R>
+template <FixedString Name>
+constexpr auto Binary<Op, L, R>::derive() const {
+    constexpr bool left_varies = L::depends(Name.view());
+    constexpr bool right_varies = R::depends(Name.view());
+    if constexpr (Op == OpCode::Add) {
+        if constexpr (!right_varies) {
+            return diff_node<Name>(left);
+        } else if constexpr (!left_varies) {
+            return diff_node<Name>(right);
+        } else {
+            return make<OpCode::Add>(diff_node<Name>(left), diff_node<Name>(right));
+        }
+    } else if constexpr (Op == OpCode::Sub) {
+        if constexpr (!right_varies) {
+            return diff_node<Name>(left);
+        } else if constexpr (!left_varies) {
+            return make<OpCode::Mul>(diff_node<Name>(right), Constant<-1.0>{});
+        } else {
+            return make<OpCode::Sub>(diff_node<Name>(left), diff_node<Name>(right));
+        }
+    } else if constexpr (Op == OpCode::Mul) {
+        if constexpr (!right_varies) {
+            return make<OpCode::Mul>(diff_node<Name>(left), right);
+        } else if constexpr (!left_varies) {
+            return make<OpCode::Mul>(left, diff_node<Name>(right));
+        } else {
+            return make<OpCode::Add>(make<OpCode::Mul>(diff_node<Name>(left), right),
+                                     make<OpCode::Mul>(left, diff_node<Name>(right)));
+        }
+    } else if constexpr (Op == OpCode::Div) {
+        if constexpr (!right_varies) {
+            return make<OpCode::Div>(diff_node<Name>(left), right);
+        } else {
+            auto denominator = make<OpCode::Pow>(right, Constant<2.0>{});
+            auto right_part = make<OpCode::Mul>(left, diff_node<Name>(right));
+            if constexpr (!left_varies) {
+                return make<OpCode::Div>(make<OpCode::Mul>(right_part, Constant<-1.0>{}), denominator);
+            } else {
+                auto numerator = make<OpCode::Sub>(make<OpCode::Mul>(diff_node<Name>(left), right), right_part);
+                return make<OpCode::Div>(numerator, denominator);
+            }
+        }
+    } else {
+        auto left_part = [&] {
+            auto power = make<OpCode::Pow>(left, make<OpCode::Sub>(right, Constant<1.0>{}));
+            return make<OpCode::Mul>(make<OpCode::Mul>(right, power), diff_node<Name>(left));
+        };
+        auto right_part = [&] {
+            auto log = make<OpCode::Mul>(make<OpCode::Pow>(left, right), make<OpCode::Ln>(left));
+            return make<OpCode::Mul>(log, diff_node<Name>(right));
+        };
+        if constexpr (!right_varies) {
+            return left_part();
+        } else if constexpr (!left_varies) {
+            return right_part();
+        } else {
+            return make<OpCode::Add>(left_part(), right_part());
+        }
+    }
+}
+
+template <OpCode Op, typename A>
+template <FixedString Name>
+constexpr auto Unary<Op, A>::derive() const {
+    if constexpr (Op == OpCode::Sin) {
+        return make<OpCode::Mul>(make<OpCode::Cos>(value), diff_node<Name>(value));
+    } else if constexpr (Op == OpCode::Cos) {
+        return make<OpCode::Mul>(make<OpCode::Mul>(make<OpCode::Sin>(value), Constant<-1.0>{}), diff_node<Name>(value));
+    } else if constexpr (Op == OpCode::Ln) {
+        return make<OpCode::Div>(diff_node<Name>(value), value);
+    } else {
+        return make<OpCode::Mul>(make<OpCode::Exp>(value), diff_node<Name>(value));
+    }
+}
+
+template <FixedString Name, Static E>
+constexpr auto diff(const E& e) {
+    return diff_node<Name>(e);
+}
+
+template <FixedString Name>
+inline constexpr Variable<Name> var{};
+
+template <double V>
+inline constexpr Constant<V> constant{};
+
+template <Static E>
+constexpr auto lift(E e) {
+    return e;
+}
+
+template <Scalar U>
+constexpr auto lift(U u) {
+    return Literal<U>(u);
+}
+
+template <typename L, typename R>
+concept Operands = (Static<L> && (Static<R> || Scalar<R>)) || (Scalar<L> && Static<R>);
+
+template <typename L, typename R> requires Operands<L, R>
+constexpr auto operator+(L l, R r) { return make<OpCode::Add>(lift(l), lift(r)); }
+template <typename L, typename R> requires Operands<L, R>
+constexpr auto operator-(L l, R r) { return make<OpCode::Sub>(lift(l), lift(r)); }
+template <typename L, typename R> requires Operands<L, R>
+constexpr auto operator*(L l, R r) { return make<OpCode::Mul>(lift(l), lift(r)); }
+template <typename L, typename R> requires Operands<L, R>
+constexpr auto operator/(L l, R r) { return make<OpCode::Div>(lift(l), lift(r)); }
+template <typename L, typename R> requires Operands<L, R>
+constexpr auto operator^(L l, R r) { return make<OpCode::Pow>(lift(l), lift(r)); }
+
+template <Static A>
+constexpr auto sin(A a) { return make<OpCode::Sin>(a); }
+template <Static A>
+constexpr auto cos(A a) { return make<OpCode::Cos>(a); }
+template <Static A>
+constexpr auto exp(A a) { return make<OpCode::Exp>(a); }
+template <Static A>
+constexpr auto ln(A a) { return make<OpCode::Ln>(a); }
+
+// Compile-time parser. The string is tokenized and reordered exactly like
+// tokenizer + polish_order, then the postfix form is folded into a flat node
+// array which parse<> turns into node types.
+struct ParsedNode {
+    OpCode op = OpCode::Constant;
+    std::size_t left = 0;
+    std::size_t right = 0;
+    double value = 0;
+    bool imaginary = false;
+    std::size_t begin = 0;
+    std::size_t end = 0;
+};
+
+template <std::size_t N>
+struct ParsedTree {
+    std::array<ParsedNode, N + 1> nodes{};
+    std::size_t size = 0;
+    std::size_t root = 0;
+};
+
+constexpr bool is_digit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+constexpr bool is_alpha(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+// Same table as polish_order.
+constexpr int priority(OpCode op) {
+    switch (op) {
+        case OpCode::Add:
+        case OpCode::Sub: return 1;
+        case OpCode::Mul:
+        case OpCode::Div: return 2;
+        case OpCode::Pow: return 3;
+        default: return 4;
+    }
+}
+
+// Decimal digits with an optional fraction, as std::stod reads them.
+constexpr double parse_number(std::string_view text) {
+    std::uint64_t mantissa = 0;
+    std::size_t digits = 0;
+    int scale = 0;
+    bool fraction = false;
+    for (char c : text) {
+        if (c == '.') {
+            if (fraction) {
+                break;
+            }
+            fraction = true;
+            continue;
+        }
+        if (digits == 19) {
+            throw "number literal has too many digits";
+        }
+        mantissa = mantissa * 10 + static_cast<std::uint64_t>(c - '0');
+        digits++;
+        scale += fraction;
+    }
+    if (digits == 0) {
+        throw "number literal has no digits";
+    }
+    double power = 1;
+    for (int i = 0; i < scale; i++) {
+        power *= 10;
+    }
+    return static_cast<double>(mantissa) / power;
+}
+
+template <std::size_t N>
+consteval ParsedTree<N> parse_tree(const FixedString<N>& source) {
+    enum Kind { Operand, Operator, Open, Close };
+    struct Token {
+        Kind kind = Operand;
+        OpCode op = OpCode::Constant;
+        std::size_t begin = 0;
+        std::size_t end = 0;
+    };
+    std::string_view input = source.view();
+
+    std::array<Token, N + 2> tokens{};
+    std::size_t count = 0;
+    tokens[count++] = {Open};
+    for (std::size_t i = 0; i < input.size(); i++) {
+        char c = input[i];
+        if (c == ' ') {
+            continue;
+        }
+        if (c == '+' || c == '-' || c == '*' || c == '/' || c == '^') {
+            OpCode op = c == '+' ? OpCode::Add : c == '-' ? OpCode::Sub : c == '*' ? OpCode::Mul
+                      : c == '/' ? OpCode::Div : OpCode::Pow;
+            tokens[count++] = {Operator, op};
+        } else if (is_digit(c) || c == '.') {
+            std::size_t begin = i;
+            while (i < input.size() && (is_digit(input[i]) || input[i] == '.' || input[i] == 'i')) {
+                i++;
+            }
+            tokens[count++] = {Operand, OpCode::Constant, begin, i};
+            i--;
+        } else if (c == '(') {
+            tokens[count++] = {Open};
+        } else if (c == ')') {
+            tokens[count++] = {Close};
+        } else if (is_alpha(c)) {
+            std::size_t begin = i;
+            while (i < input.size() && is_alpha(input[i])) {
+                i++;
+            }
+            std::string_view word = input.substr(begin, i - begin);
+            if (word == "sin") tokens[count++] = {Operator, OpCode::Sin};
+            else if (word == "cos") tokens[count++] = {Operator, OpCode::Cos};
+            else if (word == "exp") tokens[count++] = {Operator, OpCode::Exp};
+            else if (word == "ln") tokens[count++] = {Operator, OpCode::Ln};
+            else tokens[count++] = {Operand, OpCode::Variable, begin, i};
+            i--;
+        } else {
+            throw "unknown symbol in expression";
+        }
+    }
+    tokens[count++] = {Close};
+
+    std::array<Token, N + 2> postfix{};
+    std::size_t length = 0;
+    std::array<Token, N + 2> stack{};
+    std::size_t depth = 0;
+    for (std::size_t i = 0; i < count; i++) {
+        const Token& token = tokens[i];
+        if (token.kind == Operand) {
+            postfix[length++] = token;
+        } else if (token.kind == Open) {
+            stack[depth++] = token;
+        } else if (token.kind == Operator) {
+            while (depth > 0 && stack[depth - 1].kind == Operator && priority(stack[depth - 1].op) > priority(token.op)) {
+                postfix[length++] = stack[--depth];
+            }
+            stack[depth++] = token;
+        } else {
+            while (depth > 0) {
+                Token top = stack[--depth];
+                if (top.kind == Open) {
+                    break;
+                }
+                postfix[length++] = top;
+            }
+        }
+    }
+
+    ParsedTree<N> tree;
+    std::array<std::size_t, N + 2> operands{};
+    std::size_t top = 0;
+    for (std::size_t i = 0; i < length; i++) {
+        const Token& token = postfix[i];
+        ParsedNode node;
+        node.op = token.op;
+        if (token.kind == Operand) {
+            node.begin = token.begin;
+            node.end = token.end;
+            if (token.op == OpCode::Constant) {
+                std::string_view text = input.substr(token.begin, token.end - token.begin);
+                node.imaginary = text.back() == 'i';
+                node.value = parse_number(node.imaginary ? text.substr(0, text.size() - 1) : text);
+            }
+        } else if (priority(token.op) == 4) {
+            if (top < 1) {
+                throw "function without an argument";
+            }
+            node.left = operands[--top];
+        } else {
+            if (top < 2) {
+                throw "operator without two operands";
+            }
+            node.right = operands[--top];
+            node.left = operands[--top];
+        }
+        tree.nodes[tree.size] = node;
+        operands[top++] = tree.size++;
+    }
+    if (top != 1) {
+        throw "malformed expression";
+    }
+    tree.root = operands[0];
+    return tree;
+}
+
+template <FixedString S>
+inline constexpr auto parsed_v = parse_tree(S);
+
+template <FixedString S, std::size_t Begin, std::size_t End>
+consteval FixedString<End - Begin + 1> substring() {
+    FixedString<End - Begin + 1> result;
+    for (std::size_t i = Begin; i < End; i++) {
+        result.data[i - Begin] = S.data[i];
+    }
+    return result;
+}
+
+template <FixedString S, std::size_t I>
+constexpr auto build_node() {
+    constexpr ParsedNode node = parsed_v<S>.nodes[I];
+    if constexpr (node.op == OpCode::Constant) {
+        if constexpr (node.imaginary) {
+            return Imaginary<node.value>{};
+        } else {
+            return Constant<node.value>{};
+        }
+    } else if constexpr (node.op == OpCode::Variable) {
+        return Variable<substring<S, node.begin, node.end>()>{};
+    } else if constexpr (priority(node.op) == 4) {
+        return Unary<node.op, decltype(build_node<S, node.left>())>{};
+    } else {
+        return Binary<node.op, decltype(build_node<S, node.left>()), decltype(build_node<S, node.right>())>{};
+    }
+}
+
+template <FixedString S>
+constexpr auto parse() {
+    return build_node<S, parsed_v<S>.root>();
+}
+
+}
+
+#endif //EXPRESSION_STATIC_EXPRESSION_H
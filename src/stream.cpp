@@ -0,0 +1,364 @@
+#include "stream.h"
+
+#include <algorithm>
+#include <charconv>
+#include <complex>
+#include <cstring>
+#include <stdexcept>
+
+inline RecordReader::RecordReader(std::FILE* in, std::size_t buffer_size)
+    : in_(in), buffer_(buffer_size) {}
+
+// Moves the unread tail to the front of the buffer and reads after it,
+// growing the buffer only when a single line fills all of it.
+inline bool RecordReader::fill() {
+    if (eof_) {
+        return false;
+    }
+    if (begin_ > 0) {
+        std::memmove(buffer_.data(), buffer_.data() + begin_, end_ - begin_);
+        end_ -= begin_;
+        last_ = begin_ = 0;
+    }
+    if (end_ == buffer_.size()) {
+        buffer_.resize(buffer_.size() * 2);
+    }
+    std::size_t read = std::fread(buffer_.data() + end_, 1, buffer_.size() - end_, in_);
+    end_ += read;
+    if (read == 0) {
+        eof_ = true;
+    }
+    return read > 0;
+}
+
+inline bool RecordReader::next(std::vector<std::string_view>& fields) {
+    while (true) {
+        const char* start = buffer_.data() + begin_;
+        auto* newline = static_cast<const char*>(std::memchr(start, '\n', end_ - begin_));
+        if (!newline && fill()) {
+            continue;
+        }
+        if (!newline && begin_ == end_) {
+            return false;
+        }
+        start = buffer_.data() + begin_;
+        std::size_t length = newline ? static_cast<std::size_t>(newline - start) : end_ - begin_;
+        last_ = begin_;
+        begin_ += newline ? length + 1 : length;
+        line_++;
+        std::string_view record(start, length);
+        if (!record.empty() && record.back() == '\r') {
+            record.remove_suffix(1);
+        }
+        if (record.empty()) {
+            continue;
+        }
+        if (!delimiter_) {
+            delimiter_ = record.find('\t') != std::string_view::npos ? '\t' : ',';
+        }
+        split_record(record, delimiter_, fields);
+        return true;
+    }
+}
+
+inline void split_record(std::string_view record, char delimiter, std::vector<std::string_view>& fields) {
+    fields.clear();
+    std::size_t from = 0;
+    while (true) {
+        std::size_t to = record.find(delimiter, from);
+        std::string_view field = record.substr(from, to == std::string_view::npos ? to : to - from);
+        while (!field.empty() && field.front() == ' ') {
+            field.remove_prefix(1);
+        }
+        while (!field.empty() && field.back() == ' ') {
+            field.remove_suffix(1);
+        }
+        fields.push_back(field);
+        if (to == std::string_view::npos) {
+            break;
+        }
+        from = to + 1;
+    }
+}
+
+inline bool RecordReader::next_block(std::string_view& block, std::size_t& first_line) {
+    if (end_ < buffer_.size()) {
+        fill();
+    }
+    while (true) {
+        std::size_t stop = end_;
+        while (stop > begin_ && buffer_[stop - 1] != '\n') {
+            stop--;
+        }
+        if (stop == begin_) {
+            if (fill()) {
+                continue;
+            }
+            // Last line without a newline, or nothing left; fill() may
+            // have moved the data to the front.
+            stop = end_;
+            if (stop == begin_) {
+                return false;
+            }
+        }
+        block = std::string_view(buffer_.data() + begin_, stop - begin_);
+        first_line = line_ + 1;
+        line_ += static_cast<std::size_t>(std::count(block.begin(), block.end(), '\n'));
+        if (block.back() != '\n') {
+            line_++;
+        }
+        last_ = begin_;
+        begin_ = stop;
+        return true;
+    }
+}
+
+inline void RecordReader::unread() {
+    begin_ = last_;
+    line_--;
+}
+
+inline std::size_t RecordReader::line() const {
+    return line_;
+}
+
+inline char RecordReader::delimiter() const {
+    return delimiter_;
+}
+
+inline bool is_complex_field(std::string_view field) {
+    return !field.empty() && field.back() == 'i';
+}
+
+// Reads a whole field as a number; a leading '+' is accepted.
+inline bool read_number(std::string_view text, double& value) {
+    if (!text.empty() && text.front() == '+') {
+        text.remove_prefix(1);
+    }
+    auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), value);
+    return error == std::errc() && end == text.data() + text.size();
+}
+
+// a, bi or a+bi / a-bi.
+inline bool read_complex(std::string_view text, std::complex<double>& value) {
+    double re = 0;
+    double im = 0;
+    if (!is_complex_field(text)) {
+        if (!read_number(text, re)) {
+            return false;
+        }
+        value = {re, 0};
+        return true;
+    }
+    text.remove_suffix(1);
+    // The sign between the parts is the last '+' or '-' that does not
+    // start the field or follow an exponent marker.
+    std::size_t split = std::string_view::npos;
+    for (std::size_t i = text.size(); i-- > 1;) {
+        if ((text[i] == '+' || text[i] == '-') && text[i - 1] != 'e' && text[i - 1] != 'E') {
+            split = i;
+            break;
+        }
+    }
+    if (split == std::string_view::npos) {
+        if (text.empty() || text == "+" || text == "-") {
+            im = text == "-" ? -1 : 1;
+        } else if (!read_number(text, im)) {
+            return false;
+        }
+        value = {0, im};
+        return true;
+    }
+    std::string_view imaginary = text.substr(split);
+    if (!read_number(text.substr(0, split), re)) {
+        return false;
+    }
+    if (imaginary == "+" || imaginary == "-") {
+        im = imaginary == "-" ? -1 : 1;
+    } else if (!read_number(imaginary, im)) {
+        return false;
+    }
+    value = {re, im};
+    return true;
+}
+
+template <typename T>
+T read_field(std::string_view field, std::size_t line) {
+    if constexpr (std::is_same_v<T, std::complex<double>>) {
+        std::complex<double> value;
+        if (read_complex(field, value)) {
+            return value;
+        }
+    } else {
+        double value;
+        if (read_number(field, value)) {
+            return static_cast<T>(value);
+        }
+        if (is_complex_field(field)) {
+            throw std::runtime_error("Complex value '" + std::string(field) + "' in a real stream at line " + std::to_string(line));
+        }
+    }
+    throw std::runtime_error("Malformed value '" + std::string(field) + "' at line " + std::to_string(line));
+}
+
+template <typename T>
+char* write_field(char* out, char* end, T value) {
+    if constexpr (std::is_same_v<T, std::complex<double>>) {
+        out = std::to_chars(out, end, value.real()).ptr;
+        // The sign is written here, so a NaN with its sign bit set prints as
+        // "-nan" rather than "+-nan".
+        *out++ = std::signbit(value.imag()) ? '-' : '+';
+        out = std::to_chars(out, end, std::fabs(value.imag())).ptr;
+        *out++ = 'i';
+        return out;
+    } else {
+        return std::to_chars(out, end, value).ptr;
+    }
+}
+
+// Buffers one worker reuses across the segments it processes.
+template <typename T>
+struct StreamWorker {
+    std::vector<T> columns;
+    std::vector<const T*> bound;
+    std::vector<T> results;
+    std::vector<T> scratch;
+    std::vector<std::string_view> fields;
+};
+
+// Room for one formatted value and its newline.
+constexpr std::size_t stream_field_width = 2 * 32 + 4;
+
+template <typename T>
+void flush_rows(const Program<T>& program, StreamWorker<T>& worker, std::size_t rows, std::vector<char>& text) {
+    program.eval_batch(worker.bound, std::span<T>(worker.results.data(), rows), worker.scratch);
+    std::size_t used = text.size();
+    text.resize(used + rows * stream_field_width);
+    char* cursor = text.data() + used;
+    char* end = text.data() + text.size();
+    for (std::size_t row = 0; row < rows; row++) {
+        cursor = write_field(cursor, end, worker.results[row]);
+        *cursor++ = '\n';
+    }
+    text.resize(static_cast<std::size_t>(cursor - text.data()));
+}
+
+// Parses, evaluates and formats the lines of one segment; returns the rows.
+template <typename T>
+std::size_t eval_segment(const Program<T>& program, std::size_t field_count, const std::vector<std::size_t>& fields_of_slot,
+                         char delimiter, std::size_t chunk_rows, std::string_view segment, std::size_t line,
+                         StreamWorker<T>& worker, std::vector<char>& text) {
+    const std::size_t slots = fields_of_slot.size();
+    std::size_t rows = 0;
+    std::size_t total = 0;
+    for (std::size_t from = 0; from < segment.size(); line++) {
+        std::size_t to = segment.find('\n', from);
+        if (to == std::string_view::npos) {
+            to = segment.size();
+        }
+        std::string_view record = segment.substr(from, to - from);
+        from = to + 1;
+        if (!record.empty() && record.back() == '\r') {
+            record.remove_suffix(1);
+        }
+        if (record.empty()) {
+            continue;
+        }
+        split_record(record, delimiter, worker.fields);
+        if (worker.fields.size() != field_count) {
+            throw std::runtime_error("Expected " + std::to_string(field_count) + " fields at line " +
+                                     std::to_string(line) + ", got " + std::to_string(worker.fields.size()));
+        }
+        for (std::size_t slot = 0; slot < slots; slot++) {
+            worker.columns[slot * chunk_rows + rows] = read_field<T>(worker.fields[fields_of_slot[slot]], line);
+        }
+        if (++rows == chunk_rows) {
+            flush_rows(program, worker, rows, text);
+            total += rows;
+            rows = 0;
+        }
+    }
+    if (rows > 0) {
+        flush_rows(program, worker, rows, text);
+        total += rows;
+    }
+    return total;
+}
+
+template <typename T>
+std::size_t eval_stream(const Program<T>& program, const std::vector<std::string>& header,
+                        RecordReader& reader, std::FILE* out, std::size_t chunk_rows, ThreadPool* pool) {
+    const auto& variables = program.variables();
+    std::vector<std::size_t> fields_of_slot;
+    for (const auto& name : variables) {
+        auto it = std::find(header.begin(), header.end(), name);
+        if (it == header.end()) {
+            throw std::runtime_error("Variable not found in header: " + name);
+        }
+        fields_of_slot.push_back(static_cast<std::size_t>(it - header.begin()));
+    }
+
+    std::size_t threads = pool ? pool->size() : 1;
+    std::vector<StreamWorker<T>> workers(threads);
+    for (auto& worker : workers) {
+        worker.columns.resize(variables.size() * chunk_rows);
+        worker.bound.resize(variables.size());
+        for (std::size_t slot = 0; slot < variables.size(); slot++) {
+            worker.bound[slot] = worker.columns.data() + slot * chunk_rows;
+        }
+        worker.results.resize(chunk_rows);
+        worker.scratch.resize(program.batch_scratch_size());
+    }
+    // A few segments per worker, so stealing can even out uneven lines.
+    std::size_t segment_count = threads == 1 ? 1 : threads * 4;
+    std::vector<std::string_view> segments(segment_count);
+    std::vector<std::size_t> first_lines(segment_count);
+    std::vector<std::size_t> rows(segment_count);
+    std::vector<std::vector<char>> texts(segment_count);
+    std::vector<std::exception_ptr> errors(segment_count);
+
+    std::string_view block;
+    std::size_t line = 0;
+    std::size_t total = 0;
+    while (reader.next_block(block, line)) {
+        std::size_t from = 0;
+        for (std::size_t k = 0; k < segment_count; k++) {
+            std::size_t to = block.size() * (k + 1) / segment_count;
+            while (to < block.size() && to > from && block[to - 1] != '\n') {
+                to++;
+            }
+            to = std::max(to, from);
+            segments[k] = block.substr(from, to - from);
+            first_lines[k] = line;
+            line += static_cast<std::size_t>(std::count(segments[k].begin(), segments[k].end(), '\n'));
+            from = to;
+        }
+        auto run = [&](std::size_t begin, std::size_t end, std::size_t worker) {
+            for (std::size_t k = begin; k < end; k++) {
+                texts[k].clear();
+                errors[k] = nullptr;
+                try {
+                    rows[k] = eval_segment(program, header.size(), fields_of_slot, reader.delimiter(), chunk_rows,
+                                           segments[k], first_lines[k], workers[worker], texts[k]);
+                } catch (...) {
+                    errors[k] = std::current_exception();
+                }
+            }
+        };
+        if (pool) {
+            pool->parallel_for(segment_count, 1, run);
+        } else {
+            run(0, 1, 0);
+        }
+        for (std::size_t k = 0; k < segment_count; k++) {
+            if (errors[k]) {
+                std::rethrow_exception(errors[k]);
+            }
+            if (!texts[k].empty() && std::fwrite(texts[k].data(), 1, texts[k].size(), out) != texts[k].size()) {
+                throw std::runtime_error("Cannot write results");
+            }
+            total += rows[k];
+        }
+    }
+    return total;
+}
@@ -0,0 +1,67 @@
+#ifndef EXPRESSION_STREAM_H
+#define EXPRESSION_STREAM_H
+
+#include <cstddef>
+#include <cstdio>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "expression.h"
+#include "thread_pool.h"
+
+// Reads delimiter-separated records from a FILE through one fixed buffer,
+// so memory stays flat however long the input is (it only grows to fit the
+// longest line). Fields are views into the buffer and stay valid until the
+// next call to next(). No quoting: fields are plain numbers and names.
+class RecordReader {
+public:
+    explicit RecordReader(std::FILE* in, std::size_t buffer_size = 1 << 20);
+
+    // Reads the next non-empty line. The delimiter is taken from the first
+    // line: a tab if it contains one, a comma otherwise.
+    bool next(std::vector<std::string_view>& fields);
+    // Makes the next call to next() return the last record again.
+    void unread();
+    // All complete lines currently buffered (reading more first), as one
+    // view valid until the next call; `first_line` is the number of its
+    // first line. The delimiter must already be known from next().
+    bool next_block(std::string_view& block, std::size_t& first_line);
+    // 1-based number of the line returned by the last next().
+    std::size_t line() const;
+    char delimiter() const;
+
+private:
+    bool fill();
+    std::FILE* in_;
+    std::vector<char> buffer_;
+    std::size_t begin_ = 0;
+    std::size_t end_ = 0;
+    std::size_t last_ = 0;
+    std::size_t line_ = 0;
+    char delimiter_ = 0;
+    bool eof_ = false;
+};
+
+// Splits a record at `delimiter`, trimming spaces around each field.
+void split_record(std::string_view record, char delimiter, std::vector<std::string_view>& fields);
+
+// Evaluates `program` for every record of `reader` and writes one result
+// per line to `out`. `header` names the fields of each record; every
+// variable of the program must be among them, other fields are ignored.
+// Input is taken a buffer at a time; with a pool, each buffer is cut into
+// line-aligned segments that are parsed, evaluated in columnar chunks of
+// `chunk_rows` and formatted on the workers, then written in input order,
+// so the output does not depend on the number of threads. Real values are written in shortest round-trip form,
+// complex ones as a+bi (the form they are read in, along with a and bi).
+// Throws std::runtime_error naming the line of a malformed record.
+// Returns the number of rows evaluated.
+template <typename T>
+std::size_t eval_stream(const Program<T>& program, const std::vector<std::string>& header,
+                        RecordReader& reader, std::FILE* out, std::size_t chunk_rows = 4096,
+                        ThreadPool* pool = nullptr);
+
+// True if the field is written as a complex number (ends in `i`).
+bool is_complex_field(std::string_view field);
+
+#endif //EXPRESSION_STREAM_H
@@ -0,0 +1,153 @@
+#include "thread_pool.h"
+
+#include <algorithm>
+
+ThreadPool::ThreadPool(std::size_t threads) {
+    if (threads == 0) {
+        threads = std::max<std::size_t>(1, std::thread::hardware_concurrency());
+    }
+    size_ = threads;
+    queues_.reset(new Queue[size_]);
+    for (std::size_t worker = 1; worker < size_; worker++) {
+        threads_.emplace_back([this, worker] { loop(worker); });
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    start_.notify_all();
+    for (auto& thread : threads_) {
+        thread.join();
+    }
+}
+
+std::size_t ThreadPool::size() const {
+    return size_;
+}
+
+void ThreadPool::loop(std::size_t worker) {
+    std::size_t seen = 0;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            start_.wait(lock, [&] { return stop_ || generation_ != seen; });
+            if (stop_) {
+                return;
+            }
+            seen = generation_;
+        }
+        work(worker);
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (--active_ == 0) {
+            done_.notify_one();
+        }
+    }
+}
+
+bool ThreadPool::take(std::size_t worker, std::size_t& begin, std::size_t& end) {
+    Queue& queue = queues_[worker];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (queue.begin == queue.end) {
+        return false;
+    }
+    begin = queue.begin;
+    end = std::min(queue.end, begin + grain_);
+    queue.begin = end;
+    return true;
+}
+
+// Moves the back half of the fullest other queue into the worker's own.
+bool ThreadPool::steal(std::size_t worker) {
+    while (true) {
+        std::size_t victim = size_;
+        std::size_t largest = 0;
+        for (std::size_t i = 1; i < size_; i++) {
+            std::size_t other = (worker + i) % size_;
+            std::lock_guard<std::mutex> lock(queues_[other].mutex);
+            std::size_t left = queues_[other].end - queues_[other].begin;
+            if (left > largest) {
+                largest = left;
+                victim = other;
+            }
+        }
+        if (victim == size_) {
+            return false;
+        }
+        std::size_t begin;
+        std::size_t end;
+        {
+            std::lock_guard<std::mutex> lock(queues_[victim].mutex);
+            std::size_t left = queues_[victim].end - queues_[victim].begin;
+            if (left == 0) {
+                continue;
+            }
+            // The split stays on a multiple of the grain, so the pieces are
+            // the same however the range ends up divided.
+            std::size_t pieces = (left + grain_ - 1) / grain_;
+            end = queues_[victim].end;
+            begin = queues_[victim].begin + (pieces == 1 ? 0 : grain_ * (pieces - pieces / 2));
+            queues_[victim].end = begin;
+        }
+        std::lock_guard<std::mutex> lock(queues_[worker].mutex);
+        queues_[worker].begin = begin;
+        queues_[worker].end = end;
+        return true;
+    }
+}
+
+void ThreadPool::work(std::size_t worker) {
+    std::size_t begin;
+    std::size_t end;
+    while (true) {
+        if (failed_.load(std::memory_order_relaxed)) {
+            return;
+        }
+        if (!take(worker, begin, end) && !(steal(worker) && take(worker, begin, end))) {
+            return;
+        }
+        try {
+            (*body_)(begin, end, worker);
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!failed_.exchange(true)) {
+                error_ = std::current_exception();
+            }
+            return;
+        }
+    }
+}
+
+void ThreadPool::parallel_for(std::size_t count, std::size_t grain,
+                              const std::function<void(std::size_t, std::size_t, std::size_t)>& body) {
+    if (count == 0) {
+        return;
+    }
+    std::lock_guard<std::mutex> call(call_);
+    grain_ = std::max<std::size_t>(1, grain);
+    body_ = &body;
+    failed_ = false;
+    error_ = nullptr;
+    // Shares are whole numbers of grains; only the last one ends at `count`.
+    std::size_t pieces = (count + grain_ - 1) / grain_;
+    for (std::size_t worker = 0; worker < size_; worker++) {
+        queues_[worker].begin = std::min(count, grain_ * (pieces * worker / size_));
+        queues_[worker].end = std::min(count, grain_ * (pieces * (worker + 1) / size_));
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        active_ = size_ - 1;
+        generation_++;
+    }
+    start_.notify_all();
+    work(0);
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        done_.wait(lock, [&] { return active_ == 0; });
+    }
+    if (error_) {
+        std::rethrow_exception(error_);
+    }
+}
@@ -0,0 +1,68 @@
+#ifndef EXPRESSION_THREAD_POOL_H
+#define EXPRESSION_THREAD_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads running index ranges with work stealing.
+// Each worker starts on its own contiguous share of the range and takes
+// `grain`-sized pieces from the front of it; a worker that runs dry takes
+// the back half of the largest share left in another worker's queue. Shares
+// and stolen halves start on multiples of `grain`, so every piece is
+// [k * grain, min((k + 1) * grain, count)) whatever the number of threads.
+// The calling thread takes part as worker 0.
+class ThreadPool {
+public:
+    // `threads` counts the calling thread; 0 means one per hardware thread.
+    explicit ThreadPool(std::size_t threads = 0);
+    ~ThreadPool();
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    std::size_t size() const;
+
+    // Calls body(begin, end, worker) on disjoint pieces covering [0, count),
+    // each at most `grain` long, with worker < size(). Returns when all
+    // pieces are done; the first exception thrown by body is rethrown after
+    // the remaining pieces are abandoned. One call runs at a time.
+    void parallel_for(std::size_t count, std::size_t grain,
+                      const std::function<void(std::size_t, std::size_t, std::size_t)>& body);
+
+private:
+    struct alignas(64) Queue {
+        std::mutex mutex;
+        std::size_t begin = 0;
+        std::size_t end = 0;
+    };
+
+    void work(std::size_t worker);
+    bool take(std::size_t worker, std::size_t& begin, std::size_t& end);
+    bool steal(std::size_t worker);
+    void loop(std::size_t worker);
+
+    std::vector<std::thread> threads_;
+    std::unique_ptr<Queue[]> queues_;
+    std::size_t size_;
+
+    std::mutex call_;
+    std::mutex mutex_;
+    std::condition_variable start_;
+    std::condition_variable done_;
+    std::size_t generation_ = 0;
+    std::size_t active_ = 0;
+    bool stop_ = false;
+
+    const std::function<void(std::size_t, std::size_t, std::size_t)>* body_ = nullptr;
+    std::size_t grain_ = 1;
+    std::atomic<bool> failed_{false};
+    std::exception_ptr error_;
+};
+
+#endif //EXPRESSION_THREAD_POOL_H
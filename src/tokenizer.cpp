@@ -0,0 +1,119 @@
+#include "tokenizer.h"
+#include "profile.h"
+
+#include <cctype>
+#include <map>
+#include <stdexcept>
+
+// Not timed here: callers put the tokenization of the formula under the
+// Tokenize phase, and --eval also tokenizes its variable assignments.
+inline std::vector<Token> tokenizer(std::string input, bool is_eqaul_expected) {
+    std::vector<Token> result;
+    result.push_back({LEFT_BRACKET, "("});
+    for (size_t i = 0; i < input.size(); i++) {
+        if (input[i] == ' ') {
+            continue;
+        }
+        if (input[i] == '+' || input[i] == '-' || input[i] == '*' || input[i] == '/' || input[i] == '^') {
+            result.push_back({OPERATION,std::string(1,input[i])});
+            continue;
+        }
+        if (isdigit(input[i]) || input[i] == '.') {
+            std::string number = "";
+            while (i < input.size() && (isdigit(input[i]) || input[i] == '.' || input[i] == 'i')) {
+                number += input[i];
+                i++;
+            }
+            i--;
+            if (input[i] == 'i') {
+                result.push_back({COMPLEX_NUMBER,number});
+            } else {
+                result.push_back({NUMBER,number});
+            }
+            continue;
+        }
+        if (input[i] == '(') {
+            result.push_back({LEFT_BRACKET, "("});
+            continue;
+        }
+        if (input[i] == ')') {
+            result.push_back({RIGHT_BRACKET, ")"});
+            continue;
+        }
+        if (isalpha(input[i])) {
+            std::string lambda;
+            while (i < input.size() && isalpha(input[i])) {
+                lambda += input[i];
+                ++i;
+            }
+            i--;
+            if (lambda == "sin" || lambda == "cos" || lambda == "exp" || lambda == "ln") {
+                result.push_back({FUNCTION, lambda});
+            } else {
+                result.push_back({VARIABLE, lambda});
+            }
+            continue;
+        }
+        if (input[i] == '=') {
+            if (is_eqaul_expected) {
+                result.push_back({EQUAL, "="});
+                continue;
+            }
+            throw std::runtime_error("Equal sign is not accepted");
+        }
+        throw std::runtime_error("Unknown symbole: " + input[i]);
+    }
+    result.push_back({RIGHT_BRACKET, ")"});
+    return result;
+}
+
+inline std::vector<Token> polish_order(std::vector<Token> input) {
+    EXPRESSION_PROFILE_PHASE(ShuntingYard);
+    std::map<std::string,int> priority = {
+        {"(", 0},
+        {"+", 1},
+        {"-", 1},
+        {"*", 2},
+        {"/", 2},
+        {"^", 3}, 
+        {"sin", 4},
+        {"cos", 4},
+        {"exp", 4},
+        {"ln", 4}
+    };
+    std::vector<Token> stack;
+    std::vector<Token> result;
+    for (size_t i = 0; i < input.size(); i++) {
+        auto c = input[i];
+        if (c.ttype == NUMBER || c.ttype == COMPLEX_NUMBER || c.ttype == VARIABLE) {
+            result.push_back(c);
+        }
+        if (c.ttype == LEFT_BRACKET) {
+            stack.push_back(c);
+        }
+        if (c.ttype == OPERATION || c.ttype == FUNCTION) {
+            while (stack.size() > 0) {
+                size_t temp = stack.size() - 1;
+                if (priority[stack[temp].value] > priority[c.value]) {
+                    result.push_back(stack[temp]);
+                    stack.pop_back();
+                } else {
+                    break;
+                }
+            }
+            stack.push_back(c);
+        }
+        if (c.ttype == RIGHT_BRACKET) {
+            while (stack.size() > 0) {
+                size_t temp = stack.size() - 1;
+                if (stack[temp].ttype == LEFT_BRACKET) {
+                    stack.pop_back();
+                    break;
+                }
+                result.push_back(stack[temp]);
+                stack.pop_back();
+            }
+        }
+    }
+    return result;
+}
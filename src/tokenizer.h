@@ -0,0 +1,28 @@
+#ifndef EXPRESSION_TOKENIZER_H
+#define EXPRESSION_TOKENIZER_H
+
+#include <string>
+#include <vector>
+
+enum TokenType {
+    NUMBER,
+    COMPLEX_NUMBER,
+    VARIABLE,
+    OPERATION,
+    FUNCTION,
+    LEFT_BRACKET,
+    RIGHT_BRACKET,
+    EQUAL
+};
+
+struct Token {
+    TokenType ttype;
+    std::string value;
+};
+
+// Splits the input into tokens, wrapped in an outer pair of brackets.
+std::vector<Token> tokenizer(std::string input, bool is_eqaul_expected);
+// Reorders tokens into reverse Polish notation.
+std::vector<Token> polish_order(std::vector<Token> input);
+
+#endif //EXPRESSION_TOKENIZER_H
@@ -0,0 +1,331 @@
+//
+// Benchmarks for the hot paths of the library on generated workloads.
+// Writes one JSON document with a record per (operation, workload, size):
+// mean ns/op, heap allocations/op and the process peak RSS after the case.
+// Cases run from small to large, so the peak RSS grows with the largest
+// workload seen so far.
+//
+// Usage: bench_expression [out.json] [filter]
+//   out.json  output file, standard output when omitted or "-"
+//   filter    run only cases whose "operation/workload" contains it
+//
+#include <atomic>
+#include <chrono>
+#include <complex>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <new>
+#include <string>
+#include <vector>
+
+#include <sys/resource.h>
+
+#include "../src/expression.h"
+#include "../src/expression.cpp"
+#include "../src/parser.h"
+#include "../src/parser.cpp"
+#include "../src/tokenizer.h"
+#include "../src/tokenizer.cpp"
+
+// Every global allocation goes through here, so allocations/op counts the
+// library's shared_ptr nodes, strings, maps and vectors alike. All the
+// replaceable forms are defined as one set; allocate() and release() stay
+// out of line, or GCC pairs the inlined free() with operator new and warns.
+static std::atomic<std::size_t> allocations{0};
+
+[[gnu::noinline]] static void* allocate(std::size_t size, std::size_t alignment) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    size = size ? size : 1;
+    void* p = alignment <= __STDCPP_DEFAULT_NEW_ALIGNMENT__
+        ? std::malloc(size)
+        : std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment);
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+[[gnu::noinline]] static void release(void* p) noexcept {
+    std::free(p);
+}
+
+void* operator new(std::size_t size) {
+    return allocate(size, __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+}
+
+void* operator new[](std::size_t size) {
+    return allocate(size, __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment) {
+    return allocate(size, static_cast<std::size_t>(alignment));
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment) {
+    return allocate(size, static_cast<std::size_t>(alignment));
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept {
+    try {
+        return allocate(size, __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+    } catch (const std::bad_alloc&) {
+        return nullptr;
+    }
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept {
+    return operator new(size, std::nothrow);
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    try {
+        return allocate(size, static_cast<std::size_t>(alignment));
+    } catch (const std::bad_alloc&) {
+        return nullptr;
+    }
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    return operator new(size, alignment, std::nothrow);
+}
+
+void operator delete(void* p) noexcept { release(p); }
+void operator delete[](void* p) noexcept { release(p); }
+void operator delete(void* p, std::size_t) noexcept { release(p); }
+void operator delete[](void* p, std::size_t) noexcept { release(p); }
+void operator delete(void* p, std::align_val_t) noexcept { release(p); }
+void operator delete[](void* p, std::align_val_t) noexcept { release(p); }
+void operator delete(void* p, std::size_t, std::align_val_t) noexcept { release(p); }
+void operator delete[](void* p, std::size_t, std::align_val_t) noexcept { release(p); }
+void operator delete(void* p, const std::nothrow_t&) noexcept { release(p); }
+void operator delete[](void* p, const std::nothrow_t&) noexcept { release(p); }
+void operator delete(void* p, std::align_val_t, const std::nothrow_t&) noexcept { release(p); }
+void operator delete[](void* p, std::align_val_t, const std::nothrow_t&) noexcept { release(p); }
+
+struct Result {
+    std::string operation;
+    std::string workload;
+    std::string type;
+    std::size_t size;
+    std::size_t iterations;
+    double ns_per_op;
+    double allocs_per_op;
+    long peak_rss_kb;
+};
+
+long peak_rss_kb() {
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+// Keeps a result alive so the optimizer cannot drop the work producing it.
+template <typename V>
+void keep(V&& value) {
+    asm volatile("" : : "g"(&value) : "memory");
+}
+
+// Repeats `body` until at least `min_time` has passed (and at least 3 times).
+Result measure(const std::function<void()>& body) {
+    using clock = std::chrono::steady_clock;
+    const auto min_time = std::chrono::milliseconds(100);
+    body();
+    std::size_t iterations = 0;
+    std::size_t allocated = allocations.load();
+    auto start = clock::now();
+    auto elapsed = clock::duration::zero();
+    while (iterations < 3 || elapsed < min_time) {
+        body();
+        iterations++;
+        elapsed = clock::now() - start;
+    }
+    Result result{};
+    result.iterations = iterations;
+    result.ns_per_op = std::chrono::duration<double, std::nano>(elapsed).count() / iterations;
+    result.allocs_per_op = double(allocations.load() - allocated) / iterations;
+    result.peak_rss_kb = peak_rss_kb();
+    return result;
+}
+
+// Generated formulas, all in the command-line grammar.
+
+// x*(x+(x*(x+ ... ))) nested `size` levels deep.
+std::string deep_chain(std::size_t size) {
+    std::string s;
+    for (std::size_t i = 0; i < size; i++) {
+        s += i % 2 == 0 ? "x*(" : "x+(";
+    }
+    s += "y";
+    s.append(size, ')');
+    return s;
+}
+
+// 1.5*x + sin(2.5*v1) + ... over x and v1..v15.
+std::string wide_sum(std::size_t size) {
+    std::string s;
+    for (std::size_t i = 0; i < size; i++) {
+        if (i > 0) {
+            s += "+";
+        }
+        std::string variable = i % 16 == 0 ? "x" : "v" + std::to_string(i % 16);
+        std::string term = std::to_string(i + 1) + ".5*" + variable;
+        s += i % 2 == 0 ? term : "sin(" + term + ")";
+    }
+    return s;
+}
+
+// sin(exp(cos(ln( ... x ... )))) with a constant offset at every level.
+std::string nested_transcendental(std::size_t size) {
+    static const char* functions[] = {"sin", "exp", "cos", "ln"};
+    std::string s;
+    for (std::size_t i = 0; i < size; i++) {
+        s += std::string(functions[i % 4]) + "(2+";
+    }
+    s += "x";
+    s.append(size, ')');
+    return s;
+}
+
+template <typename T>
+std::map<std::string, T> workload_context() {
+    std::map<std::string, T> context = {{"x", T(0.3)}, {"y", T(0.7)}};
+    for (int i = 0; i < 16; i++) {
+        context["v" + std::to_string(i)] = T(0.1 * (i + 1));
+    }
+    return context;
+}
+
+struct Workload {
+    std::string name;
+    std::function<std::string(std::size_t)> generate;
+    std::vector<std::size_t> sizes;
+};
+
+class Bench {
+public:
+    explicit Bench(std::string filter) : filter_(std::move(filter)) {}
+
+    void run(const std::string& operation, const std::string& workload, const std::string& type,
+             std::size_t size, const std::function<void()>& body) {
+        std::string name = operation + "/" + workload;
+        if (name.find(filter_) == std::string::npos) {
+            return;
+        }
+        Result result = measure(body);
+        result.operation = operation;
+        result.workload = workload;
+        result.type = type;
+        result.size = size;
+        std::cerr << name << " " << type << " " << size << ": " << result.ns_per_op << " ns/op, "
+                  << result.allocs_per_op << " allocs/op" << std::endl;
+        results_.push_back(result);
+    }
+
+    void write(std::FILE* out) const {
+        std::fprintf(out, "{\n  \"compiler\": \"%s\",\n  \"benchmarks\": [\n", __VERSION__);
+        for (std::size_t i = 0; i < results_.size(); i++) {
+            const Result& r = results_[i];
+            std::fprintf(out,
+                         "    {\"operation\": \"%s\", \"workload\": \"%s\", \"type\": \"%s\", \"size\": %zu, "
+                         "\"iterations\": %zu, \"ns_per_op\": %.1f, \"allocs_per_op\": %.1f, "
+                         "\"peak_rss_kb\": %ld}%s\n",
+                         r.operation.c_str(), r.workload.c_str(), r.type.c_str(), r.size, r.iterations,
+                         r.ns_per_op, r.allocs_per_op, r.peak_rss_kb, i + 1 < results_.size() ? "," : "");
+        }
+        std::fprintf(out, "  ]\n}\n");
+    }
+
+private:
+    std::string filter_;
+    std::vector<Result> results_;
+};
+
+// Rows per eval_batch case; its ns/op is per whole batch.
+constexpr std::size_t batch_rows = 4096;
+
+// parse, eval, eval_batch, diff, substitute, to_string and write over one
+// formula.
+template <typename T>
+void bench_formula(Bench& bench, const std::string& workload, const std::string& type, std::size_t size,
+                   const std::string& formula) {
+    EvalContext<T> context = workload_context<T>();
+    Expression<T> f = parse<T>(formula);
+    bench.run("parse", workload, type, size, [&] { keep(parse<T>(formula)); });
+    bench.run("eval", workload, type, size, [&] { keep(f.eval(context)); });
+
+    // Every column drifts away from the workload's point row by row.
+    Program<T> program = f.compile();
+    auto point = workload_context<T>();
+    std::vector<std::vector<T>> data;
+    std::vector<const T*> columns;
+    for (const auto& name : program.variables()) {
+        data.emplace_back(batch_rows);
+        for (std::size_t row = 0; row < batch_rows; row++) {
+            data.back()[row] = point[name] * T(1.0 + 1e-4 * static_cast<double>(row));
+        }
+        columns.push_back(data.back().data());
+    }
+    std::vector<T> out(batch_rows);
+    std::vector<T> scratch(program.batch_scratch_size());
+    bench.run("eval_batch", workload, type, size, [&] {
+        program.eval_batch(columns, out, scratch);
+        keep(out);
+    });
+    bench.run("diff", workload, type, size, [&] { keep(f.diff("x")); });
+    bench.run("substitute", workload, type, size, [&] { keep(f.substitute({{"y", T(0.7)}, {"v3", T(0.4)}})); });
+    bench.run("to_string", workload, type, size, [&] { keep(f.to_string()); });
+    bench.run("write", workload, type, size, [&] { keep(f.to_string(WriteOptions{})); });
+}
+
+int main(int argc, char* argv[]) {
+    std::string path = argc > 1 ? argv[1] : "-";
+    Bench bench(argc > 2 ? argv[2] : "");
+
+    std::vector<Workload> workloads = {
+        {"deep_chain", deep_chain, {100, 1000, 4000}},
+        {"wide_sum", wide_sum, {100, 1000, 10000}},
+        {"nested_transcendental", nested_transcendental, {10, 100, 1000}},
+    };
+    for (const auto& workload : workloads) {
+        for (std::size_t size : workload.sizes) {
+            std::string formula = workload.generate(size);
+            bench.run("tokenizer", workload.name, "text", size, [&] { keep(tokenizer(formula, false)); });
+            auto tokens = tokenizer(formula, false);
+            bench.run("polish_order", workload.name, "text", size, [&] { keep(polish_order(tokens)); });
+            bench_formula<double>(bench, workload.name, "double", size, formula);
+        }
+    }
+    // Complex numbers on the same shapes.
+    for (std::size_t size : {100, 1000}) {
+        bench_formula<std::complex<double>>(bench, "wide_sum", "complex", size, wide_sum(size));
+        bench_formula<std::complex<double>>(bench, "nested_transcendental", "complex", size,
+                                            nested_transcendental(size));
+    }
+    // d^k/dx^k of sin(x)*exp(x)/(1+x^2): each order differentiates the
+    // previous, larger result.
+    Expression<double> x("x");
+    Expression<double> high = sin(x) * exp(x) / (Expression<double>(1.0) + (x ^ Expression<double>(2.0)));
+    for (std::size_t order = 1; order <= 6; order++) {
+        Expression<double> previous = high;
+        bench.run("diff", "high_order", "double", order, [&] { keep(previous.diff("x")); });
+        high = high.diff("x");
+        EvalContext<double> context = workload_context<double>();
+        bench.run("eval", "high_order", "double", order, [&] { keep(high.eval(context)); });
+        bench.run("to_string", "high_order", "double", order, [&] { keep(high.to_string()); });
+        bench.run("write", "high_order", "double", order, [&] { keep(high.to_string(WriteOptions{})); });
+    }
+
+    std::FILE* out = path == "-" ? stdout : std::fopen(path.c_str(), "w");
+    if (!out) {
+        std::cerr << "Cannot open " << path << std::endl;
+        return 1;
+    }
+    bench.write(out);
+    if (out != stdout) {
+        std::fclose(out);
+    }
+    return 0;
+}
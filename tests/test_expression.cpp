@@ -5,7 +5,24 @@
 #include "../src/expression.h"
 #include <complex>
 #include "../src/expression.cpp"
+#include "../src/arena.h"
+#include "../src/static_expression.h"
+#include "../src/parser.h"
+#include "../src/parser.cpp"
+#include "../src/stream.h"
+#include "../src/stream.cpp"
+#include "../src/mapped.h"
+#include "../src/mapped.cpp"
+#include "../src/serialize.h"
+#include "../src/serialize.cpp"
+#include "../src/incremental.h"
+#include "../src/incremental.cpp"
 #include <cassert>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <atomic>
+#include <thread>
 
 void test_value() {
     Expression<double> a(123.0);
@@ -50,11 +67,77 @@ void test_diff() {
     std::cout << "test_diff: OK" << std::endl;
 }
 
+void test_eval_context() {
+    // Names may be bound before any expression uses them.
+    EvalContext<double> context;
+    context.set("ctx_b", 2.0);
+    Expression<double> a("ctx_a");
+    Expression<double> b("ctx_b");
+    Expression<double> f = a * sin(b) + b;
+    bool thrown = false;
+    try {
+        f.eval(context);
+    } catch (const std::runtime_error&) {
+        thrown = true;
+    }
+    assert(thrown);
+
+    std::uint32_t id = variable_id<double>("ctx_a");
+    assert(id != no_variable && variable_name<double>(id) == "ctx_a");
+    context.set(id, 3.0);
+    assert(*context.find("ctx_a") == 3.0 && context.find("ctx_missing") == nullptr);
+    assert(f.eval(context) == 3.0 * std::sin(2.0) + 2.0);
+    assert(f.eval(context) == f.eval({{"ctx_a", 3.0}, {"ctx_b", 2.0}}));
+
+    // Only the bound variables are substituted; the rest of the context is
+    // reused as is.
+    EvalContext<double> partial;
+    partial.set("ctx_b", 2.0);
+    Expression<double> g = f.substitute(partial);
+    assert(g.depends_on("ctx_a") && !g.depends_on("ctx_b"));
+    assert(std::abs(g.eval(context) - f.eval(context)) < 1e-12);
+    std::cout << "test_eval_context: OK" << std::endl;
+}
+
 void test_substitute() {
     Expression<int> x("x");
     auto y = ln(x).diff("x");
-    auto check = Expression<int>(1) / Expression<int>(123);
+    // 1/x with x bound folds to the constant 1/123, in integer arithmetic.
+    auto check = Expression<int>(1 / 123);
     assert(y.substitute({{"x", 123}}).to_string() == check.to_string());
+
+    // Subtrees without substituted variables are returned as they are.
+    Expression<double> p("p");
+    Expression<double> u("u");
+    Expression<double> v("v");
+    Expression<double> tail = ln(v) * v;
+    Expression<double> f = sin(u) * p + tail;
+    assert(f.substitute({{"w", 1.0}}).node() == f.node());
+    Expression<double> bound = f.substitute({{"p", 2.0}});
+    assert(bound.node()->child(1) == tail.node());
+    assert(bound.node()->child(0)->child(0) == sin(u).node());
+
+    // Binding one parameter of a wide model rebuilds only its path.
+    Expression<double> model(0.0);
+    std::map<std::string, double> weights = {{"u", 0.5}};
+    for (int i = 0; i < 1000; i++) {
+        model = model + Expression<double>("w" + std::to_string(i)) * sin(u);
+        weights["w" + std::to_string(i)] = 0.001 * i;
+    }
+    std::size_t before = interned_nodes<double>();
+    Expression<double> specialized = model.substitute({{"w999", 3.0}});
+    assert(interned_nodes<double>() - before <= 3);
+    double expected = specialized.eval(weights);
+    weights["w999"] = 3.0;
+    assert(expected == model.eval(weights));
+
+    // Subtrees left without variables fold into one Value, including
+    // constant parts that were never substituted.
+    Expression<double> c = Expression<double>(2.0) * Expression<double>(3.0) * u + v;
+    assert(c.substitute({{"u", 1.0}, {"v", 2.0}}).to_string() == "8.000000");
+    assert(c.substitute({{"u", 1.0}}).to_string() == "(6.000000+v)");
+    Expression<int> a("a");
+    assert((Expression<int>(1) / Expression<int>(0) + a).substitute({{"a", 1}}).to_string() == "((1/0)+1)");
     std::cout << "test_substitute: OK" << std::endl;
 }
 
@@ -67,6 +150,971 @@ void test_complex() {
     std::cout << "test_complex: OK" << std::endl;
 }
 
+void test_compile() {
+    Expression<double> x("x");
+    Expression<double> y("y");
+    Expression<double> shared = sin(x * y);
+    Expression<double> f = (shared + shared) * exp(x) - ln(y) / (x ^ Expression<double>(2.0)) + cos(y);
+    auto program = f.compile();
+    std::map<std::string, double> context = {{"x", 0.7}, {"y", 1.3}};
+    assert(program.eval(program.bind(context)) == f.eval(context));
+    assert(program.variables().size() == 2);
+    assert(program.registers() < program.code().size());
+
+    Expression<int> a("a");
+    Expression<int> b(2);
+    Expression<int> g = ((a*b) ^ a) + (b/b) - a;
+    auto int_program = g.compile();
+    std::vector<int> values = {3};
+    assert(int_program.eval(values) == g.eval({{"a", 3}}));
+
+    using Complex = std::complex<double>;
+    Expression<Complex> z("z");
+    Expression<Complex> h = exp(z * Expression<Complex>(Complex(0, 1))) + (z ^ z);
+    auto complex_program = h.compile();
+    std::vector<Complex> complex_values = {Complex(0.5, -0.25)};
+    assert(complex_program.eval(complex_values) == h.eval({{"z", Complex(0.5, -0.25)}}));
+    std::cout << "test_compile: OK" << std::endl;
+}
+
+void test_eval_batch() {
+    Expression<double> x("x");
+    Expression<double> y("y");
+    Expression<double> f = sin(x) * cos(y) + exp(x / Expression<double>(3.0)) - ln(y) + (y ^ x) / (x - y);
+    const std::size_t rows = 1003;
+    std::vector<double> xs(rows), ys(rows), out(rows);
+    for (std::size_t i = 0; i < rows; i++) {
+        xs[i] = -20.0 + 0.04 * static_cast<double>(i);
+        ys[i] = 0.01 + 0.37 * static_cast<double>(i);
+    }
+    ys[7] = -1.0;
+    xs[11] = 1e7;
+    f.eval_batch({{"x", xs}, {"y", ys}}, out);
+    for (std::size_t i = 0; i < rows; i++) {
+        double expected = f.eval({{"x", xs[i]}, {"y", ys[i]}});
+        if (std::isnan(expected)) {
+            assert(std::isnan(out[i]));
+        } else if (std::isinf(expected)) {
+            assert(out[i] == expected);
+        } else {
+            assert(std::abs(out[i] - expected) <= 1e-13 * std::max(1.0, std::abs(expected)));
+        }
+    }
+
+    Expression<int> a("a");
+    Expression<int> g = a * a - Expression<int>(3);
+    std::vector<int> as = {1, 2, 3, 4, 5};
+    std::vector<int> int_out(as.size());
+    g.eval_batch({{"a", as}}, int_out);
+    assert(int_out[4] == 22);
+    std::cout << "test_eval_batch: OK (" << kernels::isa() << ")" << std::endl;
+}
+
+void test_complex_batch() {
+    using C = std::complex<double>;
+    auto close = [](C got, C expected) {
+        double scale = std::max(1.0, std::abs(expected));
+        if (std::isnan(expected.real()) || std::isnan(expected.imag()) || std::isinf(std::abs(expected))) {
+            return std::isnan(got.real()) == std::isnan(expected.real())
+                   && std::isnan(got.imag()) == std::isnan(expected.imag());
+        }
+        return std::abs(got - expected) <= 1e-13 * scale;
+    };
+
+    // Each kernel against std::complex, including lanes that leave the fast
+    // paths: zeros, infinities and huge arguments.
+    const std::size_t n = 1001;
+    std::vector<double> ar(n), ai(n), br(n), bi(n), outr(n), outi(n);
+    for (std::size_t i = 0; i < n; i++) {
+        double t = static_cast<double>(i);
+        ar[i] = std::sin(0.37 * t) * (1.0 + 0.05 * t);
+        ai[i] = std::cos(0.23 * t) * (0.5 + 0.02 * t);
+        br[i] = std::cos(0.11 * t) * 3.0 - 1.0;
+        bi[i] = std::sin(0.29 * t) * 2.0;
+    }
+    ar[3] = 0.0, ai[3] = 0.0;
+    br[4] = 0.0, bi[4] = 0.0;
+    ar[5] = 1e6, ai[5] = 800.0;
+    ar[6] = -1e-320, ai[6] = 0.0;
+    ar[7] = std::numeric_limits<double>::infinity(), ai[7] = 1.0;
+    ai[8] = -0.0, ar[8] = -2.0;
+    using Binary = void (*)(const double*, const double*, const double*, const double*, double*, double*, std::size_t);
+    using Unary = void (*)(const double*, const double*, double*, double*, std::size_t);
+    std::vector<std::pair<Binary, C (*)(C, C)>> binaries = {
+        {kernels::complex_mul, [](C a, C b) { return a * b; }},
+        {kernels::complex_div, [](C a, C b) { return a / b; }},
+        {kernels::complex_pow, [](C a, C b) { return std::pow(a, b); }},
+    };
+    for (auto [kernel, reference] : binaries) {
+        kernel(ar.data(), ai.data(), br.data(), bi.data(), outr.data(), outi.data(), n);
+        for (std::size_t i = 0; i < n; i++) {
+            assert(close(C(outr[i], outi[i]), reference(C(ar[i], ai[i]), C(br[i], bi[i]))));
+        }
+    }
+    std::vector<std::pair<Unary, C (*)(C)>> unaries = {
+        {kernels::complex_sin, [](C a) { return std::sin(a); }},
+        {kernels::complex_cos, [](C a) { return std::cos(a); }},
+        {kernels::complex_exp, [](C a) { return std::exp(a); }},
+        {kernels::complex_log, [](C a) { return std::log(a); }},
+    };
+    for (auto [kernel, reference] : unaries) {
+        kernel(ar.data(), ai.data(), outr.data(), outi.data(), n);
+        for (std::size_t i = 0; i < n; i++) {
+            assert(close(C(outr[i], outi[i]), reference(C(ar[i], ai[i]))));
+        }
+    }
+    // In place, as the batch evaluator reuses registers.
+    std::vector<double> xr = ar, xi = ai;
+    kernels::complex_exp(xr.data(), xi.data(), xr.data(), xi.data(), n);
+    assert(close(C(xr[10], xi[10]), std::exp(C(ar[10], ai[10]))));
+
+    // The batch evaluator against per-row evaluation.
+    Expression<C> z("z");
+    Expression<C> w("w");
+    Expression<C> f = sin(z) * cos(w) + exp(z / Expression<C>(C(3.0, 1.0))) - ln(w) + (w ^ z) / (z - w);
+    std::vector<C> zs(n), ws(n), out(n);
+    for (std::size_t i = 0; i < n; i++) {
+        zs[i] = C(ar[i], ai[i]);
+        ws[i] = C(br[i], bi[i]);
+    }
+    f.eval_batch({{"z", zs}, {"w", ws}}, out);
+    for (std::size_t i = 0; i < n; i++) {
+        assert(close(out[i], f.eval({{"z", zs[i]}, {"w", ws[i]}})));
+    }
+    std::cout << "test_complex_batch: OK" << std::endl;
+}
+
+void test_hash_consing() {
+    Expression<double> x("x");
+    Expression<double> a = sin(x) * exp(x);
+    Expression<double> b = sin(Expression<double>("x")) * exp(Expression<double>("x"));
+    assert(a.node() == b.node());
+
+    Expression<double> d = a;
+    for (int i = 0; i < 12; i++) {
+        d = d.diff("x");
+    }
+    assert(d.node_count() < 2000);
+    // d^n/dx^n e^x sin(x) = 2^(n/2) e^x sin(x + n pi/4)
+    double point = 0.3;
+    double expected = std::pow(2.0, 6.0) * std::exp(point) * std::sin(point + 12 * std::atan(1.0));
+    assert(std::abs(d.eval({{"x", point}}) - expected) < 1e-9 * std::abs(expected));
+    std::cout << "test_hash_consing: OK" << std::endl;
+}
+
+void test_node_dispatch() {
+    static_assert(!std::is_polymorphic_v<Node<double>>);
+    static_assert(sizeof(UnaryOperation<double>) < sizeof(BinaryOperation<double>));
+    Expression<double> x("x");
+    Expression<double> f = ln(cos(x) + Expression<double>(2.0)) ^ x;
+    auto root = f.node();
+    assert(root->opcode() == OpCode::Pow && root->arity() == 2);
+    assert(root->child(0)->opcode() == OpCode::Ln && root->child(0)->arity() == 1);
+    assert(root->child(1)->opcode() == OpCode::Variable && root->child(1)->arity() == 0);
+    auto cosine = root->child(0)->child(0)->child(0);
+    assert(cosine->opcode() == OpCode::Cos && cosine->child(0)->opcode() == OpCode::Variable);
+    bool thrown = false;
+    try {
+        root->child(1)->child(0);
+    } catch (const std::out_of_range&) {
+        thrown = true;
+    }
+    assert(thrown);
+
+    // Every opcode takes its own branch of diff.
+    double point = 0.4;
+    double c = std::cos(point) + 2.0;
+    double expected = std::pow(std::log(c), point)
+                      * (std::log(std::log(c)) + point * -std::sin(point) / (c * std::log(c)));
+    assert(std::abs(f.diff("x").eval({{"x", point}}) - expected) < 1e-12);
+    assert(std::abs(exp(sin(x)).diff("x").eval({{"x", point}}) - std::exp(std::sin(point)) * std::cos(point)) < 1e-12);
+    std::cout << "test_node_dispatch: OK" << std::endl;
+}
+
+void test_simplify() {
+    Expression<double> x("x");
+    Expression<double> y("y");
+    assert((x * Expression<double>(1.0) + Expression<double>(0.0) * y).simplify().to_string() == "x");
+    assert((x - x).simplify().to_string() == Expression<double>(0.0).to_string());
+    assert((sin(y) / sin(y)).simplify().to_string() == Expression<double>(1.0).to_string());
+    assert((x * x).simplify().to_string() == (x ^ Expression<double>(2.0)).to_string());
+    assert((Expression<double>(2.0) * x + x * Expression<double>(3.0)).simplify().to_string()
+           == (Expression<double>(5.0) * x).to_string());
+    assert(((x ^ Expression<double>(3.0)) / x).simplify().to_string() == (x ^ Expression<double>(2.0)).to_string());
+
+    Expression<double> f = sin(x * y) * exp(x) + (x ^ Expression<double>(3.0));
+    auto raw = f.diff("x");
+    auto simplified = f.diff("x", true);
+    assert(simplified.node_count() < raw.node_count());
+    std::map<std::string, double> context = {{"x", 0.4}, {"y", 1.7}};
+    assert(std::abs(simplified.eval(context) - raw.eval(context)) < 1e-12);
+
+    auto folded = f.substitute({{"y", 2.0}, {"x", 1.0}}, true);
+    assert(folded.node_count() == 1);
+    assert(std::abs(folded.eval({}) - f.eval({{"x", 1.0}, {"y", 2.0}})) < 1e-12);
+
+    Expression<int> a("a");
+    assert((Expression<int>(1) / Expression<int>(0) + a).simplify().to_string() == "((1/0)+a)");
+    // ln(exp(z)) leaves the principal strip for complex z.
+    using C = std::complex<double>;
+    Expression<C> z("z");
+    Expression<C> wrapped = ln(exp(z));
+    assert(wrapped.simplify().node_count() == wrapped.node_count());
+    assert(std::abs(wrapped.simplify().eval({{"z", C(0, 4)}}) - wrapped.eval({{"z", C(0, 4)}})) < 1e-12);
+    std::cout << "test_simplify: OK" << std::endl;
+}
+
+void test_gradient() {
+    Expression<double> x("x");
+    Expression<double> y("y");
+    Expression<double> z("z");
+    Expression<double> f = sin(x * y) / exp(z) + ln(y) * (x ^ Expression<double>(3.0)) - cos(z) * (y ^ x);
+    std::map<std::string, double> context = {{"x", 0.8}, {"y", 1.9}, {"z", 0.3}, {"w", 5.0}};
+    auto grad = f.gradient(context);
+    assert(std::abs(grad.value - f.eval(context)) < 1e-12);
+    for (const auto& name : {"x", "y", "z"}) {
+        double expected = f.diff(name).eval(context);
+        assert(std::abs(grad.partials[name] - expected) < 1e-12 * std::max(1.0, std::abs(expected)));
+    }
+    assert(grad.partials["w"] == 0.0);
+    auto cube = (x ^ Expression<double>(3.0)).gradient({{"x", -0.5}});
+    assert(std::abs(cube.partials["x"] - 0.75) < 1e-12);
+
+    using Complex = std::complex<double>;
+    Expression<Complex> u("u");
+    Expression<Complex> v("v");
+    Expression<Complex> g = exp(u * v) + (u ^ v) / sin(v);
+    std::map<std::string, Complex> complex_context = {{"u", Complex(0.4, 0.2)}, {"v", Complex(1.1, -0.5)}};
+    auto complex_grad = g.gradient(complex_context);
+    for (const auto& name : {"u", "v"}) {
+        Complex expected = g.diff(name).eval(complex_context);
+        assert(std::abs(complex_grad.partials[name] - expected) < 1e-12 * std::max(1.0, std::abs(expected)));
+    }
+    std::cout << "test_gradient: OK" << std::endl;
+}
+
+void test_taylor() {
+    Expression<double> x("x");
+    Expression<double> y("y");
+    Expression<double> f = sin(x) * exp(y) + (x ^ Expression<double>(3.0)) / y - ln(x * y) + (y ^ x);
+    std::map<std::string, double> point = {{"x", 0.7}, {"y", 1.4}};
+    std::map<std::string, double> direction = {{"x", 1.0}};
+    auto series = f.derivatives<4>(point, direction);
+    Expression<double> d = f;
+    for (std::size_t k = 0; k <= 4; k++) {
+        double expected = d.eval(point);
+        assert(std::abs(series[k] - expected) < 1e-10 * std::max(1.0, std::abs(expected)));
+        d = d.diff("x");
+    }
+
+    auto mixed = f.derivatives<1>(point, {{"x", 0.6}, {"y", -0.8}});
+    auto grad = f.gradient(point);
+    assert(std::abs(mixed[1] - (0.6 * grad.partials["x"] - 0.8 * grad.partials["y"])) < 1e-12);
+
+    auto cube = (x ^ Expression<double>(3.0)).derivatives<3>({{"x", -2.0}}, {{"x", 1.0}});
+    assert(cube[0] == -8.0 && std::abs(cube[1] - 12.0) < 1e-12 && std::abs(cube[2] + 12.0) < 1e-12 && std::abs(cube[3] - 6.0) < 1e-12);
+
+    using Complex = std::complex<double>;
+    Expression<Complex> z("z");
+    Expression<Complex> g = exp(z) * cos(z);
+    auto complex_series = g.derivatives<2>({{"z", Complex(0.3, 0.4)}}, {{"z", Complex(1, 0)}});
+    Complex expected = g.diff("z").diff("z").eval({{"z", Complex(0.3, 0.4)}});
+    assert(std::abs(complex_series[2] - expected) < 1e-12);
+    std::cout << "test_taylor: OK" << std::endl;
+}
+
+void test_arena() {
+    Expression<double> x("x");
+    Expression<double> expected_sum(0.0);
+    for (int i = 1; i <= 50; i++) {
+        expected_sum = expected_sum + sin(x * Expression<double>(i + 0.5));
+    }
+    Expression<double> derivative(0.0);
+    {
+        Arena arena(Arena::Ownership::UnlockedAllocation);
+        ArenaScope scope(arena);
+        Expression<double> sum(0.0);
+        for (int i = 1; i <= 50; i++) {
+            sum = sum + sin(Expression<double>("y") * Expression<double>(i + 0.5));
+        }
+        derivative = sum.diff("y");
+        assert(arena.allocations() >= 200);
+        assert(arena.blocks() < arena.allocations() / 10);
+    }
+    assert(Arena::current() == nullptr);
+    // The nodes outlive the Arena object; its blocks are released with them.
+    double value = derivative.eval({{"y", 0.25}});
+    assert(std::abs(value - expected_sum.diff("x").eval({{"x", 0.25}})) < 1e-12);
+
+    // An interned node from an UnlockedAllocation arena can be picked up and
+    // dropped on another thread, and keeps the arena's blocks alive while it
+    // lives.
+    std::shared_ptr<Node<double>> pinned;
+    {
+        Arena arena(Arena::Ownership::UnlockedAllocation);
+        ArenaScope scope(arena);
+        Expression<double> c(-731.25);
+        std::thread other([&] { pinned = Expression<double>(-731.25).node(); });
+        other.join();
+        assert(pinned == c.node());
+    }
+    std::thread([&] { pinned.reset(); }).join();
+    std::cout << "test_arena: OK" << std::endl;
+}
+
+void test_hessian() {
+    Expression<double> x("x");
+    Expression<double> y("y");
+    Expression<double> z("z");
+    Expression<double> f = sin(x * y) * exp(z) + (x ^ Expression<double>(3.0)) * y / z + ln(x * z);
+    std::vector<std::string> names = {"x", "y", "z"};
+    std::map<std::string, double> point = {{"x", 0.7}, {"y", 1.3}, {"z", 0.9}};
+
+    DiffCache<double> cache;
+    auto h = f.hessian(names, cache);
+    std::size_t cached = cache.size();
+    for (std::size_t i = 0; i < names.size(); i++) {
+        for (std::size_t j = 0; j < names.size(); j++) {
+            assert(h[i][j].node() == h[j][i].node());
+            double expected = f.diff(names[i]).diff(names[j]).eval(point);
+            assert(std::abs(h[i][j].eval(point) - expected) < 1e-12 * std::max(1.0, std::abs(expected)));
+        }
+    }
+    // Cached and uncached results are the same interned node.
+    assert(f.diff("y", cache).node() == f.diff("y").node());
+    f.hessian(names, cache);
+    assert(cache.size() == cached);
+
+    auto j = jacobian<double>({f, x * y + z}, names, cache, true);
+    assert(j.size() == 2 && j[1].size() == 3);
+    assert(j[1][0].to_string() == "y" && j[1][2].to_string() == "1.000000");
+    assert(std::abs(j[0][2].eval(point) - f.diff("z").eval(point)) < 1e-12);
+    std::cout << "test_hessian: OK" << std::endl;
+}
+
+void test_sparse() {
+    // More variables than fit in the inline word of a dependency set.
+    const std::size_t n = 100;
+    std::vector<std::string> names;
+    std::vector<Expression<double>> vars;
+    std::map<std::string, double> point;
+    for (std::size_t i = 0; i < n; i++) {
+        names.push_back("s" + std::to_string(i));
+        vars.emplace_back(names.back());
+        point[names.back()] = 0.01 * (i + 1);
+    }
+    Expression<double> f(0.0);
+    std::vector<Expression<double>> residuals;
+    for (std::size_t i = 0; i + 1 < n; i++) {
+        f = f + vars[i] * sin(vars[i + 1]);
+        residuals.push_back(vars[i + 1] - vars[i] * vars[i]);
+    }
+    assert(f.depends_on("s99") && !f.depends_on("s100") && !residuals[0].depends_on("s2"));
+    assert(f.diff("unknown").to_string() == "0.000000");
+    assert(residuals[0].diff("s7").to_string() == "0.000000");
+    // A constant numerator or minuend contributes no zero product.
+    Expression<double> two(2.0);
+    assert((two / vars[0]).diff("s0").to_string() == "(((2.000000*1.000000)*-1.000000)/(s0^2.000000))");
+    assert((two - vars[0]).diff("s0").to_string() == "(1.000000*-1.000000)");
+
+    auto h = f.sparse_hessian(names, true);
+    // s_i * sin(s_{i+1}): one off-diagonal pair per term, plus sin'' on the diagonal.
+    assert(h.size() == 2 * (n - 1) + (n - 1));
+    for (std::size_t k = 0; k < h.size(); k++) {
+        if (k > 0) {
+            assert(h[k - 1].row < h[k].row || (h[k - 1].row == h[k].row && h[k - 1].col < h[k].col));
+        }
+        double expected = f.diff(names[h[k].row]).diff(names[h[k].col]).eval(point);
+        assert(std::abs(h[k].value.eval(point) - expected) < 1e-12);
+    }
+
+    auto j = sparse_jacobian(residuals, names, true);
+    assert(j.size() == 2 * (n - 1));
+    assert(j[0].row == 0 && j[0].col == 0 && j[1].col == 1 && j[1].value.to_string() == "1.000000");
+
+    // x^3 no longer picks up an x^3 * ln(x) * 0 term.
+    Expression<double> x("x");
+    assert(std::isfinite((x ^ Expression<double>(3.0)).diff("x").eval({{"x", -2.0}})));
+    std::cout << "test_sparse: OK" << std::endl;
+}
+
+void test_native() {
+    std::string dir = "tests/native_cache";
+    std::filesystem::remove_all(dir);
+    NativeOptions options;
+    options.cache_dir = dir;
+
+    Expression<double> x("x");
+    Expression<double> y("y");
+    Expression<double> f = sin(x * y) + exp(x) / (y ^ Expression<double>(2.5)) - ln(y) * cos(x) + Expression<double>(0.1);
+    Program<double> program = f.compile();
+    NativeProgram<double> native = program.compile_native(options);
+    assert(!native.library().cached());
+    assert(native.variables() == program.variables());
+    std::vector<double> values(program.variables().size());
+    values[program.slot("x")] = 0.3;
+    values[program.slot("y")] = 1.7;
+    assert(native.eval(values) == program.eval(values));
+
+    std::vector<double> xs, ys;
+    for (int i = 0; i < 100; i++) {
+        xs.push_back(0.01 * i);
+        ys.push_back(1.0 + 0.02 * i);
+    }
+    auto columns = program.bind_columns({{"x", xs}, {"y", ys}}, xs.size());
+    std::vector<double> out(xs.size());
+    native.eval_batch(columns, out);
+    for (std::size_t i = 0; i < xs.size(); i++) {
+        assert(out[i] == f.eval({{"x", xs[i]}, {"y", ys[i]}}));
+    }
+    // A structurally identical expression is served from the disk cache.
+    Expression<double> g = sin(x * y) + exp(x) / (y ^ Expression<double>(2.5)) - ln(y) * cos(x) + Expression<double>(0.1);
+    assert(g.compile_native(options).library().cached());
+    // An object whose recorded input differs is not loaded.
+    std::filesystem::path object = native.library().path();
+    std::filesystem::path recorded = object;
+    recorded.replace_extension(".key");
+    std::string input;
+    {
+        std::ifstream in(recorded);
+        std::getline(in, input, '\0');
+    }
+    std::ofstream(recorded) << "other source with the same hash";
+    NativeProgram<double> rebuilt = g.compile().compile_native(options);
+    assert(!rebuilt.library().cached());
+    assert(rebuilt.eval(values) == program.eval(values));
+    std::ofstream(recorded) << input;
+    assert(g.compile_native(options).library().cached());
+
+    using Complex = std::complex<double>;
+    Expression<Complex> z("z");
+    Expression<Complex> h = exp(z) * Expression<Complex>(Complex(0.5, -2.0)) + (z ^ Expression<Complex>(Complex(1.5, 0.25)));
+    auto complex_native = h.compile_native(options);
+    std::vector<Complex> point = {Complex(0.4, 0.9)};
+    assert(complex_native.eval(point) == h.compile().eval(point));
+    std::filesystem::remove_all(dir);
+    std::cout << "test_native: OK" << std::endl;
+}
+
+void test_static() {
+    constexpr auto f = ct::parse<"sin(x*y) + exp(x)/y^2 - ln(y)*cos(x) + 0.5">();
+    static_assert(std::is_empty_v<decltype(f)>);
+    static_assert(f.variables().size == 2 && f.variables().names[0] == "x" && f.variables().names[1] == "y");
+    Expression<double> runtime = f.to_expression<double>();
+    std::map<std::string, double> point = {{"x", 0.3}, {"y", 1.7}};
+    assert(f(0.3, 1.7) == runtime.eval(point));
+
+    // Same grouping as polish_order: equal priorities group to the right.
+    constexpr auto g = ct::parse<"a-b-c">();
+    static_assert(g(10, 4, 3) == 9);
+    static_assert(ct::parse<"2*3+8/2/2">()() == 14.0);
+
+    // The compile-time derivative builds the same tree as Expression::diff.
+    constexpr auto dfdy = ct::diff<"y">(f);
+    assert(dfdy.to_expression<double>().node() == runtime.diff("y").node());
+    assert(dfdy(0.3, 1.7) == runtime.diff("y").eval(point));
+    static_assert(std::is_same_v<decltype(ct::diff<"z">(f)), ct::Constant<0.0>>);
+
+    // Expression templates mix with run-time literals.
+    constexpr auto x = ct::var<"x">;
+    constexpr auto y = ct::var<"y">;
+    auto h = sin(x * y) * 2.5 + (x ^ 3.0) / y;
+    assert(h(0.3, 1.7) == (sin(Expression<double>("x") * Expression<double>("y")) * Expression<double>(2.5)
+                           + (Expression<double>("x") ^ Expression<double>(3.0)) / Expression<double>("y")).eval(point));
+    auto dh = ct::diff<"x">(h);
+    assert(std::abs(dh(0.3, 1.7) - (std::cos(0.3 * 1.7) * 1.7 * 2.5 + 3 * 0.09 / 1.7)) < 1e-12);
+
+    using Complex = std::complex<double>;
+    constexpr auto c = ct::parse<"exp(z*2i)+z">();
+    Complex z(0.4, -0.3);
+    assert(std::abs(c(z) - (std::exp(z * Complex(0, 2)) + z)) < 1e-15);
+    std::cout << "test_static: OK" << std::endl;
+}
+
+void test_parse() {
+    auto f = parse<double>("sin(x*y) + exp(x)/y^2 - ln(y)*cos(x) + 1.5e-1");
+    Expression<double> x("x");
+    Expression<double> y("y");
+    auto expected = sin(x * y) + (exp(x) / (y ^ Expression<double>(2.0)) - (ln(y) * cos(x) + Expression<double>(0.15)));
+    assert(f.node() == expected.node());
+
+    // Priorities and grouping of polish_order: a-b-c is a-(b-c), functions
+    // bind tighter than ^.
+    assert(parse<double>("a-b-c").to_string() == "(a-(b-c))");
+    assert(parse<double>("sin x^2").to_string() == "(sin(x)^2.000000)");
+    assert(parse<double>("2*3+8/2/2").eval({}) == 14.0);
+
+    // Unary minus binds looser than ^ and folds into constants.
+    assert(parse<double>("-x^2").eval({{"x", 3.0}}) == -9.0);
+    assert(parse<double>("2*-3").to_string() == "(2.000000*-3.000000)");
+    assert(parse<double>("1E3 - .5e+1 * 2.").eval({}) == 990.0);
+
+    using Complex = std::complex<double>;
+    assert(has_imaginary_literal("exp(2i*z)") && !has_imaginary_literal("pi*x"));
+    assert(parse<Complex>("2.5i*z").eval({{"z", Complex(0, 1)}}) == Complex(-2.5, 0));
+
+    auto offset = [](const char* input) {
+        try {
+            parse<double>(input);
+        } catch (const ParseError& e) {
+            return e.offset();
+        }
+        return std::size_t(-1);
+    };
+    assert(offset("x + * y") == 4);
+    assert(offset("(x + y") == 0);
+    assert(offset("x + y)") == 5);
+    assert(offset("x + 2i") == 4);
+    assert(offset("x # y") == 2);
+    assert(offset("x +") == 3);
+
+    // Long chains and deep nesting do not recurse in the parser.
+    std::string chain = "x";
+    for (int i = 0; i < 100000; i++) {
+        chain += "+x";
+    }
+    std::string nested = std::string(100000, '(') + "x" + std::string(100000, ')');
+    assert(parse<double>(chain).eval({{"x", 1.0}}) == 100001.0);
+    assert(parse<double>(nested).node() == x.node());
+    std::cout << "test_parse: OK" << std::endl;
+}
+
+// Runs eval_stream over `input` with a small buffer and chunk, so records
+// straddle buffer refills and chunk boundaries.
+template <typename T>
+std::string run_stream(const std::string& formula, const std::string& input, ThreadPool* pool = nullptr) {
+    std::FILE* in = std::tmpfile();
+    std::FILE* out = std::tmpfile();
+    std::fwrite(input.data(), 1, input.size(), in);
+    std::rewind(in);
+    RecordReader reader(in, 16);
+    std::vector<std::string_view> fields;
+    reader.next(fields);
+    std::vector<std::string> header(fields.begin(), fields.end());
+    eval_stream(parse<T>(formula).compile(), header, reader, out, 3, pool);
+    std::string result(std::ftell(out), '\0');
+    std::rewind(out);
+    std::size_t read = std::fread(result.data(), 1, result.size(), out);
+    assert(read == result.size());
+    std::fclose(in);
+    std::fclose(out);
+    return result;
+}
+
+void test_stream() {
+    std::string csv = "x,unused,y\n1,zzz,2\r\n0.5,,4\n\n-3, 7 ,1e1\n2.5,0,0.1\n1,1,1";
+    assert(run_stream<double>("x*y+1", csv) == "3\n3\n-29\n1.25\n2\n");
+    assert(run_stream<double>("x/y", "x\ty\n1\t3\n") == "0.3333333333333333\n");
+
+    using Complex = std::complex<double>;
+    assert(run_stream<Complex>("z*w", "z,w\n1+2i,3\n2i,-1-i\n4,-0.5i\n") == "3+6i\n2-2i\n0-2i\n");
+    char field[stream_field_width];
+    auto written = [&](Complex value) {
+        return std::string(field, write_field(field, field + sizeof(field), value));
+    };
+    assert(written(Complex(1, std::nan(""))) == "1+nani" && written(Complex(1, -std::nan(""))) == "1-nani");
+    Complex nan_imaginary;
+    assert(read_complex("1-nani", nan_imaginary) && nan_imaginary.real() == 1 && std::isnan(nan_imaginary.imag()));
+
+    auto error = [](const std::string& formula, const std::string& input) {
+        try {
+            run_stream<double>(formula, input);
+        } catch (const std::runtime_error& e) {
+            return std::string(e.what());
+        }
+        return std::string();
+    };
+    assert(error("x", "x\n1\nfoo\n") == "Malformed value 'foo' at line 3");
+    assert(error("x", "x\n1\n2i\n") == "Complex value '2i' in a real stream at line 3");
+    assert(error("x+y", "x,y\n1\n") == "Expected 2 fields at line 2, got 1");
+    assert(error("x+q", "x,y\n1,2\n") == "Variable not found in header: q");
+    std::cout << "test_stream: OK" << std::endl;
+}
+
+void test_thread_pool() {
+    ThreadPool pool(4);
+    assert(pool.size() == 4);
+    // Uneven work: every index still runs exactly once.
+    std::vector<std::atomic<int>> visits(10007);
+    pool.parallel_for(visits.size(), 7, [&](std::size_t begin, std::size_t end, std::size_t worker) {
+        assert(worker < 4 && begin % 7 == 0 && (end - begin == 7 || end == visits.size()));
+        for (std::size_t i = begin; i < end; i++) {
+            if (i % 1000 == 0) {
+                std::this_thread::sleep_for(std::chrono::microseconds(200));
+            }
+            visits[i]++;
+        }
+    });
+    assert(std::all_of(visits.begin(), visits.end(), [](const std::atomic<int>& v) { return v == 1; }));
+    bool thrown = false;
+    try {
+        pool.parallel_for(1000, 10, [](std::size_t begin, std::size_t, std::size_t) {
+            if (begin == 500) {
+                throw std::runtime_error("piece 500");
+            }
+        });
+    } catch (const std::runtime_error& e) {
+        thrown = std::string(e.what()) == "piece 500";
+    }
+    assert(thrown);
+
+    Expression<double> x("x");
+    Expression<double> y("y");
+    Expression<double> f = sin(x * y) + exp(x) / y - ln(y) * cos(x);
+    std::size_t rows = 100003;
+    std::vector<double> xs(rows), ys(rows), serial(rows), parallel(rows);
+    for (std::size_t i = 0; i < rows; i++) {
+        xs[i] = 0.001 * (i % 4000);
+        ys[i] = 1.0 + 0.0005 * (i % 3001);
+    }
+    auto program = f.compile();
+    auto columns = program.bind_columns({{"x", xs}, {"y", ys}}, rows);
+    program.eval_batch(columns, serial);
+    program.eval_batch(columns, parallel, pool);
+    assert(serial == parallel);
+    // Out-of-range lanes send their whole vector to libm, so the result of
+    // a row depends on its neighbours: pieces must not move with the
+    // thread count.
+    Expression<double> g = sin(x) + exp(x);
+    auto wide = g.compile();
+    std::vector<double> zs(100000);
+    for (std::size_t i = 0; i < zs.size(); i++) {
+        zs[i] = i % 97 == 0 ? 2e5 + i : 0.0001 * i;
+    }
+    std::vector<double> expected(zs.size()), actual(zs.size());
+    auto z_columns = wide.bind_columns({{"x", zs}}, zs.size());
+    wide.eval_batch(z_columns, expected);
+    for (std::size_t threads : {2, 3, 7}) {
+        ThreadPool odd(threads);
+        wide.eval_batch(z_columns, actual, odd);
+        assert(actual == expected);
+    }
+
+    std::string csv = "x,y\n";
+    for (int i = 0; i < 2000; i++) {
+        csv += std::to_string(0.01 * i) + "," + std::to_string(1 + i % 17) + (i % 100 == 0 ? "\n\n" : "\n");
+    }
+    assert(run_stream<double>("x*y-ln(y)", csv, &pool) == run_stream<double>("x*y-ln(y)", csv));
+    std::cout << "test_thread_pool: OK" << std::endl;
+}
+
+template <typename T>
+void write_column(const std::filesystem::path& path, const std::vector<T>& values) {
+    std::ofstream file(path, std::ios::binary);
+    file.write(reinterpret_cast<const char*>(values.data()), values.size() * sizeof(T));
+}
+
+template <typename T>
+std::vector<T> read_column(const std::filesystem::path& path) {
+    std::vector<T> values(std::filesystem::file_size(path) / sizeof(T));
+    std::ifstream file(path, std::ios::binary);
+    file.read(reinterpret_cast<char*>(values.data()), values.size() * sizeof(T));
+    return values;
+}
+
+void test_mapped() {
+    std::filesystem::path dir = "tests/mapped_columns";
+    std::filesystem::create_directories(dir);
+    // Not a whole number of chunks or pages.
+    std::size_t rows = 70001;
+    std::vector<double> xs(rows), ys(rows), expected(rows);
+    for (std::size_t i = 0; i < rows; i++) {
+        xs[i] = 0.001 * (i % 4000);
+        ys[i] = 1.0 + 0.0005 * (i % 3001);
+    }
+    write_column(dir / "x.bin", xs);
+    write_column(dir / "y.bin", ys);
+    Expression<double> x("x");
+    Expression<double> y("y");
+    auto program = (sin(x * y) + exp(x) / y).compile();
+    program.eval_batch(program.bind_columns({{"x", xs}, {"y", ys}}, rows), expected);
+    std::map<std::string, std::string> columns = {{"x", (dir / "x.bin").string()}, {"y", (dir / "y.bin").string()}};
+    assert(eval_columns(program, columns, (dir / "out.bin").string(), nullptr, 4096) == rows);
+    assert(read_column<double>(dir / "out.bin") == expected);
+    ThreadPool pool(3);
+    eval_columns(program, columns, (dir / "out.bin").string(), &pool, 4096);
+    assert(read_column<double>(dir / "out.bin") == expected);
+
+    using C = std::complex<double>;
+    std::vector<C> zs(rows), complex_expected(rows);
+    for (std::size_t i = 0; i < rows; i++) {
+        zs[i] = C(0.001 * (i % 977), -0.002 * (i % 131));
+    }
+    write_column(dir / "z.bin", zs);
+    Expression<C> z("z");
+    auto complex_program = (z * z + exp(z)).compile();
+    complex_program.eval_batch(complex_program.bind_columns({{"z", zs}}, rows), complex_expected);
+    eval_columns(complex_program, {{"z", (dir / "z.bin").string()}}, (dir / "out.bin").string());
+    assert(read_column<C>(dir / "out.bin") == complex_expected);
+
+    // Columns of different lengths are rejected.
+    write_column(dir / "y.bin", std::vector<double>(rows - 1));
+    bool thrown = false;
+    try {
+        eval_columns(program, columns, (dir / "out.bin").string());
+    } catch (const std::runtime_error&) {
+        thrown = true;
+    }
+    assert(thrown);
+    std::filesystem::remove_all(dir);
+    std::cout << "test_mapped: OK" << std::endl;
+}
+
+void test_serialize() {
+    Expression<double> x("x");
+    Expression<double> y("y");
+    // 0.1 has no short exact decimal form; the image keeps every bit.
+    Expression<double> f = sin(x * y) * Expression<double>(0.1) + exp(x) / y - (ln(y) ^ Expression<double>(1.0 / 3));
+    Expression<double> df = f.diff("x");
+    std::vector<std::byte> bytes = serialize(df);
+
+    std::filesystem::path path = "tests/serialized.bin";
+    {
+        std::ofstream file(path, std::ios::binary);
+        file.write(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+    }
+    MappedFile mapped = MappedFile::open(path.string());
+    auto loaded = SerializedExpression<double>::load({mapped.data(), mapped.size()});
+    assert(loaded.variable_count() == 2);
+    std::vector<double> values(2);
+    values[loaded.slot("x")] = 0.7;
+    values[loaded.slot("y")] = 1.3;
+    assert(loaded.slot("z") == 2);
+    double expected = df.eval({{"x", 0.7}, {"y", 1.3}});
+    assert(loaded.eval(values) == expected);
+    assert(loaded.program().eval(values) == expected);
+    assert(loaded.expression().node() == df.node());
+    std::filesystem::remove(path);
+
+    using C = std::complex<double>;
+    Expression<C> z("z");
+    Expression<C> g = exp(z * Expression<C>(C(0.1, -0.2))) + cos(z);
+    std::vector<std::byte> complex_bytes = serialize(g);
+    auto complex_loaded = SerializedExpression<C>::load(complex_bytes);
+    assert(complex_loaded.eval(std::vector<C>{C(0.5, 0.25)}) == g.eval({{"z", C(0.5, 0.25)}}));
+
+    auto rejected = [](std::span<const std::byte> image) {
+        try {
+            SerializedExpression<double>::load(image);
+        } catch (const std::runtime_error&) {
+            return true;
+        }
+        return false;
+    };
+    assert(rejected(complex_bytes));
+    assert(rejected(std::span<const std::byte>(bytes).first(bytes.size() - 1)));
+    // A child index pointing at a later node.
+    std::vector<std::byte> corrupt = bytes;
+    SerialNode root;
+    std::size_t root_offset = sizeof(SerialHeader) + (loaded.size() - 1) * sizeof(SerialNode);
+    std::memcpy(&root, corrupt.data() + root_offset, sizeof(root));
+    root.a = static_cast<std::uint32_t>(loaded.size());
+    std::memcpy(corrupt.data() + root_offset, &root, sizeof(root));
+    assert(rejected(corrupt));
+    std::cout << "test_serialize: OK" << std::endl;
+}
+
+void test_incremental() {
+    // f = sum_i sin(x_i * y) + x_i^2 summed as a balanced tree: each x_i
+    // reaches the root through its own term and log n additions, y through
+    // every term.
+    std::size_t n = 64;
+    Expression<double> y("y");
+    std::vector<Expression<double>> terms;
+    std::map<std::string, double> context = {{"y", 0.5}};
+    for (std::size_t i = 0; i < n; i++) {
+        Expression<double> x("x" + std::to_string(i));
+        terms.push_back(sin(x * y) + (x ^ Expression<double>(2.0)));
+        context["x" + std::to_string(i)] = 0.01 * i;
+    }
+    while (terms.size() > 1) {
+        std::vector<Expression<double>> sums;
+        for (std::size_t i = 0; i < terms.size(); i += 2) {
+            sums.push_back(terms[i] + terms[i + 1]);
+        }
+        terms = sums;
+    }
+    Expression<double> f = terms[0];
+    auto program = f.compile();
+    IncrementalEvaluator<double> evaluator(program, context);
+    assert(evaluator.value() == f.eval(context));
+    assert(evaluator.recomputed() == 0);
+
+    evaluator.set("x7", 2.5);
+    context["x7"] = 2.5;
+    assert(std::abs(evaluator.value() - f.eval(context)) < 1e-12);
+    std::size_t one = evaluator.recomputed();
+    // x7, x7 * y, sin, ^2, the term's + and 6 levels of the sum.
+    assert(one == 11);
+
+    evaluator.set("x3", -1.0);
+    evaluator.set("x40", 4.0);
+    context["x3"] = -1.0;
+    context["x40"] = 4.0;
+    assert(std::abs(evaluator.value() - f.eval(context)) < 1e-12);
+    assert(evaluator.recomputed() == 2 * one - 1);
+
+    evaluator.set("y", 1.5);
+    context["y"] = 1.5;
+    assert(std::abs(evaluator.value() - f.eval(context)) < 1e-12);
+    assert(evaluator.recomputed() > program.ssa().size() / 2);
+
+    // An unchanged value stops at the variable.
+    evaluator.set("x7", 2.5);
+    evaluator.value();
+    assert(evaluator.recomputed() == 1);
+
+    // x*y going from +0 to -0 compares equal but flips the sign of 1/(x*y).
+    Expression<double> a("a");
+    Expression<double> b("b");
+    Expression<double> inverse = Expression<double>(1.0) / (a * b);
+    IncrementalEvaluator<double> signs(inverse.compile(), {{"a", 1.0}, {"b", 0.0}});
+    assert(signs.value() == std::numeric_limits<double>::infinity());
+    signs.set("a", -1.0);
+    assert(signs.value() == inverse.eval({{"a", -1.0}, {"b", 0.0}}));
+    assert(signs.value() == -std::numeric_limits<double>::infinity());
+    std::cout << "test_incremental: OK" << std::endl;
+}
+
+void test_profile() {
+    Expression<double> x("x");
+    Expression<double> y("y");
+    Expression<double> s = sin(x * y);
+    Expression<double> f = s * s + x;
+    ExpressionShape shape = f.shape();
+    assert(shape.depth == 5);
+    assert(shape.unique_nodes == 6);
+    assert(shape.total_nodes == 11);
+
+    profile_reset();
+    {
+        // Scopes work with or without the hooks; the nested Diff scope
+        // inside diff() must not count a second call.
+        ProfileScope scope(ProfilePhase::Diff);
+        f.diff("x");
+    }
+    f.eval({{"x", 0.5}, {"y", 2.0}});
+    ProfileStats stats = profile_stats();
+    std::size_t diff = static_cast<std::size_t>(ProfilePhase::Diff);
+    assert(stats.phase_calls[diff] == 1);
+    if (profiling_enabled()) {
+        assert(stats.phase_allocations[diff] > 0);
+        assert(stats.phase_calls[static_cast<std::size_t>(ProfilePhase::Eval)] == 1);
+        assert(stats.visits[static_cast<std::size_t>(OpCode::Sin)] == 1);
+    } else {
+        assert(stats.phase_allocations[diff] == 0);
+        assert(stats.visits[static_cast<std::size_t>(OpCode::Sin)] == 0);
+    }
+    stats.shape = shape;
+    assert(profile_report(stats).find("unique nodes 6") != std::string::npos);
+    profile_reset();
+    assert(profile_stats().phase_calls[diff] == 0);
+    std::cout << "test_profile: OK" << std::endl;
+}
+
+void test_write() {
+    WriteOptions plain{OutputFormat::Infix, true, true, false};
+    // Minimal parentheses still read back to the same interned tree.
+    for (const char* formula : {"a-b-c", "(a-b)-c", "x^y^z", "(x^y)^z", "2*-3+x/(y*z)", "(a+b)/(c-d)^2",
+                                "sin(x)^2-ln(y/2)", "-x^2*y"}) {
+        Expression<double> f = parse<double>(formula);
+        assert(parse<double>(f.to_string(plain)).node() == f.node());
+    }
+    assert(parse<double>("(a-b)-c").to_string(plain) == "(a-b)-c");
+    assert(parse<double>("a-(b-c)").to_string(plain) == "a-b-c");
+    assert(parse<double>("a*(-2)").to_string(plain) == "a*(-2)");
+
+    // Exact numbers survive the round trip bit for bit.
+    Expression<double> x("x");
+    Expression<double> third = Expression<double>(1.0 / 3) * x + Expression<double>(0.1);
+    assert(third.to_string(plain) == "0.3333333333333333*x+0.1");
+    assert(parse<double>(third.to_string(plain)).node() == third.node());
+    assert(third.to_string() == "((0.333333*x)+0.100000)");
+    // Non-finite constants read back as quotients with the same value
+    // rather than as variables named inf or nan.
+    const double inf = std::numeric_limits<double>::infinity();
+    Expression<double> huge = x * Expression<double>(inf) - Expression<double>(-inf) + Expression<double>(std::nan(""));
+    assert(huge.to_string(plain) == "(x*(1/0)-(-1/0))+(0/0)");
+    Expression<double> back = parse<double>(huge.to_string(plain));
+    assert(back.compile().variables().size() == 1);
+    assert(parse<double>("x*(1/0)").eval({{"x", 2.0}}) == inf && std::isnan(back.eval({{"x", 2.0}})));
+    bool rejected = false;
+    try {
+        Expression<std::complex<double>>(std::complex<double>(inf, 1.0)).to_string(plain);
+    } catch (const std::runtime_error&) {
+        rejected = true;
+    }
+    assert(rejected);
+
+    Expression<double> f = parse<double>("(a+b)/(c-d)^2 - (x-y-z)");
+    assert(f.to_string({OutputFormat::C}) == "(a + b) / pow(c - d, 2.0) - (x - (y - z))");
+    assert(f.to_string({OutputFormat::LaTeX}) ==
+           "\\frac{a + b}{{\\left(c - d\\right)}^{2}} - \\left(x - \\left(y - z\\right)\\right)");
+    using C = std::complex<double>;
+    Expression<C> z("z");
+    Expression<C> g = Expression<C>(C(1, -2)) * ln(z);
+    assert(g.to_string({OutputFormat::C}) == "CMPLX(1.0, -2.0) * clog(z)");
+    assert(g.to_string(plain) == "(1-2i)*ln(z)");
+
+    // Shared subtrees are bound once. Squaring 64 times would expand to
+    // 2^64 copies of x; with bindings the output has one line per level.
+    Expression<double> square = sin(x);
+    for (int i = 0; i < 64; i++) {
+        square = square * square;
+    }
+    std::string shared = square.to_string(WriteOptions{});
+    assert(std::count(shared.begin(), shared.end(), '\n') == 64);
+    assert(shared.rfind("let t0 = sin(x)\nlet t1 = t0*t0\n", 0) == 0);
+    assert(shared.substr(shared.rfind('\n') + 1) == "t63*t63");
+    std::string c_source = square.to_string({OutputFormat::C});
+    assert(c_source.rfind("const double t0 = sin(x);\n", 0) == 0);
+    assert(c_source.substr(c_source.rfind('\n') + 1) == "return t63 * t63;");
+    // A variable named like a binding pushes the names along.
+    Expression<double> t0("t0");
+    Expression<double> s = sin(t0);
+    assert((s * s).to_string(WriteOptions{}) == "let t1 = sin(t0)\nt1*t1");
+
+    // Streaming gives the same text, also for deep chains.
+    Expression<double> chain = x;
+    for (int i = 0; i < 100000; i++) {
+        chain = (i % 2 ? x : Expression<double>(2.0)) - chain;
+    }
+    std::ostringstream out;
+    chain.write(out, plain);
+    assert(out.str() == chain.to_string(plain));
+    assert(out.str().size() == 2 * 100000 + 1);
+    std::cout << "test_write: OK" << std::endl;
+}
+
+// Trees far deeper than a recursive walk could go on the call stack.
+void test_deep_expressions() {
+    const int depth = 100000;
+    std::size_t before = interned_nodes<double>();
+    {
+        // ((x + x)*y + x)*y ... with one operation per level.
+        Expression<double> x("x");
+        Expression<double> y("y");
+        Expression<double> f = x;
+        for (int i = 0; i < depth; i++) {
+            f = i % 2 ? f * y : f + x;
+        }
+        EvalContext<double> ones = {{"x", 1.0}, {"y", 1.0}};
+        const double value = depth / 2 + 1;
+        assert(f.eval(ones) == value);
+        assert(f.to_string().size() == 4 * std::size_t(depth) + 1);
+        assert(f.diff("x").eval(ones) == value);
+        assert(f.substitute({{"y", 1.0}}).eval({{"x", 1.0}}) == value);
+        assert(f.substitute(ones).node() == Expression<double>(value).node());
+        assert(f.simplify().eval(ones) == value);
+        Program<double> program = f.compile();
+        std::vector<double> values(program.variables().size(), 1.0);
+        assert(program.eval(values) == value);
+    }
+    // Dropping the last reference frees the whole chain.
+    assert(interned_nodes<double>() == before);
+    std::cout << "test_deep_expressions: OK" << std::endl;
+}
+
 int main() {
     test_value();
     test_variable();
@@ -74,8 +1122,31 @@ int main() {
     test_unary_operators();
     test_to_string();
     test_diff();
+    test_eval_context();
     test_substitute();
     test_complex();
+    test_compile();
+    test_eval_batch();
+    test_complex_batch();
+    test_hash_consing();
+    test_node_dispatch();
+    test_simplify();
+    test_gradient();
+    test_taylor();
+    test_arena();
+    test_hessian();
+    test_sparse();
+    test_native();
+    test_static();
+    test_parse();
+    test_stream();
+    test_thread_pool();
+    test_mapped();
+    test_serialize();
+    test_incremental();
+    test_profile();
+    test_write();
+    test_deep_expressions();
     
 
     return 0;